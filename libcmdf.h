@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <time.h>
 
 #ifdef _WIN32
     #include <windows.h>
@@ -60,6 +62,103 @@
     #endif
 #endif
 
+/* Built-in line editor (Unix/Linux only), for line editing without GNU Readline.
+ * Readline is used instead if both are enabled. */
+#if defined(_WIN32) || defined(CMDF_READLINE_SUPPORT)
+    #ifdef CMDF_LINEEDIT_SUPPORT
+        #undef CMDF_LINEEDIT_SUPPORT
+    #endif
+#else
+    #ifdef CMDF_LINEEDIT_SUPPORT
+        #include <errno.h>
+        #include <unistd.h>
+        #include <fcntl.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+    #endif
+#endif
+
+/* Number of lines kept in the line editor's history. They're all the searches scan. */
+#ifndef CMDF_HISTORY_SIZE
+    #define CMDF_HISTORY_SIZE 100
+#endif
+
+/* Size in bytes past which a history file is rewritten with just its latest lines on load */
+#ifndef CMDF_HISTORY_FILE_SIZE
+    #define CMDF_HISTORY_FILE_SIZE 65536
+#endif
+
+/* Background job support through a worker thread pool (Unix/Linux only) */
+#ifdef _WIN32
+    #ifdef CMDF_THREAD_SUPPORT
+        #undef CMDF_THREAD_SUPPORT
+    #endif
+#else
+    #ifdef CMDF_THREAD_SUPPORT
+        #include <pthread.h>
+    #endif
+#endif
+
+/* Number of worker threads running background jobs */
+#ifndef CMDF_WORKER_THREADS
+    #define CMDF_WORKER_THREADS 2
+#endif
+
+/* Maximum number of background jobs, either queued, running or unreported */
+#ifndef CMDF_MAX_JOBS
+    #define CMDF_MAX_JOBS 16
+#endif
+
+/* Unix domain socket server support (Linux only, as it requires epoll) */
+#ifndef __linux__
+    #ifdef CMDF_SERVER_SUPPORT
+        #undef CMDF_SERVER_SUPPORT
+    #endif
+#else
+    #ifdef CMDF_SERVER_SUPPORT
+        #include <errno.h>
+        #include <unistd.h>
+        #include <fcntl.h>
+        #include <sys/socket.h>
+        #include <sys/un.h>
+        #include <sys/epoll.h>
+    #endif
+#endif
+
+/* Maximum number of concurrent server sessions */
+#ifndef CMDF_MAX_SESSIONS
+    #define CMDF_MAX_SESSIONS 16
+#endif
+
+/* Most output a server session may have waiting for its client to read, before it's ended */
+#ifndef CMDF_MAX_SESSION_OUTPUT
+    #define CMDF_MAX_SESSION_OUTPUT (1024 * 1024)
+#endif
+
+/* C++20 coroutine commands (C++20 on Unix/Linux only, as it relies on poll()) */
+#if !defined(__cplusplus) || !defined(__cpp_impl_coroutine) || defined(_WIN32)
+    #ifdef CMDF_COROUTINE_SUPPORT
+        #undef CMDF_COROUTINE_SUPPORT
+    #endif
+#endif
+
+/* Thread-local storage class, so every thread has an active interpreter context of its own */
+#ifndef CMDF_THREAD_LOCAL
+    #if defined(_MSC_VER)
+        #define CMDF_THREAD_LOCAL __declspec(thread)
+    #elif defined(__GNUC__) || defined(__clang__)
+        #define CMDF_THREAD_LOCAL __thread
+    #else
+        #define CMDF_THREAD_LOCAL
+    #endif
+#endif
+
+/* vsnprintf() is standard since C99 and C++11. Without it, formatted output isn't buffered. */
+#if (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L) || \
+    (defined(__cplusplus) && __cplusplus >= 201103L) || (defined(_MSC_VER) && _MSC_VER >= 1900)
+    #define CMDF__HAVE_VSNPRINTF
+#endif
+
 /* fgets()-like function to use for input handling */
 #ifndef CMDF_FGETS
     #define CMDF_FGETS fgets
@@ -80,6 +179,11 @@
     #define CMDF_MAX_INPUT_BUFFER_LENGTH 256
 #endif
 
+/* Size of the buffer every context collects library output in */
+#ifndef CMDF_OUTPUT_BUFFER_SIZE
+    #define CMDF_OUTPUT_BUFFER_SIZE 4096
+#endif
+
 /* STDIN and STDOUT */
 #ifndef CMDF_STDIN
     #define CMDF_STDIN stdin
@@ -93,6 +197,7 @@
 
 /* Error codes (for CMDF_RETURN) */
 #define CMDF_OK							 1
+#define CMDF_EXITED                      0      /* Returned by cmdf_feed() once the loop exited */
 #define CMDF_ERROR_TOO_MANY_COMMANDS    -1
 #define CMDF_ERROR_TOO_MANY_ARGS        -2
 #define CMDF_ERROR_UNKNOWN_COMMAND      -3
@@ -102,6 +207,28 @@
 /* Max processes count reached */
 #define CMDF_ERROR_OUT_OF_PROCESS_STACK -6
 
+/* Background job table is full, or the worker pool could not be started */
+#define CMDF_ERROR_TOO_MANY_JOBS        -7
+
+/* A system call failed; errno tells why */
+#define CMDF_ERROR_SYSTEM               -8
+
+/* Commands can't be added to a frozen catalog, or to a menu using one */
+#define CMDF_ERROR_CATALOG_FROZEN       -9
+
+/* The command was cancelled, by Ctrl-C or otherwise */
+#define CMDF_ERROR_CANCELLED            -10
+
+/* The command ran past its time limit */
+#define CMDF_ERROR_TIMED_OUT            -11
+
+/* Command flags (for cmdf_register_command_ex) */
+#define CMDF_COMMAND_ASYNC              0x1     /* Always run in the background */
+
+/* Output formats (for cmdf_set_output_format) */
+#define CMDF_OUTPUT_TEXT                0       /* Text for people to read */
+#define CMDF_OUTPUT_JSON                1       /* A JSON object per line, for programs */
+
 /* =================================================================================== */
 
 #ifdef __cplusplus
@@ -117,6 +244,31 @@ struct cmdf_windowsize {
     #endif
 };
 
+/* Per-command statistics, as returned by cmdf_get_command_stats() */
+struct cmdf_command_stats {
+    unsigned long calls;                        /* Times the command ran */
+    unsigned long cancellations;                /* Times it was cancelled or timed out */
+    unsigned long overruns;                     /* Times it ran past its time limit */
+    unsigned long total_ms, max_ms;             /* Total and longest run time */
+};
+
+/*
+ * I/O backend of a context, for cmdf_set_io(). Functions left NULL fall back to reading
+ * with CMDF_FGETS from CMDF_STDIN, and to writing to the output stream.
+ */
+struct cmdf_io {
+    void *data;                                 /* Passed to every function */
+
+    /* Read a line into buff, like fgets(). Returns NULL at EOF. */
+    char *(* read_line)(void *data, char *buff, size_t size);
+
+    /* Write out len bytes of output. Returns how many were written, or 0 on failure. */
+    size_t (* write)(void *data, const char *buff, size_t len);
+
+    /* Flush written output, once per command or prompt */
+    void (* flush)(void *data);
+};
+
 /* libcmdf command list and arglist */
 typedef struct cmdf___arglist_s {
     char **args;                /* NULL-terminated string list */
@@ -127,11 +279,21 @@ typedef struct cmdf___arglist_s {
 typedef int CMDF_RETURN;
 typedef CMDF_RETURN (* cmdf_command_callback)(cmdf_arglist *arglist);
 
+/* Argument completion typedefs. A completer adds the candidates for the given argument
+ * position (from 0) with cmdf_add_completion(). */
+typedef struct cmdf__completions_s cmdf_completions;
+typedef void (* cmdf_completer_callback)(cmdf_completions *completions, size_t argindex);
+
+/* Interpreter context typedef */
+typedef struct cmdf__context_s cmdf_context;
+
+/* Command catalog typedef */
+typedef struct cmdf__catalog_s cmdf_catalog;
+
 /* Utility Functions */
 char *cmdf__strdup(const char *src);
 void cmdf__trim(char *src);
 void cmdf__print_title(const char *title, char ruler);
-void cmdf__pprint(size_t loffset, const char * const strtoprint);
 void cmdf__print_command_list();
 
 /* Init/Free functions */
@@ -140,8 +302,54 @@ void cmdf_init(const char *prompt, const char *intro, const char *doc_header,
 #define cmdf_init_quick() cmdf_init(NULL, NULL, NULL, NULL, 0, 1)
 #define cmdf_quit ;
 
+/* Context functions */
+cmdf_context *cmdf_context_create(void);
+void cmdf_context_destroy(cmdf_context *ctx);
+cmdf_context *cmdf_get_context(void);
+void cmdf_set_context(cmdf_context *ctx);
+void cmdf_init_ctx(cmdf_context *ctx, const char *prompt, const char *intro, const char *doc_header,
+                   const char *undoc_header, char ruler, int use_default_exit);
+
+/* Command catalog functions */
+cmdf_catalog *cmdf_catalog_create(int use_default_exit);
+void cmdf_catalog_destroy(cmdf_catalog *catalog);
+CMDF_RETURN cmdf_catalog_register_command(cmdf_catalog *catalog, cmdf_command_callback callback,
+                                          const char *cmdname, const char *help, int flags);
+void cmdf_catalog_freeze(cmdf_catalog *catalog);
+CMDF_RETURN cmdf_init_catalog(cmdf_context *ctx, const cmdf_catalog *catalog, const char *prompt,
+                              const char *intro, const char *doc_header, const char *undoc_header,
+                              char ruler);
+
 /* Public interface functions */
 void cmdf_commandloop(void);
+void cmdf_commandloop_ctx(cmdf_context *ctx);
+size_t cmdf_exec_batch(const char *const *lines, size_t n, CMDF_RETURN *results);
+size_t cmdf_exec_batch_ctx(cmdf_context *ctx, const char *const *lines, size_t n,
+                           CMDF_RETURN *results);
+
+/* Event loop interface functions */
+void cmdf_feed_begin(void);
+void cmdf_feed_begin_ctx(cmdf_context *ctx);
+CMDF_RETURN cmdf_feed(const char *bytes, size_t len);
+CMDF_RETURN cmdf_feed_ctx(cmdf_context *ctx, const char *bytes, size_t len);
+int cmdf_get_input_fd(void);
+void cmdf_print_async(const char *format, ...);
+#ifdef CMDF_THREAD_SUPPORT
+    void cmdf_feed_jobs(void);
+#endif
+
+/* Cancellation */
+int cmdf_cancelled(void);
+
+/* Command time limits and statistics */
+CMDF_RETURN cmdf_set_command_timeout(const char *cmdname, unsigned int seconds);
+CMDF_RETURN cmdf_get_command_stats(const char *cmdname, struct cmdf_command_stats *stats);
+
+/* Argument completion */
+CMDF_RETURN cmdf_set_command_completer(const char *cmdname, cmdf_completer_callback completer,
+                                       unsigned int ttl);
+CMDF_RETURN cmdf_add_completion(cmdf_completions *completions, const char *candidate);
+CMDF_RETURN cmdf_invalidate_completions(const char *cmdname);
 
 /* Getters */
 const char *cmdf_get_prompt(void);
@@ -150,12 +358,23 @@ const char *cmdf_get_doc_header(void);
 const char *cmdf_get_undoc_header(void);
 char cmdf_get_ruler(void);
 int cmdf_get_command_count(void);
+FILE *cmdf_get_output(void);
+int cmdf_get_output_format(void);
 
 /* Setters */
 void cmdf_set_prompt(const char *new_prompt);
 void cmdf_set_intro(const char *new_intro);
 void cmdf_set_doc_header(const char *new_doc_header);
 void cmdf_set_undoc_header(const char *new_undoc_header);
+void cmdf_set_output(FILE *new_output);
+CMDF_RETURN cmdf_set_output_format(int format);
+CMDF_RETURN cmdf_set_io(const struct cmdf_io *io);
+
+/* Structured output */
+void cmdf_record_begin(const char *type);
+void cmdf_record_string(const char *key, const char *value);
+void cmdf_record_number(const char *key, long value);
+void cmdf_record_end(void);
 
 /* Argument Parsing */
 cmdf_arglist *cmdf_parse_arguments(char *argline);
@@ -164,14 +383,36 @@ void cmdf_free_arglist(cmdf_arglist *arglist);
 /* Adding/Removing Command Entries */
 CMDF_RETURN cmdf_register_command(cmdf_command_callback callback, const char *cmdname, 
                                   const char *help);
+CMDF_RETURN cmdf_register_command_ex(cmdf_command_callback callback, const char *cmdname,
+                                     const char *help, int flags);
+CMDF_RETURN cmdf_register_command_ctx(cmdf_context *ctx, cmdf_command_callback callback,
+                                      const char *cmdname, const char *help, int flags);
 
 /* Default callbacks */
+struct cmdf__entry_s;
 CMDF_RETURN cmdf__default_do_help(cmdf_arglist *arglist);
-CMDF_RETURN cmdf__default_do_command(const char *cmdname, cmdf_arglist *arglist);
+CMDF_RETURN cmdf__default_do_command(const struct cmdf__entry_s *entry, cmdf_arglist *arglist);
 CMDF_RETURN cmdf__default_do_emptyline(cmdf_arglist *arglist /* Unused */);
 CMDF_RETURN cmdf__default_do_exit(cmdf_arglist *arglist /* Unused */);
 CMDF_RETURN cmdf__default_do_noop(cmdf_arglist *arglist /* Unused */);
-void cmdf__default_commandloop(void);
+void cmdf__default_commandloop(cmdf_context *ctx);
+
+/* Background job callbacks.
+ * Compiled only if thread support is enabled */
+#ifdef CMDF_THREAD_SUPPORT
+    CMDF_RETURN cmdf__default_do_jobs(cmdf_arglist *arglist /* Unused */);
+    CMDF_RETURN cmdf__default_do_wait(cmdf_arglist *arglist);
+    CMDF_RETURN cmdf__default_do_kill(cmdf_arglist *arglist);
+    int cmdf__jobs_stop(cmdf_context *ctx);
+    void cmdf__jobs_cancel_all(cmdf_context *ctx);
+    int cmdf__jobs_detach(cmdf_context *ctx, void (*orphaned)(cmdf_context *ctx));
+#endif
+
+/* Help search.
+ * Compiled only if apropos support is enabled */
+#ifdef CMDF_APROPOS_SUPPORT
+    CMDF_RETURN cmdf__default_do_apropos(cmdf_arglist *arglist);
+#endif
 
 /* Utility Functions */
 #ifdef _WIN32
@@ -182,11 +423,46 @@ void cmdf__default_commandloop(void);
     #define cmdf_get_window_size cmdf_get_window_size_unix
 #endif
 
+struct cmdf_windowsize cmdf__window_size(cmdf_context *ctx);
+void cmdf__flush(cmdf_context *ctx);
+
+/* Coroutine commands.
+ * Compiled only if coroutine support is enabled */
+#ifdef CMDF_COROUTINE_SUPPORT
+    void cmdf__coroutines_cancel(cmdf_context *ctx);
+#endif
+
 /* ReadLine-related functions and callbackes.
  * Compiled only if readline is enabled */
 #ifdef CMDF_READLINE_SUPPORT
     char **cmdf__command_name_completion(const char *text, int start, int end);
     char *cmdf__command_name_iter(const char *text, int state);
+    char *cmdf__argument_iter(const char *text, int state);
+    void cmdf__readline_line_handler(char *line);
+    CMDF_RETURN cmdf_feed_readline(void);
+#endif
+
+/* Built-in line editor.
+ * Compiled only if line editor support is enabled */
+#ifdef CMDF_LINEEDIT_SUPPORT
+    CMDF_RETURN cmdf_set_history_file(const char *path);
+    int cmdf__lineedit_read(cmdf_context *ctx, const char *prompt, char *buff, size_t size,
+                            char **block);
+    void cmdf__lineedit_run(cmdf_context *ctx, char *block);
+    void cmdf__history_add(cmdf_context *ctx, const char *line);
+    int cmdf__history_compact(const char *path, int fd, const char *map, const size_t *starts,
+                              const size_t *lens, int found);
+#endif
+
+/* Unix domain socket server.
+ * Compiled only if server support is enabled */
+#ifdef CMDF_SERVER_SUPPORT
+    typedef struct cmdf__server_s cmdf_server;
+
+    cmdf_server *cmdf_server_open(const char *path);
+    int cmdf_server_get_fd(cmdf_server *server);
+    CMDF_RETURN cmdf_server_dispatch(cmdf_server *server, int timeout);
+    void cmdf_server_close(cmdf_server *server);
 #endif
 
 #endif /* LIBCMDF_H_INCLUDE */
@@ -205,6 +481,17 @@ static const char *cmdf__default_doc_header = "Documented Commands:";
 static const char *cmdf__default_undoc_header = "Undocumented Commands:";
 static const char cmdf__default_ruler = '=';
 
+/* Relaxed atomic access to counters and flags shared between threads */
+#ifdef CMDF_THREAD_SUPPORT
+    #define CMDF__RELAXED_LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+    #define CMDF__RELAXED_STORE(var, value) __atomic_store_n(&(var), (value), __ATOMIC_RELAXED)
+    #define CMDF__RELAXED_ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#else
+    #define CMDF__RELAXED_LOAD(var) (var)
+    #define CMDF__RELAXED_STORE(var, value) ((var) = (value))
+    #define CMDF__RELAXED_ADD(var, n) ((var) += (n))
+#endif
+
 /* libcmdf settings */
 struct cmdf__settings_s {
     /* Properties */
@@ -214,682 +501,6600 @@ struct cmdf__settings_s {
     /* Counters */
     int undoc_cmds, doc_cmds, entry_count;
 
-    /* Index in cmdf__entries array from which commands would be active */
+    /* Index in the entries array from which commands would be active */
     int entry_start;
 
+    /* Shared catalog holding the commands instead of the entries array, if any */
+    const struct cmdf__catalog_s *catalog;
+
     /* Flags */
     int exit_flag;
 
     /* Callback pointers */
     cmdf_command_callback do_emptyline;
-    CMDF_RETURN (* do_command)(const char *, cmdf_arglist *);
+    CMDF_RETURN (* do_command)(const struct cmdf__entry_s *, cmdf_arglist *);
+};
+
+/* Event loop interface modes */
+enum cmdf__feed_mode {
+    CMDF__FEED_INACTIVE = 0,                    /* Not started, or exited */
+    CMDF__FEED_PLAIN,                           /* Input is pushed with cmdf_feed() */
+    CMDF__FEED_READLINE                         /* Input is read by readline's callback interface */
+};
+
+/* Partial input line buffered by cmdf_feed() */
+struct cmdf__feed_buffer_s {
+    char buff[CMDF_MAX_INPUT_BUFFER_LENGTH];
+    size_t length;
+    enum cmdf__feed_mode mode;
+};
+
+#ifdef CMDF_LINEEDIT_SUPPORT
+/*
+ * Line editor history, kept in a ring of the latest distinct lines, and optionally
+ * appended to a file
+ */
+struct cmdf__history_s {
+    char *lines[CMDF_HISTORY_SIZE];
+    int first, count;                           /* Oldest line, and number of lines */
+    int fd, persistent;                         /* History file, if persistent is set */
 };
+#endif
 
 /* libcmdf settings stack */
-static struct cmdf__settings_stack_s {
+struct cmdf__settings_stack_s {
     struct cmdf__settings_s stack[CMDF_MAX_SUBPROCESSES];
     size_t size;
     struct cmdf__settings_s *top; /* actual settings for currect process */
-} cmdf__settings_stack =
+};
+
+/* Mutable state of a registered command, kept apart from its (possibly shared) entry */
+struct cmdf__command_info_s {
+    unsigned int timeout;                       /* Time limit in seconds, or 0 for none */
+    struct cmdf_command_stats stats;
+    cmdf_completer_callback completer;          /* Argument completer, if any */
+    unsigned int completion_ttl;                /* Seconds completions stay cached, 0 for ever */
+    struct cmdf__completions_s *completions;    /* Cached completions, by argument position */
+    const char *help;                           /* Help the words below were found in */
+    struct cmdf__help_word_s *words;
+    size_t word_count;
+    char *wrapped;                              /* Help wrapped for the width and offset below */
+    size_t wrapped_len, wrapped_offset;
+    unsigned short wrapped_width;
+};
+
+void cmdf__completions_drop(struct cmdf__command_info_s *info);
+void cmdf__help_drop(struct cmdf__command_info_s *info);
+void cmdf__help_prepare(struct cmdf__command_info_s *info, const char *help);
+
+struct cmdf__entry_s {
+    const char *cmdname;                        /* Command name */
+    const char *help;                           /* Help */
+    cmdf_command_callback callback;             /* Command callback */
+    int flags;                                  /* CMDF_COMMAND_* flags */
+    struct cmdf__command_info_s *info;          /* Time limit and statistics */
+};
+
+/* One version of a catalog's commands, which is never changed once published */
+struct cmdf__catalog_table_s {
+    struct cmdf__entry_s entries[CMDF_MAX_COMMANDS];
+    const struct cmdf__entry_s *index[CMDF_MAX_COMMANDS];  /* Sorted by command name */
+    int undoc_cmds, doc_cmds, entry_count;
+    unsigned long version;                      /* Unique to every change of any catalog */
+
+    #ifdef CMDF_THREAD_SUPPORT
+        unsigned long retire_epoch;             /* Epoch following its replacement */
+        struct cmdf__catalog_table_s *next;     /* Next replaced version */
+    #endif
+};
+
+/*
+ * libcmdf command catalog. Filled once, then frozen and shared read-only by any number
+ * of contexts and threads, which keep only their own menu state. Freezing builds an index
+ * sorted by command name, so lookups are lock-free binary searches. If thread support is
+ * enabled, frozen catalogs can still be changed: changes are published as new versions,
+ * and replaced versions are reclaimed once no reader can be using them.
+ */
+struct cmdf__catalog_s {
+    struct cmdf__catalog_table_s *table;        /* Current version */
+    struct cmdf__command_info_s info[CMDF_MAX_COMMANDS];  /* Shared by all versions */
+    int frozen;
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_t write_lock;             /* Serializes writers; readers never take it */
+        struct cmdf__catalog_table_s *retired;  /* Replaced versions, awaiting reclamation */
+    #endif
+};
+
+#ifdef CMDF_THREAD_SUPPORT
+/* Background job states */
+enum cmdf__job_state {
+    CMDF__JOB_FREE = 0,
+    CMDF__JOB_QUEUED,
+    CMDF__JOB_RUNNING,
+    CMDF__JOB_DONE,
+    CMDF__JOB_KILLED
+};
+
+/* libcmdf background job */
+struct cmdf__job_s {
+    int id;                                     /* Job ID, as shown to the user */
+    enum cmdf__job_state state;                 /* Job state */
+    char *cmdline;                              /* Command line, for job listing */
+    cmdf_command_callback callback;             /* Command callback */
+    struct cmdf__command_info_s *info;          /* Command time limit and statistics */
+    struct cmdf__entry_s *entries;              /* Copy of the menu's commands, or NULL for a catalog */
+    struct cmdf__command_info_s *infos;         /* Their state, which only the job uses */
+    cmdf_arglist *arglist;                      /* Arguments, owned by the job */
+    CMDF_RETURN retval;                         /* Return code, once done */
+    int cancelled;                              /* Set by 'kill' while it runs */
+    int held;                                   /* Output is held for the thread feeding input */
+    FILE *output;                               /* Output held, once done, or NULL */
+    struct cmdf__context_s *ctx;                /* Context the job was started from */
+    struct cmdf__settings_s menu;               /* Copy of the menu it was started from */
+    struct cmdf__job_s *next;                   /* Next job in the worker pool's queue */
+};
+
+/* A job to report, taken out of the job table so it can be reported without the lock */
+struct cmdf__job_report_s {
+    int id;
+    enum cmdf__job_state state;
+    CMDF_RETURN retval;
+    char *cmdline;
+    FILE *output;
+};
+#endif
+
+/*
+ * Library output of a context, collected so that a whole screen, such as the help listing,
+ * reaches the stream in one write
+ */
+struct cmdf__output_buffer_s {
+    char data[CMDF_OUTPUT_BUFFER_SIZE];
+    size_t len;
+    int message;                                /* A message record is open, in JSON output */
+    FILE *spool;                                /* cmdf_get_output() of an I/O backend, or NULL */
+    int hold;                                   /* Everything goes to the spool and stays there */
+};
+
+/* Help listing of a menu, laid out for the width and menu state it was made for */
+struct cmdf__listing_s {
+    char *text;
+    size_t len;
+    unsigned short width;
+    unsigned long version;                      /* Catalog version, or 0 for the context's entries */
+    int entry_start, entry_count;
+    const char *doc_header, *undoc_header;
+    char ruler;
+};
+
+/* Commands of a context's menu sorted by name, for the menu state it was made for */
+struct cmdf__name_index_s {
+    const struct cmdf__entry_s **entries;
+    int entry_start, entry_count;
+};
+
+/* Help search index, kept per menu. Compiled only if apropos support is enabled. */
+#ifdef CMDF_APROPOS_SUPPORT
+    #define CMDF__APROPOS_WORD_SIZE 32          /* Longer words are cut to fit */
+
+    struct cmdf__apropos_posting_s {
+        int slot;                               /* Command, counted from the start of its menu */
+        int weight;                             /* Times it uses the word, counting more in its name */
+    };
+
+    /* A word of the index, and the commands using it */
+    struct cmdf__apropos_term_s {
+        char *word;
+        struct cmdf__apropos_posting_s *postings;
+        int count, capacity;
+    };
+
+    /*
+     * Inverted index over the names and help of a menu's commands. Words are kept sorted,
+     * so a keyword finds the words it starts with by binary search. It's built on the first
+     * search, then kept up to date as commands are registered.
+     */
+    struct cmdf__apropos_s {
+        struct cmdf__apropos_term_s *terms;
+        int term_count, term_capacity;
+        const char **names, **helps;            /* What every command was indexed with */
+        int slot_count, slot_capacity;
+        int built;
+    };
+
+    struct cmdf__apropos_match_s {
+        const char *cmdname, *help;
+        int keywords;                           /* Keywords it matched */
+        long score;
+    };
+
+    CMDF_RETURN cmdf__apropos_sync(struct cmdf__apropos_s *index, const struct cmdf__entry_s *entries,
+                                   int count);
+    void cmdf__apropos_drop(struct cmdf__apropos_s *index);
+#endif
+
+/*
+ * libcmdf interpreter context. Holds all of an interpreter's mutable state, so several
+ * interpreters can run at once. The default one is used by the context-less functions,
+ * and every server session gets one of its own.
+ */
+struct cmdf__context_s {
+    struct cmdf__settings_stack_s settings_stack;
+    struct cmdf__entry_s entries[(CMDF_MAX_COMMANDS + 1) * CMDF_MAX_SUBPROCESSES];
+    struct cmdf__command_info_s info[(CMDF_MAX_COMMANDS + 1) * CMDF_MAX_SUBPROCESSES];
+    struct cmdf__feed_buffer_s feed_buffer;
+    FILE *out;                                  /* Output stream, or NULL for CMDF_STDOUT */
+    struct cmdf_io io;                          /* I/O backend, all NULL for the streams */
+    struct cmdf__output_buffer_s output_buffer; /* Output not written to it yet */
+    int format;                                 /* CMDF_OUTPUT_TEXT or CMDF_OUTPUT_JSON */
+    struct cmdf__listing_s listings[CMDF_MAX_SUBPROCESSES];     /* Help listing of every menu */
+    struct cmdf__name_index_s name_indexes[CMDF_MAX_SUBPROCESSES];  /* Of every context menu */
+
+    #ifdef CMDF_APROPOS_SUPPORT
+        struct cmdf__apropos_s apropos[CMDF_MAX_SUBPROCESSES];     /* Help search index of every menu */
+    #endif
+    struct cmdf_windowsize winsize;             /* Size of the terminal it prints to */
+    sig_atomic_t winsize_resizes;               /* cmdf__resizes when it was measured */
+
+    #ifdef CMDF_THREAD_SUPPORT
+        struct cmdf__job_s jobs[CMDF_MAX_JOBS];
+        int next_job_id;
+        void (*orphaned)(struct cmdf__context_s *ctx);  /* Frees it after its last job, once detached */
+    #endif
+
+    #ifdef CMDF_LINEEDIT_SUPPORT
+        struct cmdf__history_s history;
+        char typeahead[CMDF_MAX_INPUT_BUFFER_LENGTH];   /* Unfinished last line of a paste */
+    #endif
+};
+
+static struct cmdf__context_s cmdf__default_context =
 #ifdef __cplusplus /* Required to avoid -Wmissing-braces on Apple clang and possibly others */
     {{}};
 #else
     { 0 };
 #endif
 
-static struct cmdf__entry_s {
-    const char *cmdname;                        /* Command name */
-    const char *help;                           /* Help */
-    cmdf_command_callback callback;             /* Command callback */
-} cmdf__entries[(CMDF_MAX_COMMANDS + 1) * CMDF_MAX_SUBPROCESSES];
+/*
+ * Context the calling thread is working with. The context-less functions use it,
+ * and it is set to the dispatching context while a command callback runs.
+ */
+static CMDF_THREAD_LOCAL struct cmdf__context_s *cmdf__ctx = &cmdf__default_context;
 
-/* Utility Functions */
-char *cmdf__strdup(const char *src) {
-    char *dst = (char *)(CMDF_MALLOC(sizeof(char) * (strlen(src) + 1))); /* src + '\0' */
-    if (!dst)
-        return NULL;
+/* Readline's state is global, so only one context at a time can feed input through it */
+#ifdef CMDF_READLINE_SUPPORT
+    static struct cmdf__context_s *cmdf__readline_ctx = NULL;
+#endif
 
-    return strcpy(dst, src);
+/* Get the output stream of the given context */
+FILE *cmdf__output(struct cmdf__context_s *ctx) {
+    return ctx->out ? ctx->out : CMDF_STDOUT;
 }
 
-void cmdf__trim(char *src) {
-    char *begin = src, *end, *newline;
-    size_t end_location;
+/* Protects everything about background jobs, and the command slots they report back to */
+#ifdef CMDF_THREAD_SUPPORT
+    static pthread_mutex_t cmdf__jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-	/* Check for empty string */
-	if (strlen(src) == 1 && (src[0] == '\n' || src[0] == '\0')) {
-		src[0] = '\0';
-		return;
-	}
+/* Background jobs buffer their output apart from the context's, which other threads use */
+#ifdef CMDF_THREAD_SUPPORT
+    static CMDF_THREAD_LOCAL struct cmdf__job_s *cmdf__current_job = NULL;
+    static CMDF_THREAD_LOCAL struct cmdf__output_buffer_s *cmdf__job_output = NULL;
+#endif
 
-    /* Replace newline */
-    newline = strrchr(src, '\n');
-    if (newline)
-        *newline = '\0';
+struct cmdf__output_buffer_s *cmdf__output_buffer(struct cmdf__context_s *ctx) {
+    #ifdef CMDF_THREAD_SUPPORT
+        if (cmdf__job_output)
+            return cmdf__job_output;
+    #endif
 
-    /* Replace spaces and re-align the string */
-    while (isspace((int)*begin))
-        begin++;
+    return &ctx->output_buffer;
+}
 
-    if (src != begin) {
-        end_location = strlen(begin);
-        memmove(src, begin, strlen(begin) + 1);
-        memset(begin + end_location, '\0', sizeof(char) * strlen(begin - end_location));
-    }
+/* Whether the calling thread runs a background job of ctx, which must leave its menus alone */
+int cmdf__job_of(const struct cmdf__context_s *ctx) {
+    #ifdef CMDF_THREAD_SUPPORT
+        return cmdf__current_job && cmdf__current_job->ctx == ctx;
+    #else
+        return 0;
+    #endif
+}
 
-    /* Replaces spaces at the end of the string */
-    end = strrchr(src, '\0');
-    
-    /* Check if we haven't reached the end of the string.
-     * Because if we did, we have nothing else to do. */
-    if (src == end)
-        return;
-    else
-        end--;
+/*
+ * Get the menu of ctx that the calling thread works with: the active one, or for a
+ * background job, its copy of the menu it was started from, which only the job sees.
+ */
+struct cmdf__settings_s *cmdf__active_menu(struct cmdf__context_s *ctx) {
+    #ifdef CMDF_THREAD_SUPPORT
+        if (cmdf__job_of(ctx))
+            return &cmdf__current_job->menu;
+    #endif
 
-    if (isspace((int)*end)) {
-        do {
-            *end = '\0';
-            end--;
-        } while (isspace((int)*end));
-    }
+    return ctx->settings_stack.top;
 }
 
-void cmdf__print_title(const char *title, char ruler) {
-    size_t i = 0;
+/* Get the stack level of a menu of ctx, where its caches are, or -1 for a job's copy */
+int cmdf__menu_level(const struct cmdf__context_s *ctx, const struct cmdf__settings_s *settings) {
+    #ifdef CMDF_THREAD_SUPPORT
+        if (cmdf__current_job && settings == &cmdf__current_job->menu)
+            return -1;
+    #endif
 
-    fprintf(CMDF_STDOUT, "\n%s\n", title);
+    return (int)(settings - ctx->settings_stack.stack);
+}
 
-    for (i = 0; i < strlen(title) + 1; i++)
-        putc(ruler, CMDF_STDOUT);
+/* Get the commands of a menu of ctx that doesn't use a catalog, or a job's copy of them */
+struct cmdf__entry_s *cmdf__menu_entries(struct cmdf__context_s *ctx,
+                                         const struct cmdf__settings_s *settings) {
+    #ifdef CMDF_THREAD_SUPPORT
+        if (cmdf__current_job && settings == &cmdf__current_job->menu && cmdf__current_job->entries)
+            return cmdf__current_job->entries;
+    #endif
 
-    putc('\n', CMDF_STDOUT);
+    return ctx->entries + settings->entry_start;
 }
 
-/* 
- * Print a string from the current line, down to the next line if needed,
- * which is padded with loffset characters. 
- * The function takes the input string and prints it word by word - if a word can not
- * be printed on the line without being concatenated, it is printed on the next line.
- */
-void cmdf__pprint(size_t loffset, const char * const strtoprint) {
-    const struct cmdf_windowsize winsize = cmdf_get_window_size();
-    size_t total_printed = loffset, i, wordlen;
-    char *strbuff = cmdf__strdup(strtoprint), *wordptr;
+/* Write output of ctx out to its backend, straight from where it is, or to its stream */
+void cmdf__sink(struct cmdf__context_s *ctx, const char *text, size_t len) {
+    size_t written;
 
-    /* If we couldn't allocate a buffer, print regularly, exit. */
-    if (!strbuff) {
-        fprintf(CMDF_STDOUT, "\n%s\n", strtoprint);
+    if (!ctx->io.write) {
+        fwrite(text, sizeof(char), len, cmdf__output(ctx));
         return;
     }
 
-    /* Begin splitting by words */
-    wordptr = strtok(strbuff, " \t\n");
-    while (wordptr) {
-        /* Check if we can print this word. */
-        wordlen = strlen(wordptr);
-        if (total_printed + (wordlen + 1) > (size_t)(winsize.w - CMDF_PPRINT_RIGHT_OFFSET)) {
-            /* Go to the next line and print the word there. */
-            /* Print newline and loffset spaces */
-            fputc('\n', CMDF_STDOUT);
-            for (i = 0; i < loffset; i++)
-                fputc(' ', CMDF_STDOUT);
+    /* Output that can't be written is dropped, like a stream would */
+    while (len && (written = ctx->io.write(ctx->io.data, text, len)) > 0) {
+        text += written;
+        len -= written;
+    }
+}
 
-            total_printed = loffset;
-        }
+/* Write out what callbacks printed to a spool since last time, and start it over */
+void cmdf__spool_forward(struct cmdf__context_s *ctx, FILE *spool) {
+    char chunk[CMDF_OUTPUT_BUFFER_SIZE];
+    size_t got;
+    long left;
 
-        /* Print the word */
-        fprintf(CMDF_STDOUT, "%s ", wordptr);
-        total_printed += wordlen + 1; /* strlen(word) + space */
+    fflush(spool);
+    if ((left = ftell(spool)) <= 0)
+        return;
 
-        /* Get the next word */
-        wordptr = strtok(NULL, " \t\n");
+    fseek(spool, 0, SEEK_SET);
+    while (left > 0 && (got = fread(chunk, sizeof(char),
+                                    left < (long)sizeof(chunk) ? (size_t)left : sizeof(chunk), spool)) > 0) {
+        cmdf__sink(ctx, chunk, got);
+        left -= (long)got;
     }
 
-    fputc('\n', CMDF_STDOUT);
-
-    CMDF_FREE(strbuff);
+    /* Whatever is printed next overwrites it */
+    fseek(spool, 0, SEEK_SET);
 }
 
-void cmdf__print_command_list(void) {
-    int i, printed;
-    const struct cmdf_windowsize winsize = cmdf_get_window_size();
-
-    /* Print documented commands */
-    cmdf__print_title(cmdf__settings_stack.top->doc_header, cmdf__settings_stack.top->ruler);
-    for (i = cmdf__settings_stack.top->entry_start, printed = 0; i < cmdf__settings_stack.top->entry_start + cmdf__settings_stack.top->entry_count; i++) {
-        if (cmdf__entries[i].help) {
-            /* Check if we need to break into the next line. */
-            if (printed + strlen(cmdf__entries[i].cmdname) + 1 >= winsize.w) {
-                printed = 0;
-                fputc('\n', CMDF_STDOUT);
-            }
+/* Write out the output buffered for ctx, leaving the backend to flush it */
+void cmdf__drain(struct cmdf__context_s *ctx) {
+    struct cmdf__output_buffer_s *buffer = cmdf__output_buffer(ctx);
 
-            /* Print command */
-            printed += fprintf(CMDF_STDOUT, "%s ", cmdf__entries[i].cmdname);
-        }
+    /* Held output is appended to what callbacks printed to the spool */
+    if (buffer->hold) {
+        fwrite(buffer->data, sizeof(char), buffer->len, buffer->spool);
+        buffer->len = 0;
+        return;
     }
 
-    fputc('\n', CMDF_STDOUT);
+    /* Callbacks printed to the spool before libcmdf buffered anything after it */
+    if (buffer->spool)
+        cmdf__spool_forward(ctx, buffer->spool);
 
-    /* Print undocumented commands, if any */
-    if (cmdf__settings_stack.top->undoc_cmds > 0) {
-        cmdf__print_title(cmdf__settings_stack.top->undoc_header, cmdf__settings_stack.top->ruler);
-        for (i = cmdf__settings_stack.top->entry_start, printed = 0; i < cmdf__settings_stack.top->entry_start + cmdf__settings_stack.top->entry_count; i++) {
-            if (!cmdf__entries[i].help) {
-                /* Check if we need to break into the next line. */
-                if (printed + strlen(cmdf__entries[i].cmdname) + 1 >= winsize.w) {
-                    printed = 0;
-                    fputc('\n', CMDF_STDOUT);
-                }
+    if (buffer->len) {
+        cmdf__sink(ctx, buffer->data, buffer->len);
+        buffer->len = 0;
+    }
+}
 
-                /* Print command */
-                printed += fprintf(CMDF_STDOUT, "%s ", cmdf__entries[i].cmdname);
-            }
-        }
+/* Buffer output of ctx as it is, writing the buffer out whenever it fills up */
+void cmdf__emit(struct cmdf__context_s *ctx, const char *text, size_t len) {
+    struct cmdf__output_buffer_s *buffer = cmdf__output_buffer(ctx);
 
-        fputc('\n', CMDF_STDOUT);
+    if (len > sizeof(buffer->data) - buffer->len) {
+        cmdf__drain(ctx);
+
+        if (len > sizeof(buffer->data)) {
+            cmdf__sink(ctx, text, len);
+            return;
+        }
     }
+
+    memcpy(buffer->data + buffer->len, text, len);
+    buffer->len += len;
 }
 
-/* Init/Free functions */
-void cmdf_init(const char *prompt, const char *intro, const char *doc_header,
-               const char *undoc_header, char ruler, int use_default_exit) {
-    /* Create new settings to push them to stack */
-    struct cmdf__settings_s settings;
-    memset((void *)&settings, 0, sizeof(struct cmdf__settings_s));
+/* Buffer text as the inside of a JSON string, escaping what JSON doesn't allow as it is */
+void cmdf__json_escape(struct cmdf__context_s *ctx, const char *text, size_t len) {
+    char escape[8];
+    size_t start = 0, i;
 
-    /* Set properties */
-    settings.prompt = prompt ? prompt : cmdf__default_prompt;
-    settings.intro = intro ? intro : cmdf__default_intro;
-    settings.doc_header = doc_header ? doc_header : cmdf__default_doc_header;
-    settings.undoc_header = undoc_header ? undoc_header : cmdf__default_undoc_header;
-    settings.ruler = ruler ? ruler : cmdf__default_ruler;
-    settings.doc_cmds = settings.undoc_cmds = settings.entry_count = 0;
+    for (i = 0; i < len; i++) {
+        if (text[i] != '"' && text[i] != '\\' && (unsigned char)text[i] >= 0x20)
+            continue;
 
-    /* If not first - look for actual entry_start index */
-    if (cmdf__settings_stack.top != NULL)
-        settings.entry_start = cmdf__settings_stack.top->entry_start + cmdf__settings_stack.top->entry_count;
+        cmdf__emit(ctx, text + start, i - start);
+        start = i + 1;
+
+        if (text[i] == '\n')
+            cmdf__emit(ctx, "\\n", 2);
+        else if (text[i] == '\t')
+            cmdf__emit(ctx, "\\t", 2);
+        else if (text[i] == '"' || text[i] == '\\') {
+            escape[0] = '\\';
+            escape[1] = text[i];
+            cmdf__emit(ctx, escape, 2);
+        }
+        else {
+            sprintf(escape, "\\u%04x", (unsigned char)text[i]);
+            cmdf__emit(ctx, escape, 6);
+        }
+    }
 
-    /* Set command callbacks */
-    settings.do_command = cmdf__default_do_command;
-    settings.do_emptyline = cmdf__default_do_emptyline;
+    cmdf__emit(ctx, text + start, len - start);
+}
 
-    /* Push value to the stack */
-    if (cmdf__settings_stack.size < CMDF_MAX_SUBPROCESSES) {
-        cmdf__settings_stack.stack[cmdf__settings_stack.size] = settings;
-        cmdf__settings_stack.top = cmdf__settings_stack.stack + cmdf__settings_stack.size;
-        cmdf__settings_stack.size++;
-    } else {
-        printf("max subprocesses count reached!\n");
-        exit(CMDF_ERROR_OUT_OF_PROCESS_STACK); /* maybe handle error somehow */
+/* Buffer a JSON string, or null */
+void cmdf__json_string(struct cmdf__context_s *ctx, const char *text) {
+    if (!text) {
+        cmdf__emit(ctx, "null", 4);
+        return;
     }
 
-    /* Register help callback */
-    cmdf_register_command(cmdf__default_do_help, "help", "Get information on a command" \
-                          " or list commands.");
+    cmdf__emit(ctx, "\"", 1);
+    cmdf__json_escape(ctx, text, strlen(text));
+    cmdf__emit(ctx, "\"", 1);
+}
 
-    /* Register exit callback, if required */
-    if (use_default_exit)
-        cmdf_register_command(cmdf__default_do_exit, "exit", "Quit the application");
+/* Close the message record collecting library text, if one is open */
+void cmdf__end_message(struct cmdf__context_s *ctx) {
+    struct cmdf__output_buffer_s *buffer = cmdf__output_buffer(ctx);
 
-    #ifdef CMDF_READLINE_SUPPORT
-        /* Set completion function */
-        rl_attempted_completion_function = cmdf__command_name_completion;
-    #endif
+    if (buffer->message) {
+        buffer->message = 0;
+        cmdf__emit(ctx, "\"}\n", 3);
+    }
 }
 
-/* Public interface functions */
-void cmdf_commandloop(void) {
-    cmdf__default_commandloop();
-}
+/* Write out the output buffered for ctx, and flush the stream. Done once per command. */
+void cmdf__flush(struct cmdf__context_s *ctx) {
+    cmdf__end_message(ctx);
+    cmdf__drain(ctx);
 
-/* Getters */
-const char *cmdf_get_prompt(void) {
-    return cmdf__settings_stack.top->prompt;
+    if (ctx->io.flush)
+        ctx->io.flush(ctx->io.data);
+    else if (!ctx->io.write)
+        fflush(cmdf__output(ctx));
 }
 
-const char *cmdf_get_intro(void) {
-    return cmdf__settings_stack.top->intro;
-}
+/*
+ * Buffer text output of ctx. In JSON output, text is collected into a message record,
+ * which is closed by the next record or the next flush. Blank lines don't open one.
+ */
+void cmdf__write(struct cmdf__context_s *ctx, const char *text, size_t len) {
+    struct cmdf__output_buffer_s *buffer;
+
+    if (ctx->format != CMDF_OUTPUT_JSON) {
+        cmdf__emit(ctx, text, len);
+        return;
+    }
+
+    buffer = cmdf__output_buffer(ctx);
+    if (!buffer->message) {
+        while (len && isspace((unsigned char)*text)) {
+            text++;
+            len--;
+        }
+
+        if (!len)
+            return;
+
+        cmdf__emit(ctx, "{\"type\":\"message\",\"text\":\"", 26);
+        buffer->message = 1;
+    }
+
+    cmdf__json_escape(ctx, text, len);
+}
+
+void cmdf__puts(struct cmdf__context_s *ctx, const char *text) {
+    cmdf__write(ctx, text, strlen(text));
+}
+
+/* Buffer count copies of a character, such as a ruler or padding */
+void cmdf__fill(struct cmdf__context_s *ctx, char c, size_t count) {
+    struct cmdf__output_buffer_s *buffer = cmdf__output_buffer(ctx);
+    size_t len;
+
+    while (count && ctx->format == CMDF_OUTPUT_JSON) {
+        cmdf__write(ctx, &c, 1);
+        count--;
+    }
+
+    while (count) {
+        if (buffer->len == sizeof(buffer->data))
+            cmdf__drain(ctx);
+
+        len = sizeof(buffer->data) - buffer->len;
+        if (len > count)
+            len = count;
+
+        memset(buffer->data + buffer->len, c, len);
+        buffer->len += len;
+        count -= len;
+    }
+}
+
+/* Buffer formatted output of ctx. Returns the number of characters printed, like printf(). */
+int cmdf__vprintf(struct cmdf__context_s *ctx, const char *format, va_list args) {
+    struct cmdf__output_buffer_s *buffer = cmdf__output_buffer(ctx);
+
+    #ifdef CMDF__HAVE_VSNPRINTF
+        char text[256], *formatted = text;
+        va_list copy;
+        int len, attempt;
+
+        /* JSON output has to see the text to escape it */
+        if (ctx->format == CMDF_OUTPUT_JSON) {
+            va_copy(copy, args);
+            len = vsnprintf(text, sizeof(text), format, copy);
+            va_end(copy);
+
+            if (len >= (int)sizeof(text) && (formatted = (char *)(CMDF_MALLOC(sizeof(char) * (len + 1)))))
+                vsnprintf(formatted, len + 1, format, args);
+
+            if (len > 0)
+                cmdf__write(ctx, formatted ? formatted : text,
+                            formatted ? (size_t)len : sizeof(text) - 1);
+
+            if (formatted != text)
+                CMDF_FREE(formatted);
+
+            return len;
+        }
+
+        /* If it doesn't fit, try again with an empty buffer */
+        for (attempt = 0; attempt < 2; attempt++) {
+            va_copy(copy, args);
+            len = vsnprintf(buffer->data + buffer->len, sizeof(buffer->data) - buffer->len, format, copy);
+            va_end(copy);
+
+            if (len >= 0 && (size_t)len < sizeof(buffer->data) - buffer->len) {
+                buffer->len += len;
+                return len;
+            }
+
+            if (!buffer->len)
+                break;
+
+            cmdf__drain(ctx);
+        }
+
+        /* A backend has no stream to print to, so it gets the text formatted on its own */
+        if (ctx->io.write) {
+            if (len > 0 && (formatted = (char *)(CMDF_MALLOC(sizeof(char) * (len + 1))))) {
+                vsnprintf(formatted, len + 1, format, args);
+                cmdf__sink(ctx, formatted, len);
+                CMDF_FREE(formatted);
+            }
+
+            return len;
+        }
+    #endif
+
+    /* Print it directly, after what's buffered */
+    (void)buffer;
+    cmdf__drain(ctx);
+
+    return vfprintf(cmdf__output(ctx), format, args);
+}
+
+int cmdf__printf(struct cmdf__context_s *ctx, const char *format, ...) {
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = cmdf__vprintf(ctx, format, args);
+    va_end(args);
+
+    return len;
+}
+
+/* Start a record of structured output. Fields are added with cmdf__record_key(). */
+void cmdf__record_begin(struct cmdf__context_s *ctx, const char *type) {
+    cmdf__end_message(ctx);
+    cmdf__emit(ctx, "{\"type\":", 8);
+    cmdf__json_string(ctx, type);
+}
+
+/* Start a field of a record. Its value is buffered next. */
+void cmdf__record_key(struct cmdf__context_s *ctx, const char *key) {
+    cmdf__emit(ctx, ",", 1);
+    cmdf__json_string(ctx, key);
+    cmdf__emit(ctx, ":", 1);
+}
+
+void cmdf__record_number(struct cmdf__context_s *ctx, const char *key, long value) {
+    char number[24];
+
+    cmdf__record_key(ctx, key);
+    cmdf__emit(ctx, number, sprintf(number, "%ld", value));
+}
+
+void cmdf__record_end(struct cmdf__context_s *ctx) {
+    cmdf__emit(ctx, "}\n", 2);
+}
+
+/* Add a field listing commands with their help to a record, taken from index if it's not NULL */
+void cmdf__record_commands(struct cmdf__context_s *ctx, const struct cmdf__entry_s *entries,
+                           const struct cmdf__entry_s *const *index, int count) {
+    const struct cmdf__entry_s *entry;
+    int i;
+
+    cmdf__record_key(ctx, "commands");
+    cmdf__emit(ctx, "[", 1);
+
+    for (i = 0; i < count; i++) {
+        entry = index ? index[i] : entries + i;
+        cmdf__emit(ctx, i ? ",{\"name\":" : "{\"name\":", i ? 9 : 8);
+        cmdf__json_string(ctx, entry->cmdname);
+        cmdf__emit(ctx, ",\"help\":", 8);
+        cmdf__json_string(ctx, entry->help);
+        cmdf__emit(ctx, "}", 1);
+    }
+
+    cmdf__emit(ctx, "]", 1);
+}
+
+#ifdef CMDF_THREAD_SUPPORT
+/*
+ * Epoch-based reclamation of replaced catalog versions.
+ * Every thread reading a catalog has a record holding the global epoch it observed when it
+ * started reading, or 0 while it isn't. A replaced version is tagged with the epoch that
+ * follows its replacement, and may be freed once no reader observed an earlier epoch.
+ */
+struct cmdf__reader_s {
+    unsigned long epoch;                        /* Epoch observed when entering, or 0 */
+    int depth;                                  /* Nesting of read-side sections */
+    int in_use;                                 /* Set while owned by a live thread */
+    struct cmdf__reader_s *next;                /* Next record; records are never freed */
+};
+
+static unsigned long cmdf__epoch = 1;
+static struct cmdf__reader_s *cmdf__readers = NULL;
+static pthread_once_t cmdf__readers_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cmdf__readers_key;
+static CMDF_THREAD_LOCAL struct cmdf__reader_s *cmdf__reader = NULL;
+
+/* Hand the record of an exiting thread over to the next thread that needs one */
+void cmdf__reader_release(void *reader) {
+    __atomic_store_n(&((struct cmdf__reader_s *)reader)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void cmdf__readers_init(void) {
+    pthread_key_create(&cmdf__readers_key, cmdf__reader_release);
+}
+
+/* Get the calling thread's reader record, or NULL if one could not be allocated */
+struct cmdf__reader_s *cmdf__reader_get(void) {
+    struct cmdf__reader_s *reader;
+    int expected;
+
+    if (cmdf__reader)
+        return cmdf__reader;
+
+    pthread_once(&cmdf__readers_once, cmdf__readers_init);
+
+    /* Reuse the record of a thread that exited, or add a new one */
+    for (reader = __atomic_load_n(&cmdf__readers, __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&reader->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!reader) {
+        if (!(reader = (struct cmdf__reader_s *)(CMDF_MALLOC(sizeof(struct cmdf__reader_s)))))
+            return NULL;
+
+        memset(reader, 0, sizeof(struct cmdf__reader_s));
+        reader->in_use = 1;
+        reader->next = __atomic_load_n(&cmdf__readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&cmdf__readers, &reader->next, reader, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(cmdf__readers_key, reader);
+
+    return cmdf__reader = reader;
+}
+
+/*
+ * Publish a new version of a catalog, with its write lock held, then free the replaced
+ * versions no reader can be using anymore.
+ */
+void cmdf__catalog_publish(struct cmdf__catalog_s *catalog, struct cmdf__catalog_table_s *table) {
+    struct cmdf__catalog_table_s *old = catalog->table, **link;
+    struct cmdf__reader_s *reader;
+    unsigned long oldest = (unsigned long)-1, epoch;
+
+    __atomic_store_n(&catalog->table, table, __ATOMIC_SEQ_CST);
+    old->retire_epoch = __atomic_add_fetch(&cmdf__epoch, 1, __ATOMIC_SEQ_CST);
+    old->next = catalog->retired;
+    catalog->retired = old;
+
+    /* Find the oldest epoch a reader may still be holding a version from */
+    for (reader = __atomic_load_n(&cmdf__readers, __ATOMIC_ACQUIRE); reader; reader = reader->next)
+        if ((epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST)) && epoch < oldest)
+            oldest = epoch;
+
+    for (link = &catalog->retired; *link; ) {
+        if ((*link)->retire_epoch <= oldest) {
+            old = *link;
+            *link = old->next;
+            CMDF_FREE(old);
+        }
+        else
+            link = &(*link)->next;
+    }
+}
+#endif
+
+/*
+ * Start reading the current version of a catalog, which stays valid until the matching
+ * cmdf__catalog_leave(), even if the catalog is changed in the meantime. Takes no locks.
+ */
+const struct cmdf__catalog_table_s *cmdf__catalog_enter(const struct cmdf__catalog_s *catalog) {
+    #ifdef CMDF_THREAD_SUPPORT
+        struct cmdf__reader_s *reader = cmdf__reader_get();
+
+        /* Without a reader record, fall back to keeping writers out */
+        if (!reader) {
+            pthread_mutex_lock((pthread_mutex_t *)&catalog->write_lock);
+            return catalog->table;
+        }
+
+        if (reader->depth++ == 0)
+            __atomic_store_n(&reader->epoch, __atomic_load_n(&cmdf__epoch, __ATOMIC_SEQ_CST),
+                             __ATOMIC_SEQ_CST);
+
+        return __atomic_load_n(&catalog->table, __ATOMIC_SEQ_CST);
+    #else
+        return catalog->table;
+    #endif
+}
+
+void cmdf__catalog_leave(const struct cmdf__catalog_s *catalog) {
+    #ifdef CMDF_THREAD_SUPPORT
+        if (!cmdf__reader) {
+            pthread_mutex_unlock((pthread_mutex_t *)&catalog->write_lock);
+            return;
+        }
+
+        if (--cmdf__reader->depth == 0)
+            __atomic_store_n(&cmdf__reader->epoch, 0, __ATOMIC_RELEASE);
+    #endif
+}
+
+/*
+ * Start reading the commands of a menu, which live either in its catalog or in the context.
+ * Stores the number of commands, and of undocumented ones if undoc_cmds is not NULL.
+ * Must be paired with cmdf__menu_leave().
+ */
+const struct cmdf__entry_s *cmdf__menu_enter(struct cmdf__context_s *ctx,
+                                             const struct cmdf__settings_s *settings,
+                                             int *entry_count, int *undoc_cmds) {
+    const struct cmdf__catalog_table_s *table;
+
+    if (!settings->catalog) {
+        *entry_count = settings->entry_count;
+        if (undoc_cmds)
+            *undoc_cmds = settings->undoc_cmds;
+
+        return cmdf__menu_entries(ctx, settings);
+    }
+
+    table = cmdf__catalog_enter(settings->catalog);
+    *entry_count = table->entry_count;
+    if (undoc_cmds)
+        *undoc_cmds = table->undoc_cmds;
+
+    return table->entries;
+}
+
+void cmdf__menu_leave(const struct cmdf__settings_s *settings) {
+    if (settings->catalog)
+        cmdf__catalog_leave(settings->catalog);
+}
+
+/* Utility Functions */
+char *cmdf__strdup(const char *src) {
+    char *dst = (char *)(CMDF_MALLOC(sizeof(char) * (strlen(src) + 1))); /* src + '\0' */
+    if (!dst)
+        return NULL;
+
+    return strcpy(dst, src);
+}
+
+void cmdf__trim(char *src) {
+    char *begin = src, *end, *newline;
+    size_t end_location;
+
+	/* Check for empty string */
+	if (strlen(src) == 1 && (src[0] == '\n' || src[0] == '\0')) {
+		src[0] = '\0';
+		return;
+	}
+
+    /* Replace newline */
+    newline = strrchr(src, '\n');
+    if (newline)
+        *newline = '\0';
+
+    /* Replace spaces and re-align the string */
+    while (isspace((int)*begin))
+        begin++;
+
+    if (src != begin) {
+        end_location = strlen(begin);
+        memmove(src, begin, strlen(begin) + 1);
+        memset(begin + end_location, '\0', sizeof(char) * strlen(begin - end_location));
+    }
+
+    /* Replaces spaces at the end of the string */
+    end = strrchr(src, '\0');
+    
+    /* Check if we haven't reached the end of the string.
+     * Because if we did, we have nothing else to do. */
+    if (src == end)
+        return;
+    else
+        end--;
+
+    if (isspace((int)*end)) {
+        do {
+            *end = '\0';
+            end--;
+        } while (isspace((int)*end));
+    }
+}
+
+void cmdf__print_title(const char *title, char ruler) {
+    cmdf__puts(cmdf__ctx, "\n");
+    cmdf__puts(cmdf__ctx, title);
+    cmdf__puts(cmdf__ctx, "\n");
+    cmdf__fill(cmdf__ctx, ruler, strlen(title) + 1);
+    cmdf__puts(cmdf__ctx, "\n");
+}
+
+/* A word of a command's help */
+struct cmdf__help_word_s {
+    size_t start, len;
+};
+
+/* Help layouts are cached in the commands' state, which catalog versions share */
+#ifdef CMDF_THREAD_SUPPORT
+    static pthread_mutex_t cmdf__help_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Cached completions are shared by every thread completing with the same menu */
+#ifdef CMDF_THREAD_SUPPORT
+    static pthread_mutex_t cmdf__completions_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Drop the help layout of a command, with the lock held if there's one */
+void cmdf__help_drop(struct cmdf__command_info_s *info) {
+    CMDF_FREE(info->words);
+    CMDF_FREE(info->wrapped);
+    info->words = NULL;
+    info->wrapped = NULL;
+    info->help = NULL;
+}
+
+/*
+ * Find the words of a command's help, once, so it can be wrapped to any width without
+ * scanning it again. If there's no memory for them, the help is left unprepared.
+ */
+void cmdf__help_prepare(struct cmdf__command_info_s *info, const char *help) {
+    size_t i, count = 0;
+
+    cmdf__help_drop(info);
+    if (!help)
+        return;
+
+    for (i = 0; help[i]; i++)
+        if (!strchr(" \t\n", help[i]) && (i == 0 || strchr(" \t\n", help[i - 1])))
+            count++;
+
+    if (!(info->words = (struct cmdf__help_word_s *)(CMDF_MALLOC(sizeof(struct cmdf__help_word_s) * (count + 1)))))
+        return;
+
+    for (i = 0, count = 0; help[i]; i++) {
+        if (strchr(" \t\n", help[i]))
+            continue;
+
+        info->words[count].start = i;
+        while (help[i + 1] && !strchr(" \t\n", help[i + 1]))
+            i++;
+
+        info->words[count].len = i + 1 - info->words[count].start;
+        count++;
+    }
+
+    info->word_count = count;
+    info->help = help;
+}
+
+/*
+ * Lay a command's prepared help out word by word, with lines indented by loffset columns
+ * and no wider than width. A word that doesn't fit on a line starts the next one.
+ * Writes the result to dest, unless it's NULL, and returns its length.
+ */
+size_t cmdf__help_wrap(const struct cmdf__command_info_s *info, size_t loffset, unsigned short width,
+                       char *dest) {
+    size_t total_printed = loffset, len = 0, i;
+    const struct cmdf__help_word_s *word;
+
+    for (i = 0; i < info->word_count; i++) {
+        word = info->words + i;
+
+        /* Go to the next line and print the word there */
+        if (total_printed + (word->len + 1) > (size_t)(width - CMDF_PPRINT_RIGHT_OFFSET)) {
+            if (dest) {
+                dest[len] = '\n';
+                memset(dest + len + 1, ' ', loffset);
+            }
+
+            len += loffset + 1;
+            total_printed = loffset;
+        }
+
+        if (dest) {
+            memcpy(dest + len, info->help + word->start, word->len);
+            dest[len + word->len] = ' ';
+        }
+
+        len += word->len + 1;
+        total_printed += word->len + 1;
+    }
+
+    if (dest)
+        dest[len] = '\n';
+
+    return len + 1;
+}
+
+/*
+ * Print the help of a command, from the current column loffset. It's wrapped once, and
+ * the result is kept until the width of the terminal changes. Output may block, so with
+ * thread support the layout is copied out and written once the lock is released.
+ */
+void cmdf__print_help(const struct cmdf__entry_s *entry, size_t loffset) {
+    const struct cmdf_windowsize winsize = cmdf__window_size(cmdf__ctx);
+    struct cmdf__command_info_s *info = entry->info;
+    const char *text = NULL;
+    size_t len = 0;
+    #ifdef CMDF_THREAD_SUPPORT
+        char textbuff[CMDF_MAX_INPUT_BUFFER_LENGTH], *copy = NULL;
+    #endif
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&cmdf__help_lock);
+    #endif
+
+    /* A command replaced in a newer catalog version may have changed its help */
+    if (info->help != entry->help)
+        cmdf__help_prepare(info, entry->help);
+
+    if (info->help == entry->help &&
+        (!info->wrapped || info->wrapped_width != winsize.w || info->wrapped_offset != loffset)) {
+        CMDF_FREE(info->wrapped);
+
+        len = cmdf__help_wrap(info, loffset, winsize.w, NULL);
+        if ((info->wrapped = (char *)(CMDF_MALLOC(sizeof(char) * len)))) {
+            cmdf__help_wrap(info, loffset, winsize.w, info->wrapped);
+            info->wrapped_len = len;
+            info->wrapped_width = winsize.w;
+            info->wrapped_offset = loffset;
+        }
+    }
+
+    if (info->help == entry->help && info->wrapped) {
+        text = info->wrapped;
+        len = info->wrapped_len;
+
+        /* Long layouts are copied to the heap */
+        #ifdef CMDF_THREAD_SUPPORT
+            copy = len <= sizeof(textbuff) ? textbuff : (char *)(CMDF_MALLOC(sizeof(char) * len));
+            if (copy)
+                memcpy(copy, text, len);
+
+            text = copy;
+        #endif
+    }
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__help_lock);
+    #endif
+
+    /* If we couldn't allocate a layout, print it as it is */
+    if (text)
+        cmdf__write(cmdf__ctx, text, len);
+    else
+        cmdf__printf(cmdf__ctx, "\n%s\n", entry->help);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        if (copy != textbuff)
+            CMDF_FREE(copy);
+    #endif
+}
+
+/*
+ * Lay out names in as few rows as fit the width, filling columns first, like Python's
+ * cmd.columnize(). Writes to dest, which must have room for every name, two spaces
+ * and a line break, and returns the length written.
+ */
+size_t cmdf__columnize(const char **names, size_t n, size_t width, char *dest) {
+    size_t lens[CMDF_MAX_COMMANDS], colwidths[CMDF_MAX_COMMANDS];
+    size_t rows, cols = 0, row, col, i, total = 0, len = 0;
+
+    for (i = 0; i < n; i++)
+        lens[i] = strlen(names[i]);
+
+    /* Find the fewest rows that fit, or settle for a single column */
+    for (rows = 1; rows < n; rows++) {
+        cols = (n + rows - 1) / rows;
+        for (col = 0, total = 0; col < cols && total <= width; col++) {
+            colwidths[col] = 0;
+            for (i = col * rows; i < (col + 1) * rows && i < n; i++)
+                if (lens[i] > colwidths[col])
+                    colwidths[col] = lens[i];
+
+            total += colwidths[col] + (col ? 2 : 0);
+        }
+
+        if (total <= width)
+            break;
+    }
+
+    if (rows >= n)
+        cols = 1;
+
+    for (row = 0; row < rows && row < n; row++) {
+        for (col = 0; col < cols && (i = col * rows + row) < n; col++) {
+            memcpy(dest + len, names[i], lens[i]);
+            len += lens[i];
+
+            /* Pad it to its column, unless it's the last one in the row */
+            if (col + 1 < cols && i + rows < n) {
+                memset(dest + len, ' ', colwidths[col] - lens[i] + 2);
+                len += colwidths[col] - lens[i] + 2;
+            }
+        }
+
+        dest[len++] = '\n';
+    }
+
+    return len;
+}
+
+/* Write a section title of the help listing, underlined with the ruler, to dest */
+size_t cmdf__listing_title(const char *title, char ruler, char *dest) {
+    size_t len = 0, titlelen = strlen(title);
+
+    dest[len++] = '\n';
+    memcpy(dest + len, title, titlelen);
+    len += titlelen;
+    dest[len++] = '\n';
+    memset(dest + len, ruler, titlelen + 1);
+    len += titlelen + 1;
+    dest[len++] = '\n';
+
+    return len;
+}
+
+/*
+ * Lay out one section of the help listing: a title, and the names of the documented or
+ * undocumented commands. Writes to dest and returns the length written.
+ */
+size_t cmdf__listing_section(const struct cmdf__entry_s *entries, int count, int documented,
+                             const char *title, char ruler, size_t width, char *dest) {
+    const char *names[CMDF_MAX_COMMANDS];
+    size_t n = 0, i, len;
+
+    for (i = 0; i < (size_t)count; i++)
+        if ((entries[i].help != NULL) == documented)
+            names[n++] = entries[i].cmdname;
+
+    len = cmdf__listing_title(title, ruler, dest);
+    len += cmdf__columnize(names, n, width, dest + len);
+
+    if (!n)
+        dest[len++] = '\n';
+
+    return len;
+}
+
+/* Drop the help listing of a menu, such as when its commands change */
+void cmdf__listing_drop(struct cmdf__listing_s *listing) {
+    CMDF_FREE(listing->text);
+    listing->text = NULL;
+}
+
+/* Drop the name index of a menu, such as when its commands change */
+void cmdf__name_index_drop(struct cmdf__name_index_s *index) {
+    CMDF_FREE(index->entries);
+    index->entries = NULL;
+}
+
+/*
+ * Print the help listing of the active menu. It's laid out once, and kept until the menu's
+ * commands or the width of the terminal change, so it's usually a single copy to the output.
+ */
+void cmdf__print_command_list(void) {
+    const struct cmdf_windowsize winsize = cmdf__window_size(cmdf__ctx);
+    const struct cmdf__settings_s *settings = cmdf__active_menu(cmdf__ctx);
+    const int level = cmdf__menu_level(cmdf__ctx, settings);
+    struct cmdf__listing_s *listing;
+    const struct cmdf__catalog_table_s *table;
+    const struct cmdf__entry_s *entries;
+    struct cmdf__listing_s fresh;
+    size_t maxlen = 0, width = winsize.w > 1 ? winsize.w - 1 : 1;
+    int i, count, undoc_cmds = 0;
+
+    /* Programs get the commands in the order they were registered, with their help */
+    if (cmdf__ctx->format == CMDF_OUTPUT_JSON) {
+        entries = cmdf__menu_enter(cmdf__ctx, settings, &count, NULL);
+        cmdf__record_begin(cmdf__ctx, "commands");
+        cmdf__record_commands(cmdf__ctx, entries, NULL, count);
+        cmdf__record_end(cmdf__ctx);
+        cmdf__menu_leave(settings);
+        return;
+    }
+
+    /* What the listing depends on */
+    memset(&fresh, 0, sizeof(struct cmdf__listing_s));
+    if (settings->catalog) {
+        table = cmdf__catalog_enter(settings->catalog);
+        entries = table->entries;
+        count = table->entry_count;
+        fresh.version = table->version;
+    }
+    else {
+        entries = cmdf__menu_entries(cmdf__ctx, settings);
+        count = settings->entry_count;
+        fresh.entry_start = settings->entry_start;
+    }
+
+    fresh.entry_count = count;
+    fresh.width = winsize.w;
+    fresh.doc_header = settings->doc_header;
+    fresh.undoc_header = settings->undoc_header;
+    fresh.ruler = settings->ruler;
+
+    /* Background jobs leave the context's listings to the thread driving it */
+    listing = level < 0 ? &fresh : cmdf__ctx->listings + level;
+
+    if (!listing->text || listing->width != fresh.width || listing->version != fresh.version ||
+        listing->entry_start != fresh.entry_start || listing->entry_count != fresh.entry_count ||
+        listing->doc_header != fresh.doc_header || listing->undoc_header != fresh.undoc_header ||
+        listing->ruler != fresh.ruler) {
+        for (i = 0; i < count; i++) {
+            if (strlen(entries[i].cmdname) > maxlen)
+                maxlen = strlen(entries[i].cmdname);
+
+            if (!entries[i].help)
+                undoc_cmds++;
+        }
+
+        /* Every name takes at most a column of maxlen, two spaces and a line break */
+        fresh.text = (char *)(CMDF_MALLOC(sizeof(char) * (2 * (strlen(fresh.doc_header) + strlen(fresh.undoc_header)) +
+                                                          count * (maxlen + 3) + 10)));
+        if (fresh.text) {
+            fresh.len = cmdf__listing_section(entries, count, 1, fresh.doc_header, fresh.ruler, width,
+                                              fresh.text);
+            if (undoc_cmds > 0)
+                fresh.len += cmdf__listing_section(entries, count, 0, fresh.undoc_header, fresh.ruler,
+                                                   width, fresh.text + fresh.len);
+        }
+
+        if (listing != &fresh) {
+            cmdf__listing_drop(listing);
+            *listing = fresh;
+        }
+    }
+
+    if (listing->text)
+        cmdf__write(cmdf__ctx, listing->text, listing->len);
+
+    if (listing == &fresh)
+        CMDF_FREE(fresh.text);
+
+    cmdf__menu_leave(settings);
+}
+
+/* Init/Free functions */
+void cmdf_init(const char *prompt, const char *intro, const char *doc_header,
+               const char *undoc_header, char ruler, int use_default_exit) {
+    cmdf_init_ctx(cmdf__ctx, prompt, intro, doc_header, undoc_header, ruler, use_default_exit);
+}
+
+/* Commands registered in every menu. The exit command comes second, as it's optional. */
+static const struct cmdf__entry_s cmdf__default_entries[] = {
+    { "help", "Get information on a command or list commands.", cmdf__default_do_help, 0, NULL },
+    { "exit", "Quit the application", cmdf__default_do_exit, 0, NULL }
+    #ifdef CMDF_THREAD_SUPPORT
+        ,
+        { "jobs", "List background jobs.", cmdf__default_do_jobs, 0, NULL },
+        { "wait", "Wait for a background job to finish. With no job ID, wait for all of them.",
+          cmdf__default_do_wait, 0, NULL },
+        { "kill", "Cancel a queued background job.", cmdf__default_do_kill, 0, NULL }
+    #endif
+
+    #ifdef CMDF_APROPOS_SUPPORT
+        ,
+        { "apropos", "Search the names and help of all commands for keywords. Best matches come first.",
+          cmdf__default_do_apropos, 0, NULL }
+    #endif
+};
+
+/*
+ * Push a new menu with the given properties onto the settings stack of ctx.
+ * Its commands start right after the ones of the menu below it.
+ */
+struct cmdf__settings_s *cmdf__push_menu(struct cmdf__context_s *ctx, const char *prompt,
+                                         const char *intro, const char *doc_header,
+                                         const char *undoc_header, char ruler) {
+    /* Create new settings to push them to stack */
+    struct cmdf__settings_s settings;
+    memset((void *)&settings, 0, sizeof(struct cmdf__settings_s));
+
+    /* Set properties */
+    settings.prompt = prompt ? prompt : cmdf__default_prompt;
+    settings.intro = intro ? intro : cmdf__default_intro;
+    settings.doc_header = doc_header ? doc_header : cmdf__default_doc_header;
+    settings.undoc_header = undoc_header ? undoc_header : cmdf__default_undoc_header;
+    settings.ruler = ruler ? ruler : cmdf__default_ruler;
+    settings.doc_cmds = settings.undoc_cmds = settings.entry_count = 0;
+
+    /* If not first - look for actual entry_start index. Menus using a catalog take no entries. */
+    if (ctx->settings_stack.size) {
+        settings.entry_start = ctx->settings_stack.top->entry_start;
+        if (!ctx->settings_stack.top->catalog)
+            settings.entry_start += ctx->settings_stack.top->entry_count;
+    }
+
+    /* Set command callbacks */
+    settings.do_command = cmdf__default_do_command;
+    settings.do_emptyline = cmdf__default_do_emptyline;
+
+    /* Push value to the stack */
+    if (ctx->settings_stack.size < CMDF_MAX_SUBPROCESSES) {
+        ctx->settings_stack.stack[ctx->settings_stack.size] = settings;
+        ctx->settings_stack.top = ctx->settings_stack.stack + ctx->settings_stack.size;
+        ctx->settings_stack.size++;
+    } else {
+        cmdf__printf(ctx, "max subprocesses count reached!\n");
+        exit(CMDF_ERROR_OUT_OF_PROCESS_STACK); /* maybe handle error somehow */
+    }
+
+    #ifdef CMDF_READLINE_SUPPORT
+        /* Set completion function */
+        rl_attempted_completion_function = cmdf__command_name_completion;
+    #endif
+
+    return ctx->settings_stack.top;
+}
+
+void cmdf_init_ctx(cmdf_context *ctx, const char *prompt, const char *intro, const char *doc_header,
+                   const char *undoc_header, char ruler, int use_default_exit) {
+    size_t i;
+
+    /* The menu stack belongs to the foreground */
+    if (cmdf__job_of(ctx)) {
+        cmdf__printf(ctx, "Background jobs can't open submenus.\n");
+        return;
+    }
+
+    cmdf__push_menu(ctx, prompt, intro, doc_header, undoc_header, ruler);
+
+    /* Register default callbacks, skipping exit if not required */
+    for (i = 0; i < sizeof(cmdf__default_entries) / sizeof(cmdf__default_entries[0]); i++)
+        if (use_default_exit || cmdf__default_entries[i].callback != cmdf__default_do_exit)
+            cmdf_register_command_ctx(ctx, cmdf__default_entries[i].callback,
+                                      cmdf__default_entries[i].cmdname,
+                                      cmdf__default_entries[i].help, 0);
+}
+
+/*
+ * Push a new menu whose commands are those of a frozen catalog, rather than registered
+ * to ctx. The catalog is shared, not copied, so it must outlive the menu.
+ * Returns CMDF_OK, or CMDF_ERROR_ARGUMENT_ERROR if the catalog is not frozen yet.
+ */
+CMDF_RETURN cmdf_init_catalog(cmdf_context *ctx, const cmdf_catalog *catalog, const char *prompt,
+                              const char *intro, const char *doc_header, const char *undoc_header,
+                              char ruler) {
+    struct cmdf__settings_s *settings;
+
+    if (!catalog->frozen || cmdf__job_of(ctx))
+        return CMDF_ERROR_ARGUMENT_ERROR;
+
+    settings = cmdf__push_menu(ctx, prompt, intro, doc_header, undoc_header, ruler);
+    settings->catalog = catalog;
+
+    return CMDF_OK;
+}
+
+/*
+ * Create a new interpreter context, to run an interpreter that is independent of the
+ * default one. Initialize it with cmdf_init_ctx(), or make it the calling thread's
+ * context with cmdf_set_context() and use cmdf_init().
+ * Returns NULL if memory could not be allocated.
+ */
+cmdf_context *cmdf_context_create(void) {
+    cmdf_context *ctx = (cmdf_context *)(CMDF_MALLOC(sizeof(cmdf_context)));
+
+    if (ctx)
+        memset(ctx, 0, sizeof(cmdf_context));
+
+    return ctx;
+}
+
+/*
+ * Release everything a context holds besides its own memory: its background jobs, the
+ * output still buffered, its caches and indexes, and its history. Done whenever a
+ * context goes away, so every cache it gains has to be dropped here.
+ */
+void cmdf__context_release(struct cmdf__context_s *ctx) {
+    size_t i;
+
+    /* Jobs write their output themselves, so it comes before what's left buffered */
+    #ifdef CMDF_THREAD_SUPPORT
+        cmdf__jobs_cancel_all(ctx);
+    #endif
+
+    #ifdef CMDF_COROUTINE_SUPPORT
+        cmdf__coroutines_cancel(ctx);
+    #endif
+
+    cmdf__end_message(ctx);
+    cmdf__drain(ctx);
+
+    if (ctx->output_buffer.spool)
+        fclose(ctx->output_buffer.spool);
+
+    for (i = 0; i < sizeof(ctx->info) / sizeof(ctx->info[0]); i++) {
+        cmdf__completions_drop(ctx->info + i);
+        cmdf__help_drop(ctx->info + i);
+    }
+
+    for (i = 0; i < CMDF_MAX_SUBPROCESSES; i++) {
+        cmdf__listing_drop(ctx->listings + i);
+        cmdf__name_index_drop(ctx->name_indexes + i);
+
+        #ifdef CMDF_APROPOS_SUPPORT
+            cmdf__apropos_drop(ctx->apropos + i);
+        #endif
+    }
+
+    #ifdef CMDF_LINEEDIT_SUPPORT
+        while (ctx->history.count--)
+            CMDF_FREE(ctx->history.lines[(ctx->history.first + ctx->history.count) % CMDF_HISTORY_SIZE]);
+
+        if (ctx->history.persistent)
+            close(ctx->history.fd);
+    #endif
+
+    if (cmdf__ctx == ctx)
+        cmdf__ctx = &cmdf__default_context;
+}
+
+/* Destroy a context created by cmdf_context_create(), after its background jobs are over */
+void cmdf_context_destroy(cmdf_context *ctx) {
+    if (!ctx || ctx == &cmdf__default_context)
+        return;
+
+    cmdf__context_release(ctx);
+    CMDF_FREE(ctx);
+}
+
+/* Get the calling thread's context. Inside a command callback, this is the dispatching context. */
+cmdf_context *cmdf_get_context(void) {
+    return cmdf__ctx;
+}
+
+/* Make ctx the context the calling thread's context-less calls work with. NULL restores the default. */
+void cmdf_set_context(cmdf_context *ctx) {
+    cmdf__ctx = ctx ? ctx : &cmdf__default_context;
+}
+
+/* Public interface functions */
+void cmdf_commandloop(void) {
+    cmdf__default_commandloop(cmdf__ctx);
+}
+
+void cmdf_commandloop_ctx(cmdf_context *ctx) {
+    cmdf__default_commandloop(ctx);
+}
+
+/* Getters */
+const char *cmdf_get_prompt(void) {
+    return cmdf__active_menu(cmdf__ctx)->prompt;
+}
+
+const char *cmdf_get_intro(void) {
+    return cmdf__active_menu(cmdf__ctx)->intro;
+}
+
+const char *cmdf_get_doc_header(void) {
+    return cmdf__active_menu(cmdf__ctx)->doc_header;
+}
+
+const char *cmdf_get_undoc_header(void) {
+    return cmdf__active_menu(cmdf__ctx)->undoc_header;
+}
+
+char cmdf_get_ruler(void) {
+    return cmdf__active_menu(cmdf__ctx)->ruler;
+}
+
+int cmdf_get_command_count(void) {
+    int count;
+
+    cmdf__menu_enter(cmdf__ctx, cmdf__active_menu(cmdf__ctx), &count, NULL);
+    cmdf__menu_leave(cmdf__active_menu(cmdf__ctx));
+
+    return count;
+}
+
+/* The stream libcmdf prints to. Callbacks should print to it as well,
+ * so their output reaches server sessions. Output libcmdf buffered is written first.
+ * A context with an I/O backend gets a temporary file, forwarded to the backend in order,
+ * and so does a job whose output is held. */
+FILE *cmdf_get_output(void) {
+    struct cmdf__output_buffer_s *buffer = cmdf__output_buffer(cmdf__ctx);
+
+    cmdf__end_message(cmdf__ctx);
+    cmdf__drain(cmdf__ctx);
+
+    if ((cmdf__ctx->io.write || buffer->hold) && (buffer->spool || (buffer->spool = tmpfile())))
+        return buffer->spool;
+
+    return cmdf__output(cmdf__ctx);
+}
+
+int cmdf_get_output_format(void) {
+    return cmdf__ctx->format;
+}
+
+/* Setters */
+void cmdf_set_prompt(const char *new_prompt) {
+    cmdf__active_menu(cmdf__ctx)->prompt = new_prompt ? new_prompt : cmdf__default_prompt;
+}
+
+void cmdf_set_intro(const char *new_intro) {
+    cmdf__active_menu(cmdf__ctx)->intro = new_intro ? new_intro : cmdf__default_intro;
+}
+
+void cmdf_set_doc_header(const char *new_doc_header) {
+    cmdf__active_menu(cmdf__ctx)->doc_header = new_doc_header ? new_doc_header : cmdf__default_doc_header;
+}
+
+void cmdf_set_undoc_header(const char *new_undoc_header) {
+    cmdf__active_menu(cmdf__ctx)->undoc_header = new_undoc_header ? new_undoc_header : cmdf__default_undoc_header;
+}
+
+void cmdf_set_output(FILE *new_output) {
+    cmdf__flush(cmdf__ctx);
+    cmdf__ctx->out = new_output;
+}
+
+/*
+ * Choose between text output, and a JSON object per line. JSON output needs vsnprintf(),
+ * so it's only available in C99, C++11 or later. Returns CMDF_ERROR_ARGUMENT_ERROR if the
+ * format isn't available.
+ */
+CMDF_RETURN cmdf_set_output_format(int format) {
+    if (format != CMDF_OUTPUT_TEXT && format != CMDF_OUTPUT_JSON)
+        return CMDF_ERROR_ARGUMENT_ERROR;
+
+    #ifndef CMDF__HAVE_VSNPRINTF
+        if (format == CMDF_OUTPUT_JSON)
+            return CMDF_ERROR_ARGUMENT_ERROR;
+    #endif
+
+    cmdf__flush(cmdf__ctx);
+    cmdf__ctx->format = format;
+
+    return CMDF_OK;
+}
+
+/*
+ * Read input and write output of the current context through the given backend, instead
+ * of CMDF_STDIN and the output stream, e.g. to run it over a pipe or an in-memory buffer.
+ * The backend is copied, and NULL goes back to the streams. Writing to a backend needs
+ * vsnprintf(), like JSON output. Returns CMDF_ERROR_ARGUMENT_ERROR if it isn't available.
+ */
+CMDF_RETURN cmdf_set_io(const struct cmdf_io *io) {
+    #ifndef CMDF__HAVE_VSNPRINTF
+        if (io && io->write)
+            return CMDF_ERROR_ARGUMENT_ERROR;
+    #endif
+
+    cmdf__flush(cmdf__ctx);
+
+    if (io)
+        cmdf__ctx->io = *io;
+    else
+        memset(&cmdf__ctx->io, 0, sizeof(struct cmdf_io));
+
+    /* Streams are printed to directly */
+    if (!cmdf__ctx->io.write && cmdf__ctx->output_buffer.spool) {
+        fclose(cmdf__ctx->output_buffer.spool);
+        cmdf__ctx->output_buffer.spool = NULL;
+    }
+
+    /* Measure the window again, for the new output */
+    cmdf__ctx->winsize_resizes = 0;
+
+    return CMDF_OK;
+}
+
+/*
+ * Structured output for command callbacks. In JSON output, a record is a line of its own,
+ * such as {"type":"disk","name":"sda","size":512}, written in order with libcmdf's own
+ * output. In text output, its fields are printed one per line, as "name: sda".
+ */
+void cmdf_record_begin(const char *type) {
+    if (cmdf__ctx->format == CMDF_OUTPUT_JSON)
+        cmdf__record_begin(cmdf__ctx, type);
+}
+
+void cmdf_record_string(const char *key, const char *value) {
+    if (cmdf__ctx->format == CMDF_OUTPUT_JSON) {
+        cmdf__record_key(cmdf__ctx, key);
+        cmdf__json_string(cmdf__ctx, value);
+    }
+    else
+        cmdf__printf(cmdf__ctx, "%s: %s\n", key, value ? value : "");
+}
+
+void cmdf_record_number(const char *key, long value) {
+    if (cmdf__ctx->format == CMDF_OUTPUT_JSON)
+        cmdf__record_number(cmdf__ctx, key, value);
+    else
+        cmdf__printf(cmdf__ctx, "%s: %ld\n", key, value);
+}
+
+void cmdf_record_end(void) {
+    if (cmdf__ctx->format == CMDF_OUTPUT_JSON)
+        cmdf__record_end(cmdf__ctx);
+}
+
+/* Argument Parsing */
+cmdf_arglist *cmdf_parse_arguments(char *argline) {
+    cmdf_arglist *arglist = NULL;
+    size_t i;
+    char *strptr, *startptr;
+    enum states { NONE, IN_WORD, IN_QUOTES } state = NONE;
+
+    /* Check if there are any arguments */
+    if (!argline)
+        return NULL;
+
+    /* Allocate argument list */
+    arglist = (cmdf_arglist *)(CMDF_MALLOC(sizeof(cmdf_arglist)));
+    if (!arglist)
+        return NULL;
+
+    arglist->count = 0;
+
+    /* First pass on the arguments line - use the state machine to determine how many
+     * argument do we have. */
+    for (strptr = startptr = argline, i = 0; *strptr; strptr++) {
+        switch (state) {
+            case NONE:
+                /* 
+                 * Space = Don't care.
+                 * Quotes = a quoted argument begins.
+                 * Anything else = Inside a word. 
+                 */
+                if (isspace((int)*strptr))
+                    continue;
+                else if (*strptr == '\"')
+                    state = IN_QUOTES;
+                else
+                    state = IN_WORD;
+
+                break;
+            case IN_QUOTES:
+                /*
+                 * Space = Don't care, since we're inside quotes.
+                 * Quotes = Quotes have ended, so count++
+                 * Anything else = Don't care, since we're inside quotes.
+                 */
+                if (isspace((int)*strptr))
+                    continue;
+                else if (*strptr == '\"') {
+                    state = NONE;
+                    arglist->count++;
+                    
+                    break;
+                }
+                else
+                    continue;
+            case IN_WORD:
+                /* 
+                 * Space = A word just terminated, so count++
+                 * Quotes = Ignore - quote is part of the word
+                 * Anything else = Still in word
+                 */
+                if (isspace((int)*strptr)) {
+                    state = NONE;
+                    arglist->count++;
+
+                    break;
+                }
+                else if (*strptr == '\"')
+                    continue;
+                else
+                    continue;
+        }
+    }
+
+    /* Handle last argument counting, if any */
+    if (state != NONE)
+        arglist->count++;
+
+    /* Now we can allocate the argument list */
+    arglist->args = (char **)(CMDF_MALLOC(sizeof(char *) * (arglist->count + 1))); /* + NULL */
+    if (!arglist->args) {
+        CMDF_FREE(arglist);
+        return NULL;
+    }
+
+    /* Populate argument list */
+    state = NONE;
+    for (strptr = startptr = argline, i = 0; *strptr; strptr++) {
+        switch (state) {
+            case NONE:
+                /* Space = No word yet.
+                 * Quotes = Quotes started, so ignore everything inbetween.
+                 * Else = Probably a word. */
+                if (isspace((int)*strptr))
+                    continue;
+                else if (*strptr == '\"') {
+                    state = IN_QUOTES;
+                    startptr = strptr + 1;
+                }
+                else {
+                    state = IN_WORD;
+                    startptr = strptr;
+                }
+
+                break;
+            case IN_QUOTES:
+                /* Space = Ignore it, iterate futher.
+                 * Quotes = End quotes, so put the entire quoted part as an argument.
+                 * Else = Whatever is between the quotes */
+                if (*strptr == '\"') {
+                    *strptr = '\0';
+                    arglist->args[i++] = cmdf__strdup(startptr);
+                    state = NONE;
+                }
+
+                break;
+            case IN_WORD:
+                /* Space = End of word, so parse it.
+                 * Quote = Some quote inside of a word. We treat it is a word.
+                 * Else = Still a word. */
+                if (isspace((int)*strptr)) {
+                    *strptr = '\0';
+                    arglist->args[i++] = cmdf__strdup(startptr);
+                    state = NONE;
+                }
+
+                break;
+        }
+    }
+
+    /* Get the last argument, if any. */
+    if (state != NONE && i < arglist->count)
+        arglist->args[i++] = cmdf__strdup(startptr);
+
+    /* Set up null terminator in the argument list */
+    arglist->args[i] = NULL;
+
+    return arglist;
+}
+
+void cmdf_free_arglist(cmdf_arglist *arglist) {
+    size_t i;
+
+    /* Check if any argument list was provided. */
+    if (arglist) {
+        /* Free every argument */
+        for (i = 0; i < arglist->count - 1; i++)
+            CMDF_FREE(arglist->args[i]);
+
+        CMDF_FREE(arglist->args);
+    }
+
+    CMDF_FREE(arglist);
+}
+
+/* Adding/Removing Command Entries */
+CMDF_RETURN cmdf_register_command(cmdf_command_callback callback, const char *cmdname, 
+                          const char *help) {
+    return cmdf_register_command_ex(callback, cmdname, help, 0);
+}
+
+CMDF_RETURN cmdf_register_command_ex(cmdf_command_callback callback, const char *cmdname,
+                                     const char *help, int flags) {
+    return cmdf_register_command_ctx(cmdf__ctx, callback, cmdname, help, flags);
+}
+
+CMDF_RETURN cmdf_register_command_ctx(cmdf_context *ctx, cmdf_command_callback callback,
+                                      const char *cmdname, const char *help, int flags) {
+    struct cmdf__settings_s *settings;
+    int new_index;
+
+    /* Background jobs can't change menus, and commands of menus using a catalog are fixed */
+    if (cmdf__job_of(ctx))
+        return CMDF_ERROR_ARGUMENT_ERROR;
+
+    settings = ctx->settings_stack.top;
+    if (settings->catalog)
+        return CMDF_ERROR_CATALOG_FROZEN;
+
+    /* Increate entry count, first checking if we can add more */
+    if (settings->entry_count == CMDF_MAX_COMMANDS)
+        return CMDF_ERROR_TOO_MANY_COMMANDS;
+
+    /* Initialize new entry. Its slot may have held a command of an exited submenu,
+     * whose background jobs report their statistics back to it until it's taken over. */
+    new_index = settings->entry_start + settings->entry_count;
+
+    /* Its caches are dropped with the locks their users take */
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&cmdf__completions_lock);
+    #endif
+
+    cmdf__completions_drop(ctx->info + new_index);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__completions_lock);
+        pthread_mutex_lock(&cmdf__help_lock);
+    #endif
+
+    cmdf__help_drop(ctx->info + new_index);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__help_lock);
+        pthread_mutex_lock(&cmdf__jobs_lock);
+    #endif
+
+    ctx->entries[new_index].callback = callback;
+    ctx->entries[new_index].cmdname = cmdname;
+    ctx->entries[new_index].help = help;
+    ctx->entries[new_index].flags = flags;
+    ctx->entries[new_index].info = ctx->info + new_index;
+    memset(ctx->info + new_index, 0, sizeof(struct cmdf__command_info_s));
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__jobs_lock);
+        pthread_mutex_lock(&cmdf__help_lock);
+    #endif
+
+    cmdf__help_prepare(ctx->info + new_index, help);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__help_lock);
+    #endif
+
+    cmdf__listing_drop(ctx->listings + (settings - ctx->settings_stack.stack));
+    cmdf__name_index_drop(ctx->name_indexes + (settings - ctx->settings_stack.stack));
+
+    settings->entry_count++;
+
+    /* Once searched, the help search index is kept up to date */
+    #ifdef CMDF_APROPOS_SUPPORT
+        if (ctx->apropos[settings - ctx->settings_stack.stack].built)
+            cmdf__apropos_sync(ctx->apropos + (settings - ctx->settings_stack.stack),
+                               ctx->entries + settings->entry_start, settings->entry_count);
+    #endif
+
+    /* Check doc */
+    if (help)
+        settings->doc_cmds++;
+    else
+        settings->undoc_cmds++;
+
+    return CMDF_OK;
+}
+
+/* Order catalog index entries by name, then by registration order */
+int cmdf__catalog_compare(const void *a, const void *b) {
+    const struct cmdf__entry_s *entry_a = *(const struct cmdf__entry_s * const *)a;
+    const struct cmdf__entry_s *entry_b = *(const struct cmdf__entry_s * const *)b;
+    int cmp = strcmp(entry_a->cmdname, entry_b->cmdname);
+
+    return cmp ? cmp : (entry_a < entry_b ? -1 : entry_a > entry_b);
+}
+
+/* Rebuild the sorted index of a catalog version */
+void cmdf__catalog_table_index(struct cmdf__catalog_table_s *table) {
+    int i;
+
+    for (i = 0; i < table->entry_count; i++)
+        table->index[i] = table->entries + i;
+
+    qsort(table->index, table->entry_count, sizeof(table->index[0]), cmdf__catalog_compare);
+}
+
+/* Catalog versions handed out so far, so layouts made for one can tell it from any other */
+static unsigned long cmdf__catalog_versions = 0;
+
+/*
+ * Add a command to a version of the given catalog, replacing any command by the same name.
+ * A replaced command keeps its time limit and statistics.
+ */
+CMDF_RETURN cmdf__catalog_table_add(struct cmdf__catalog_s *catalog, struct cmdf__catalog_table_s *table,
+                                    cmdf_command_callback callback, const char *cmdname,
+                                    const char *help, int flags) {
+    struct cmdf__entry_s *entry;
+
+    for (entry = table->entries; entry < table->entries + table->entry_count; entry++)
+        if (strcmp(entry->cmdname, cmdname) == 0)
+            break;
+
+    if (entry == table->entries + table->entry_count) {
+        if (table->entry_count == CMDF_MAX_COMMANDS)
+            return CMDF_ERROR_TOO_MANY_COMMANDS;
+
+        /* Entries keep their slot in later versions, so no reader is using this one */
+        entry->info = catalog->info + table->entry_count;
+        memset(entry->info, 0, sizeof(struct cmdf__command_info_s));
+        table->entry_count++;
+    }
+    else if (entry->help)
+        table->doc_cmds--;
+    else
+        table->undoc_cmds--;
+
+    entry->callback = callback;
+    entry->cmdname = cmdname;
+    entry->help = help;
+    entry->flags = flags;
+    table->version = CMDF__RELAXED_ADD(cmdf__catalog_versions, 1);
+
+    /* Readers of older versions may be printing its help */
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&cmdf__help_lock);
+    #endif
+
+    cmdf__help_prepare(entry->info, help);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__help_lock);
+    #endif
+
+    if (help)
+        table->doc_cmds++;
+    else
+        table->undoc_cmds++;
+
+    return CMDF_OK;
+}
+
+/*
+ * Create an empty command catalog, with the default commands registered.
+ * Returns NULL if memory could not be allocated.
+ */
+cmdf_catalog *cmdf_catalog_create(int use_default_exit) {
+    cmdf_catalog *catalog = (cmdf_catalog *)(CMDF_MALLOC(sizeof(cmdf_catalog)));
+    size_t i;
+
+    if (!catalog)
+        return NULL;
+
+    memset(catalog, 0, sizeof(cmdf_catalog));
+    if (!(catalog->table = (struct cmdf__catalog_table_s *)(CMDF_MALLOC(sizeof(struct cmdf__catalog_table_s))))) {
+        CMDF_FREE(catalog);
+        return NULL;
+    }
+
+    memset(catalog->table, 0, sizeof(struct cmdf__catalog_table_s));
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_init(&catalog->write_lock, NULL);
+    #endif
+
+    for (i = 0; i < sizeof(cmdf__default_entries) / sizeof(cmdf__default_entries[0]); i++) {
+        if (use_default_exit || cmdf__default_entries[i].callback != cmdf__default_do_exit) {
+            catalog->table->entries[catalog->table->entry_count] = cmdf__default_entries[i];
+            catalog->table->entries[catalog->table->entry_count].info =
+                catalog->info + catalog->table->entry_count;
+            catalog->table->entry_count++;
+        }
+    }
+
+    catalog->table->doc_cmds = catalog->table->entry_count;
+
+    return catalog;
+}
+
+/* Destroy a catalog, once no menu uses it anymore */
+void cmdf_catalog_destroy(cmdf_catalog *catalog) {
+    int i;
+    #ifdef CMDF_THREAD_SUPPORT
+        struct cmdf__catalog_table_s *table;
+
+        while ((table = catalog->retired)) {
+            catalog->retired = table->next;
+            CMDF_FREE(table);
+        }
+
+        pthread_mutex_destroy(&catalog->write_lock);
+    #endif
+
+    for (i = 0; i < CMDF_MAX_COMMANDS; i++) {
+        cmdf__completions_drop(catalog->info + i);
+        cmdf__help_drop(catalog->info + i);
+    }
+
+    CMDF_FREE(catalog->table);
+    CMDF_FREE(catalog);
+}
+
+/*
+ * Add a command to a catalog, replacing any command by the same name.
+ * Once the catalog is frozen, this is only possible if thread support is enabled: the
+ * change is then made to a copy, which is published atomically, so other threads can
+ * keep dispatching against the catalog without locking. Registrations are serialized.
+ */
+CMDF_RETURN cmdf_catalog_register_command(cmdf_catalog *catalog, cmdf_command_callback callback,
+                                          const char *cmdname, const char *help, int flags) {
+    #ifdef CMDF_THREAD_SUPPORT
+        struct cmdf__catalog_table_s *table;
+        CMDF_RETURN retflag;
+    #endif
+
+    if (!catalog->frozen)
+        return cmdf__catalog_table_add(catalog, catalog->table, callback, cmdname, help, flags);
+
+    #ifndef CMDF_THREAD_SUPPORT
+        return CMDF_ERROR_CATALOG_FROZEN;
+    #else
+        pthread_mutex_lock(&catalog->write_lock);
+
+        table = (struct cmdf__catalog_table_s *)(CMDF_MALLOC(sizeof(struct cmdf__catalog_table_s)));
+        if (!table)
+            retflag = CMDF_ERROR_OUT_OF_MEMORY;
+        else {
+            *table = *catalog->table;
+
+            if ((retflag = cmdf__catalog_table_add(catalog, table, callback, cmdname, help, flags)) == CMDF_OK) {
+                cmdf__catalog_table_index(table);
+                cmdf__catalog_publish(catalog, table);
+            }
+            else
+                CMDF_FREE(table);
+        }
+
+        pthread_mutex_unlock(&catalog->write_lock);
+
+        return retflag;
+    #endif
+}
+
+/*
+ * Freeze a catalog, after which it may be shared by any number of contexts and
+ * threads without locking.
+ */
+void cmdf_catalog_freeze(cmdf_catalog *catalog) {
+    if (catalog->frozen)
+        return;
+
+    cmdf__catalog_table_index(catalog->table);
+    catalog->frozen = 1;
+}
+
+/*
+ * Find a command in the given settings' commands list, and copy its entry to found,
+ * so it can be used after the catalog changes. Returns 1 if found, 0 otherwise.
+ */
+int cmdf__find_entry(struct cmdf__context_s *ctx, const struct cmdf__settings_s *settings,
+                     const char *cmdname, struct cmdf__entry_s *found) {
+    const struct cmdf__catalog_table_s *table;
+    const struct cmdf__entry_s *entries;
+    int i, low, high, count;
+
+    /* Catalogs are searched through their index */
+    if (settings->catalog) {
+        table = cmdf__catalog_enter(settings->catalog);
+
+        for (low = 0, high = table->entry_count; low < high; ) {
+            i = low + (high - low) / 2;
+            if (strcmp(table->index[i]->cmdname, cmdname) < 0)
+                low = i + 1;
+            else
+                high = i;
+        }
+
+        if ((i = low < table->entry_count && strcmp(table->index[low]->cmdname, cmdname) == 0))
+            *found = *table->index[low];
+
+        cmdf__catalog_leave(settings->catalog);
+
+        return i;
+    }
+
+    entries = cmdf__menu_enter(ctx, settings, &count, NULL);
+    for (i = 0; i < count; i++) {
+        if (strcmp(cmdname, entries[i].cmdname) == 0) {
+            *found = entries[i];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Limit the run time of a command of the current menu, or lift the limit with 0.
+ * Past its limit, cmdf_cancelled() returns nonzero while it runs, and the command fails
+ * with CMDF_ERROR_TIMED_OUT. For menus using a catalog, the limit is shared by all of them.
+ */
+CMDF_RETURN cmdf_set_command_timeout(const char *cmdname, unsigned int seconds) {
+    struct cmdf__entry_s entry;
+
+    if (!cmdf__find_entry(cmdf__ctx, cmdf__active_menu(cmdf__ctx), cmdname, &entry))
+        return CMDF_ERROR_UNKNOWN_COMMAND;
+
+    CMDF__RELAXED_STORE(entry.info->timeout, seconds);
+
+    return CMDF_OK;
+}
+
+/* Get the statistics of a command of the current menu */
+CMDF_RETURN cmdf_get_command_stats(const char *cmdname, struct cmdf_command_stats *stats) {
+    struct cmdf__entry_s entry;
+
+    if (!cmdf__find_entry(cmdf__ctx, cmdf__active_menu(cmdf__ctx), cmdname, &entry))
+        return CMDF_ERROR_UNKNOWN_COMMAND;
+
+    stats->calls = CMDF__RELAXED_LOAD(entry.info->stats.calls);
+    stats->cancellations = CMDF__RELAXED_LOAD(entry.info->stats.cancellations);
+    stats->overruns = CMDF__RELAXED_LOAD(entry.info->stats.overruns);
+    stats->total_ms = CMDF__RELAXED_LOAD(entry.info->stats.total_ms);
+    stats->max_ms = CMDF__RELAXED_LOAD(entry.info->stats.max_ms);
+
+    return CMDF_OK;
+}
+
+/*
+ * Collect the names of a menu's commands starting with the given prefix into names,
+ * which must have room for CMDF_MAX_COMMANDS of them. Catalog commands come out sorted,
+ * as they are found through the index. Returns the number of names.
+ */
+int cmdf__match_commands(struct cmdf__context_s *ctx, const struct cmdf__settings_s *settings,
+                         const char *prefix, size_t len, const char **names) {
+    const struct cmdf__catalog_table_s *table;
+    const struct cmdf__entry_s *entries;
+    int i, low, high, count, matches = 0;
+
+    /* Names starting with the prefix are a range of the index */
+    if (settings->catalog) {
+        table = cmdf__catalog_enter(settings->catalog);
+
+        for (low = 0, high = table->entry_count; low < high; ) {
+            i = low + (high - low) / 2;
+            if (strncmp(table->index[i]->cmdname, prefix, len) < 0)
+                low = i + 1;
+            else
+                high = i;
+        }
+
+        for (i = low; i < table->entry_count && strncmp(table->index[i]->cmdname, prefix, len) == 0; i++)
+            names[matches++] = table->index[i]->cmdname;
+
+        cmdf__catalog_leave(settings->catalog);
+
+        return matches;
+    }
+
+    entries = cmdf__menu_enter(ctx, settings, &count, NULL);
+    for (i = 0; i < count; i++)
+        if (strncmp(entries[i].cmdname, prefix, len) == 0)
+            names[matches++] = entries[i].cmdname;
+
+    cmdf__menu_leave(settings);
+
+    return matches;
+}
+
+/* Longest names, and most names, suggested for an unknown command */
+#define CMDF__SUGGEST_MAX_LEN 64
+#define CMDF__SUGGEST_COUNT 5
+
+/*
+ * Edit distance between two names: the Levenshtein distance, with a swap of two adjacent
+ * characters counting as one edit (the optimal string alignment distance). Only the cells
+ * within bound of the diagonal are worked out, and it gives up as soon as a whole row is
+ * past bound. Names must be at most CMDF__SUGGEST_MAX_LEN long. Returns bound + 1 if
+ * they're further apart than bound.
+ */
+size_t cmdf__edit_distance(const char *a, size_t alen, const char *b, size_t blen, size_t bound) {
+    size_t rows[3][CMDF__SUGGEST_MAX_LEN + 2], *prev2 = rows[0], *prev = rows[1], *cur = rows[2], *tmp;
+    size_t i, j, lo, hi, best, d;
+
+    if ((alen > blen ? alen - blen : blen - alen) > bound)
+        return bound + 1;
+
+    for (j = 0; j <= blen && j <= bound; j++)
+        prev[j] = j;
+
+    if (j <= blen)
+        prev[j] = bound + 1;
+
+    for (i = 1; i <= alen; i++) {
+        lo = i > bound ? i - bound : 1;
+        hi = i + bound < blen ? i + bound : blen;
+        cur[lo - 1] = lo == 1 ? i : bound + 1;
+        best = cur[lo - 1];
+
+        for (j = lo; j <= hi; j++) {
+            d = prev[j - 1] + (a[i - 1] != b[j - 1]);
+            if (prev[j] + 1 < d)
+                d = prev[j] + 1;
+            if (cur[j - 1] + 1 < d)
+                d = cur[j - 1] + 1;
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && prev2[j - 2] + 1 < d)
+                d = prev2[j - 2] + 1;
+
+            cur[j] = d;
+            if (d < best)
+                best = d;
+        }
+
+        /* Cells right past the band are read by the next row */
+        if (hi < blen)
+            cur[hi + 1] = bound + 1;
+
+        if (best > bound)
+            return bound + 1;
+
+        tmp = prev2;
+        prev2 = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    return prev[blen] <= bound ? prev[blen] : bound + 1;
+}
+
+/*
+ * Find the commands of a menu nearest to an unknown name, if any are close enough: one
+ * edit away for names of up to five characters, two for up to nine, and three for longer
+ * ones. Only the nearest ones are kept, at most CMDF__SUGGEST_COUNT of them, in suggestions.
+ * Returns how many there are.
+ */
+int cmdf__suggest(struct cmdf__context_s *ctx, const struct cmdf__settings_s *settings,
+                  const char *cmdname, const char **suggestions) {
+    const struct cmdf__entry_s *entries;
+    size_t len = strlen(cmdname), bound, d, entrylen;
+    int i, j, count, n = 0;
+
+    if (len == 0 || len > CMDF__SUGGEST_MAX_LEN)
+        return 0;
+
+    bound = len <= 5 ? 1 : (len <= 9 ? 2 : 3);
+
+    entries = cmdf__menu_enter(ctx, settings, &count, NULL);
+
+    for (i = 0; i < count; i++) {
+        entrylen = strlen(entries[i].cmdname);
+        if (entrylen > CMDF__SUGGEST_MAX_LEN)
+            continue;
+
+        /* Once something is found, only names at least as near are worth looking at */
+        d = cmdf__edit_distance(cmdname, len, entries[i].cmdname, entrylen, bound);
+        if (d > bound)
+            continue;
+
+        if (d < bound) {
+            bound = d;
+            n = 0;
+        }
+
+        /* Keep the nearest names in order, dropping the last one if there are too many */
+        for (j = n < CMDF__SUGGEST_COUNT ? n++ : CMDF__SUGGEST_COUNT;
+             j > 0 && strcmp(suggestions[j - 1], entries[i].cmdname) > 0; j--)
+            if (j < CMDF__SUGGEST_COUNT)
+                suggestions[j] = suggestions[j - 1];
+
+        if (j < CMDF__SUGGEST_COUNT)
+            suggestions[j] = entries[i].cmdname;
+    }
+
+    cmdf__menu_leave(settings);
+
+    return n;
+}
+
+/* Suggest the commands of a menu nearest to an unknown name, if any are close enough */
+void cmdf__print_suggestions(struct cmdf__context_s *ctx, const struct cmdf__settings_s *settings,
+                             const char *cmdname) {
+    const char *suggestions[CMDF__SUGGEST_COUNT];
+    int i, n = cmdf__suggest(ctx, settings, cmdname, suggestions);
+
+    for (i = 0; i < n; i++) {
+        cmdf__puts(ctx, i == 0 ? "Did you mean '" : (i + 1 < n ? ", '" : " or '"));
+        cmdf__puts(ctx, suggestions[i]);
+        cmdf__puts(ctx, "'");
+    }
+
+    if (n)
+        cmdf__puts(ctx, "?\n");
+}
+
+/* Names of the error codes, for structured output */
+static const char *cmdf__error_names[] = {
+    NULL, "too_many_commands", "too_many_args", "unknown_command", "argument_error", "out_of_memory",
+    "out_of_process_stack", "too_many_jobs", "system", "catalog_frozen", "cancelled", "timed_out"
+};
+
+/*
+ * Report how a command went in a result record, in JSON output: its name, background job
+ * (if any), return code and error, time taken, and suggestions for unknown commands if
+ * settings is given.
+ */
+void cmdf__record_result(struct cmdf__context_s *ctx, const struct cmdf__settings_s *settings,
+                         const char *cmdline, int job, CMDF_RETURN retflag, unsigned long elapsed) {
+    const char *suggestions[CMDF__SUGGEST_COUNT];
+    int i, n;
+
+    cmdf__record_begin(ctx, "result");
+    cmdf__record_key(ctx, "command");
+    cmdf__emit(ctx, "\"", 1);
+    cmdf__json_escape(ctx, cmdline, strcspn(cmdline, " "));
+    cmdf__emit(ctx, "\"", 1);
+
+    if (job)
+        cmdf__record_number(ctx, "job", job);
+
+    cmdf__record_number(ctx, "code", retflag);
+    if (retflag < 0 && -retflag < (int)(sizeof(cmdf__error_names) / sizeof(cmdf__error_names[0]))) {
+        cmdf__record_key(ctx, "error");
+        cmdf__json_string(ctx, cmdf__error_names[-retflag]);
+    }
+
+    cmdf__record_number(ctx, "elapsed_ms", (long)elapsed);
+
+    if (settings && retflag == CMDF_ERROR_UNKNOWN_COMMAND) {
+        n = cmdf__suggest(ctx, settings, cmdline, suggestions);
+        cmdf__record_key(ctx, "suggestions");
+        cmdf__emit(ctx, "[", 1);
+        for (i = 0; i < n; i++) {
+            if (i)
+                cmdf__emit(ctx, ",", 1);
+            cmdf__json_string(ctx, suggestions[i]);
+        }
+        cmdf__emit(ctx, "]", 1);
+    }
+
+    cmdf__record_end(ctx);
+}
+
+/*
+ * Match one character of a name against the element at the start of a glob pattern: a
+ * '?', a bracket expression such as "[a-f]" or "[!0-9]", an escaped character or a plain
+ * one. Returns the rest of the pattern if it matches, or NULL.
+ */
+const char *cmdf__glob_element(const char *pattern, char c) {
+    const unsigned char *p = (const unsigned char *)pattern + 1, uc = (unsigned char)c;
+    int negate, matched = 0;
+
+    if (*pattern == '?')
+        return pattern + 1;
+
+    if (*pattern == '\\' && pattern[1])
+        return pattern[1] == c ? pattern + 2 : NULL;
+
+    if (*pattern != '[')
+        return *pattern == c ? pattern + 1 : NULL;
+
+    if ((negate = (*p == '!' || *p == '^')))
+        p++;
+
+    /* A ']' right after the opening bracket is part of the set */
+    if (*p == ']') {
+        matched = uc == ']';
+        p++;
+    }
+
+    for (; *p && *p != ']'; p++) {
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            if (uc >= p[0] && uc <= p[2])
+                matched = 1;
+            p += 2;
+        }
+        else if (*p == uc)
+            matched = 1;
+    }
+
+    /* An unterminated bracket is just a '[' */
+    if (!*p)
+        return c == '[' ? pattern + 1 : NULL;
+
+    return matched != negate ? (const char *)p + 1 : NULL;
+}
+
+/* Match a whole name against a glob pattern, with '*' standing for any run of characters */
+int cmdf__glob_match(const char *pattern, const char *name) {
+    const char *star = NULL, *resume = NULL, *next;
+
+    while (*name) {
+        if (*pattern == '*') {
+            star = ++pattern;
+            resume = name;
+        }
+        else if (*pattern && (next = cmdf__glob_element(pattern, *name))) {
+            pattern = next;
+            name++;
+        }
+        /* Let the last '*' take one more character, and try again after it */
+        else if (star) {
+            pattern = star;
+            name = ++resume;
+        }
+        else
+            return 0;
+    }
+
+    while (*pattern == '*')
+        pattern++;
+
+    return *pattern == '\0';
+}
+
+/* Whether a help argument is a glob pattern, rather than a command name */
+int cmdf__is_glob(const char *pattern) {
+    return pattern[strcspn(pattern, "*?[\\")] != '\0';
+}
+
+/*
+ * Get the commands of a context's menu sorted by name. The index is built once, and kept
+ * until the menu's commands change. Background jobs sort into scratch instead, which must
+ * have room for CMDF_MAX_COMMANDS entries, as do contexts that are out of memory.
+ */
+const struct cmdf__entry_s *const *cmdf__name_index(struct cmdf__context_s *ctx,
+                                                    const struct cmdf__settings_s *settings,
+                                                    const struct cmdf__entry_s **scratch) {
+    const int level = cmdf__menu_level(ctx, settings);
+    struct cmdf__name_index_s *index;
+    const struct cmdf__entry_s **entries = scratch;
+    int i;
+
+    /* Background jobs leave the context's indexes to the thread driving it */
+    index = level < 0 ? NULL : ctx->name_indexes + level;
+
+    if (index && index->entries && index->entry_start == settings->entry_start &&
+        index->entry_count == settings->entry_count)
+        return index->entries;
+
+    if (index) {
+        cmdf__name_index_drop(index);
+        index->entries = (const struct cmdf__entry_s **)(CMDF_MALLOC(sizeof(const struct cmdf__entry_s *) *
+                                                                     (settings->entry_count + 1)));
+        if (index->entries) {
+            entries = index->entries;
+            index->entry_start = settings->entry_start;
+            index->entry_count = settings->entry_count;
+        }
+    }
+
+    for (i = 0; i < settings->entry_count; i++)
+        entries[i] = cmdf__menu_entries(ctx, settings) + i;
+
+    qsort(entries, settings->entry_count, sizeof(entries[0]), cmdf__catalog_compare);
+
+    return entries;
+}
+
+/*
+ * Print a page of the active menu's commands whose names match a glob pattern, or of all
+ * of them if it's NULL. A page holds as many names as fit the terminal, in name order.
+ * Names are found through the menu's index, so only the ones starting with the pattern's
+ * literal prefix are looked at. Returns CMDF_OK, or CMDF_ERROR_ARGUMENT_ERROR if nothing
+ * matches or the page doesn't exist.
+ */
+CMDF_RETURN cmdf__print_command_page(const char *pattern, long page) {
+    const struct cmdf_windowsize winsize = cmdf__window_size(cmdf__ctx);
+    const struct cmdf__settings_s *settings = cmdf__active_menu(cmdf__ctx);
+    const struct cmdf__entry_s *scratch[CMDF_MAX_COMMANDS], *matches[CMDF_MAX_COMMANDS];
+    const struct cmdf__entry_s *const *index;
+    const struct cmdf__catalog_table_s *table;
+    const char *names[CMDF_MAX_COMMANDS];
+    const char *glob = pattern ? pattern : "*";
+    size_t width = winsize.w > 1 ? winsize.w - 1 : 1, prefix = strcspn(glob, "*?[\\");
+    size_t maxlen = 0, rows, per_page, len = 0;
+    int i, low, high, count, first, last, pages, documented, n = 0, shown;
+    char *text;
+    CMDF_RETURN retflag = CMDF_OK;
+
+    if (settings->catalog) {
+        table = cmdf__catalog_enter(settings->catalog);
+        index = table->index;
+        count = table->entry_count;
+    }
+    else {
+        index = cmdf__name_index(cmdf__ctx, settings, scratch);
+        count = settings->entry_count;
+    }
+
+    /* Names starting with the literal prefix are a range of the index */
+    for (low = 0, high = count; low < high; ) {
+        i = low + (high - low) / 2;
+        if (strncmp(index[i]->cmdname, glob, prefix) < 0)
+            low = i + 1;
+        else
+            high = i;
+    }
+
+    for (i = low; i < count && strncmp(index[i]->cmdname, glob, prefix) == 0; i++) {
+        if (cmdf__glob_match(glob, index[i]->cmdname)) {
+            matches[n++] = index[i];
+            if (strlen(index[i]->cmdname) > maxlen)
+                maxlen = strlen(index[i]->cmdname);
+        }
+    }
+
+    /*
+     * Leave room for both section titles, the footer and the prompt. Every column of a page
+     * fits its longest name, so the names of a page never take more than these rows.
+     */
+    rows = winsize.h > 12 ? winsize.h - 10 : 2;
+    per_page = rows * ((width + 2) / (maxlen + 2) ? (width + 2) / (maxlen + 2) : 1);
+    pages = (int)((n + per_page - 1) / per_page);
+
+    if (!n) {
+        cmdf__printf(cmdf__ctx, "No command matches '%s'.\n", glob);
+        retflag = CMDF_ERROR_ARGUMENT_ERROR;
+    }
+    else if (page < 1 || page > pages) {
+        cmdf__printf(cmdf__ctx, "There is no page %ld, only pages 1 to %d.\n", page, pages);
+        retflag = CMDF_ERROR_ARGUMENT_ERROR;
+    }
+    else {
+        first = (int)((page - 1) * per_page);
+        last = first + (int)per_page < n ? first + (int)per_page : n;
+
+        if (cmdf__ctx->format == CMDF_OUTPUT_JSON) {
+            cmdf__record_begin(cmdf__ctx, "commands");
+            cmdf__record_number(cmdf__ctx, "page", page);
+            cmdf__record_number(cmdf__ctx, "pages", pages);
+            cmdf__record_number(cmdf__ctx, "total", n);
+            cmdf__record_commands(cmdf__ctx, NULL, matches + first, last - first);
+            cmdf__record_end(cmdf__ctx);
+            cmdf__menu_leave(settings);
+            return CMDF_OK;
+        }
+
+        /* Every name takes at most a column of maxlen, two spaces and a line break */
+        text = (char *)(CMDF_MALLOC(sizeof(char) * (2 * (strlen(settings->doc_header) +
+                                                         strlen(settings->undoc_header)) +
+                                                    (last - first) * (maxlen + 3) + 10)));
+        if (!text) {
+            cmdf__menu_leave(settings);
+            return CMDF_ERROR_OUT_OF_MEMORY;
+        }
+
+        for (documented = 1; documented >= 0; documented--) {
+            for (i = first, shown = 0; i < last; i++)
+                if ((matches[i]->help != NULL) == documented)
+                    names[shown++] = matches[i]->cmdname;
+
+            if (shown) {
+                len += cmdf__listing_title(documented ? settings->doc_header : settings->undoc_header,
+                                           settings->ruler, text + len);
+                len += cmdf__columnize(names, shown, width, text + len);
+            }
+        }
+
+        cmdf__write(cmdf__ctx, text, len);
+        CMDF_FREE(text);
+
+        if (pages > 1)
+            cmdf__printf(cmdf__ctx, "\nPage %ld of %d, %d commands. Type 'help %s%s--page N' for another.\n",
+                         page, pages, n, pattern ? pattern : "", pattern ? " " : "");
+    }
+
+    cmdf__menu_leave(settings);
+
+    return retflag;
+}
+
+/* Default callbacks */
+CMDF_RETURN cmdf__default_do_help(cmdf_arglist *arglist) {
+	struct cmdf__entry_s entry;
+	const char *pattern = NULL;
+	size_t offset, i;
+	char *endptr;
+	long page = 1;
+	int paged = 0;
+	CMDF_RETURN retflag;
+
+    /* Takes a command name or a pattern, and a page, in any order */
+    for (i = 0; arglist && i < arglist->count; i++) {
+        if (strcmp(arglist->args[i], "--page") == 0 && !paged) {
+            paged = 1;
+            if (++i < arglist->count)
+                page = strtol(arglist->args[i], &endptr, 10);
+
+            if (i == arglist->count || *arglist->args[i] == '\0' || *endptr != '\0') {
+                cmdf__printf(cmdf__ctx, "Usage: help [pattern] [--page N]\n");
+                return CMDF_ERROR_ARGUMENT_ERROR;
+            }
+        }
+        else if (!pattern)
+            pattern = arglist->args[i];
+        else {
+            cmdf__printf(cmdf__ctx, "Too many arguments for the 'help' command!\n");
+            return CMDF_ERROR_TOO_MANY_ARGS;
+        }
+    }
+
+    /* Patterns and pages list the matching commands; a plain name shows its documentation */
+    if (paged || (pattern && cmdf__is_glob(pattern))) {
+        if ((retflag = cmdf__print_command_page(pattern, page)) != CMDF_OK)
+            return retflag;
+    }
+    else if (pattern) {
+        if (cmdf__find_entry(cmdf__ctx, cmdf__active_menu(cmdf__ctx), pattern, &entry)) {
+		    /* Print help, if any */
+		    if (cmdf__ctx->format == CMDF_OUTPUT_JSON) {
+		        cmdf__record_begin(cmdf__ctx, "help");
+		        cmdf__record_key(cmdf__ctx, "name");
+		        cmdf__json_string(cmdf__ctx, entry.cmdname);
+		        cmdf__record_key(cmdf__ctx, "help");
+		        cmdf__json_string(cmdf__ctx, entry.help);
+		        cmdf__record_end(cmdf__ctx);
+		    }
+		    else if (entry.help) {
+                cmdf__puts(cmdf__ctx, entry.cmdname);
+                cmdf__puts(cmdf__ctx, "   ");
+                offset = strlen(entry.cmdname) + 3;
+                cmdf__print_help(&entry, offset);
+		    }
+		    else
+			    cmdf__printf(cmdf__ctx, "\n(No documentation)\n");
+
+		    return CMDF_OK;
+        }
+
+        /* If we reached this, means that the command was not found */
+        cmdf__printf(cmdf__ctx, "Command '%s' was not found.\n", pattern);
+        cmdf__print_suggestions(cmdf__ctx, cmdf__active_menu(cmdf__ctx), pattern);
+	    return CMDF_ERROR_UNKNOWN_COMMAND;
+    }
+    else
+        cmdf__print_command_list();
+
+    cmdf__puts(cmdf__ctx, "\n");
+
+    return CMDF_OK;
+}
+
+/* Help search.
+ * Compiled only if apropos support is enabled */
+#ifdef CMDF_APROPOS_SUPPORT
+/* Grow an array of count elements of the given size to hold one more. Returns NULL if out of memory. */
+void *cmdf__apropos_grow(void *array, int count, int *capacity, size_t size) {
+    void *grown;
+
+    if (count < *capacity)
+        return array;
+
+    if (!(grown = CMDF_MALLOC(size * (*capacity ? *capacity * 2 : 16))))
+        return NULL;
+
+    if (count)
+        memcpy(grown, array, size * count);
+
+    CMDF_FREE(array);
+    *capacity = *capacity ? *capacity * 2 : 16;
+
+    return grown;
+}
+
+/*
+ * Copy the word starting at text into word, lowercased and cut to CMDF__APROPOS_WORD_SIZE - 1
+ * characters. Words are runs of letters and digits. Returns where the word ends.
+ */
+const char *cmdf__apropos_word(const char *text, char *word) {
+    size_t len = 0;
+
+    for (; isalnum((unsigned char)*text); text++)
+        if (len < CMDF__APROPOS_WORD_SIZE - 1)
+            word[len++] = (char)tolower((unsigned char)*text);
+
+    word[len] = '\0';
+
+    return text;
+}
+
+/* Find the first term of the index not sorting before word */
+int cmdf__apropos_find(const struct cmdf__apropos_s *index, const char *word) {
+    int low = 0, high = index->term_count, i;
+
+    while (low < high) {
+        i = low + (high - low) / 2;
+        if (strcmp(index->terms[i].word, word) < 0)
+            low = i + 1;
+        else
+            high = i;
+    }
+
+    return low;
+}
+
+/* Add the words of a command's text to the index, each counting weight times */
+CMDF_RETURN cmdf__apropos_add(struct cmdf__apropos_s *index, int slot, const char *text, int weight) {
+    char word[CMDF__APROPOS_WORD_SIZE];
+    struct cmdf__apropos_term_s *term;
+    void *grown;
+    int i;
+
+    while (text && *text) {
+        if (!isalnum((unsigned char)*text)) {
+            text++;
+            continue;
+        }
+
+        /* Single letters and digits are too common to search for */
+        text = cmdf__apropos_word(text, word);
+        if (!word[1])
+            continue;
+
+        i = cmdf__apropos_find(index, word);
+        if (i == index->term_count || strcmp(index->terms[i].word, word) != 0) {
+            if (!(grown = cmdf__apropos_grow(index->terms, index->term_count, &index->term_capacity,
+                                             sizeof(struct cmdf__apropos_term_s))))
+                return CMDF_ERROR_OUT_OF_MEMORY;
+
+            index->terms = (struct cmdf__apropos_term_s *)grown;
+            memmove(index->terms + i + 1, index->terms + i,
+                    sizeof(struct cmdf__apropos_term_s) * (index->term_count - i));
+            memset(index->terms + i, 0, sizeof(struct cmdf__apropos_term_s));
+            index->term_count++;
+            if (!(index->terms[i].word = cmdf__strdup(word)))
+                return CMDF_ERROR_OUT_OF_MEMORY;
+        }
+
+        /* A command's postings are added together, so a repeated word is always the last one */
+        term = index->terms + i;
+        if (term->count && term->postings[term->count - 1].slot == slot) {
+            term->postings[term->count - 1].weight += weight;
+            continue;
+        }
+
+        if (!(grown = cmdf__apropos_grow(term->postings, term->count, &term->capacity,
+                                         sizeof(struct cmdf__apropos_posting_s))))
+            return CMDF_ERROR_OUT_OF_MEMORY;
+
+        term->postings = (struct cmdf__apropos_posting_s *)grown;
+        term->postings[term->count].slot = slot;
+        term->postings[term->count].weight = weight;
+        term->count++;
+    }
+
+    return CMDF_OK;
+}
+
+/* Drop the help search index of a menu, such as when its context is destroyed */
+void cmdf__apropos_drop(struct cmdf__apropos_s *index) {
+    int i;
+
+    for (i = 0; i < index->term_count; i++) {
+        CMDF_FREE(index->terms[i].word);
+        CMDF_FREE(index->terms[i].postings);
+    }
+
+    CMDF_FREE(index->terms);
+    CMDF_FREE(index->names);
+    CMDF_FREE(index->helps);
+    memset(index, 0, sizeof(struct cmdf__apropos_s));
+}
+
+/*
+ * Bring the help search index of a menu up to date with its commands. Only commands that
+ * were added, replaced or removed since it was last brought up to date are looked at again,
+ * so it's cheap to call on every registration and every search.
+ */
+CMDF_RETURN cmdf__apropos_sync(struct cmdf__apropos_s *index, const struct cmdf__entry_s *entries,
+                               int count) {
+    const char **names = index->names, **helps = index->helps;
+    struct cmdf__apropos_term_s *term;
+    int slot, i, j, kept, posted, stale = 0, capacity;
+
+    /* Commands are indexed by their slot, which keeps the name and help they were indexed with */
+    if (count > index->slot_capacity) {
+        for (capacity = index->slot_capacity ? index->slot_capacity * 2 : 16; capacity < count; capacity *= 2)
+            ;
+
+        names = (const char **)(CMDF_MALLOC(sizeof(const char *) * capacity));
+        helps = (const char **)(CMDF_MALLOC(sizeof(const char *) * capacity));
+        if (!names || !helps) {
+            CMDF_FREE(names);
+            CMDF_FREE(helps);
+            cmdf__apropos_drop(index);
+            return CMDF_ERROR_OUT_OF_MEMORY;
+        }
+
+        if (index->slot_count) {
+            memcpy(names, index->names, sizeof(const char *) * index->slot_count);
+            memcpy(helps, index->helps, sizeof(const char *) * index->slot_count);
+        }
+
+        CMDF_FREE(index->names);
+        CMDF_FREE(index->helps);
+        index->names = names;
+        index->helps = helps;
+        index->slot_capacity = capacity;
+    }
+
+    for (slot = 0; slot < index->slot_count; slot++) {
+        if (slot >= count || names[slot] != entries[slot].cmdname || helps[slot] != entries[slot].help) {
+            names[slot] = NULL;
+            stale = 1;
+        }
+    }
+
+    /* Take stale commands out of every posting list, and drop the words no command uses anymore */
+    if (stale) {
+        for (i = 0, kept = 0; i < index->term_count; i++) {
+            term = index->terms + i;
+            for (j = 0, posted = 0; j < term->count; j++)
+                if (term->postings[j].slot < count && names[term->postings[j].slot])
+                    term->postings[posted++] = term->postings[j];
+
+            term->count = posted;
+            if (posted)
+                index->terms[kept++] = *term;
+            else {
+                CMDF_FREE(term->word);
+                CMDF_FREE(term->postings);
+            }
+        }
+
+        index->term_count = kept;
+    }
+
+    /* A command's name counts more than its help */
+    for (slot = 0; slot < count; slot++) {
+        if (slot < index->slot_count && names[slot])
+            continue;
+
+        if (cmdf__apropos_add(index, slot, entries[slot].cmdname, 4) != CMDF_OK ||
+            cmdf__apropos_add(index, slot, entries[slot].help, 1) != CMDF_OK) {
+            cmdf__apropos_drop(index);
+            return CMDF_ERROR_OUT_OF_MEMORY;
+        }
+
+        names[slot] = entries[slot].cmdname;
+        helps[slot] = entries[slot].help;
+    }
+
+    index->slot_count = count;
+    index->built = 1;
+
+    return CMDF_OK;
+}
+
+/* Order apropos results by keywords matched, then by score, then by name */
+int cmdf__apropos_compare(const void *a, const void *b) {
+    const struct cmdf__apropos_match_s *match_a = (const struct cmdf__apropos_match_s *)a;
+    const struct cmdf__apropos_match_s *match_b = (const struct cmdf__apropos_match_s *)b;
+
+    if (match_a->keywords != match_b->keywords)
+        return match_b->keywords - match_a->keywords;
+
+    if (match_a->score != match_b->score)
+        return match_b->score > match_a->score ? 1 : -1;
+
+    return strcmp(match_a->cmdname, match_b->cmdname);
+}
+
+CMDF_RETURN cmdf__default_do_apropos(cmdf_arglist *arglist) {
+    const struct cmdf_windowsize winsize = cmdf__window_size(cmdf__ctx);
+    const struct cmdf__settings_s *settings = cmdf__active_menu(cmdf__ctx);
+    const int level = cmdf__menu_level(cmdf__ctx, settings);
+    struct cmdf__apropos_s *index;
+    struct cmdf__apropos_match_s matches[CMDF_MAX_COMMANDS];
+    int found[CMDF_MAX_COMMANDS], seen[CMDF_MAX_COMMANDS];
+    long scores[CMDF_MAX_COMMANDS];
+    struct cmdf__apropos_s scratch;
+    const struct cmdf__entry_s *entries;
+    char keyword[CMDF__APROPOS_WORD_SIZE];
+    const char *summary;
+    size_t i, keylen, namewidth = 0, room, len;
+    int count, term, j, rarity, n = 0, slot;
+    CMDF_RETURN retflag;
+
+    if (!arglist) {
+        cmdf__printf(cmdf__ctx, "Usage: apropos <keyword>...\n");
+        return CMDF_ERROR_ARGUMENT_ERROR;
+    }
+
+    /* Background jobs leave the context's indexes to the thread driving it */
+    if (level < 0) {
+        memset(&scratch, 0, sizeof(struct cmdf__apropos_s));
+        index = &scratch;
+    }
+    else
+        index = cmdf__ctx->apropos + level;
+
+    entries = cmdf__menu_enter(cmdf__ctx, settings, &count, NULL);
+    if ((retflag = cmdf__apropos_sync(index, entries, count)) != CMDF_OK) {
+        cmdf__menu_leave(settings);
+        return retflag;
+    }
+
+    memset(found, 0, sizeof(int) * count);
+    memset(seen, 0, sizeof(int) * count);
+    memset(scores, 0, sizeof(long) * count);
+
+    /*
+     * Every keyword matches the words it starts with, and exact words count twice. Words used
+     * by fewer commands count more: about one more for every halving of the commands using it.
+     */
+    for (i = 0; i < arglist->count; i++) {
+        for (summary = arglist->args[i]; *summary && !isalnum((unsigned char)*summary); summary++)
+            ;
+
+        cmdf__apropos_word(summary, keyword);
+        keylen = strlen(keyword);
+        if (!keylen)
+            continue;
+
+        for (term = cmdf__apropos_find(index, keyword);
+             term < index->term_count && strncmp(index->terms[term].word, keyword, keylen) == 0; term++) {
+            for (rarity = 1, j = index->terms[term].count; j < count; j *= 2)
+                rarity++;
+
+            if (!index->terms[term].word[keylen])
+                rarity *= 2;
+
+            for (j = 0; j < index->terms[term].count; j++) {
+                slot = index->terms[term].postings[j].slot;
+                scores[slot] += (long)rarity * index->terms[term].postings[j].weight;
+                if (seen[slot] != (int)i + 1) {
+                    seen[slot] = (int)i + 1;
+                    found[slot]++;
+                }
+            }
+        }
+    }
+
+    for (slot = 0; slot < count; slot++) {
+        if (found[slot]) {
+            matches[n].cmdname = entries[slot].cmdname;
+            matches[n].help = entries[slot].help;
+            matches[n].keywords = found[slot];
+            matches[n].score = scores[slot];
+            if (strlen(entries[slot].cmdname) > namewidth)
+                namewidth = strlen(entries[slot].cmdname);
+            n++;
+        }
+    }
+
+    qsort(matches, n, sizeof(struct cmdf__apropos_match_s), cmdf__apropos_compare);
+
+    if (cmdf__ctx->format == CMDF_OUTPUT_JSON) {
+        cmdf__record_begin(cmdf__ctx, "apropos");
+        cmdf__record_key(cmdf__ctx, "commands");
+        cmdf__emit(cmdf__ctx, "[", 1);
+        for (j = 0; j < n; j++) {
+            cmdf__emit(cmdf__ctx, j ? ",{\"name\":" : "{\"name\":", j ? 9 : 8);
+            cmdf__json_string(cmdf__ctx, matches[j].cmdname);
+            cmdf__emit(cmdf__ctx, ",\"help\":", 8);
+            cmdf__json_string(cmdf__ctx, matches[j].help);
+            cmdf__record_number(cmdf__ctx, "score", matches[j].score);
+            cmdf__emit(cmdf__ctx, "}", 1);
+        }
+        cmdf__emit(cmdf__ctx, "]", 1);
+        cmdf__record_end(cmdf__ctx);
+    }
+    else {
+        /* One line per command: its name, and as much of the first line of its help as fits */
+        for (j = 0; j < n; j++) {
+            cmdf__puts(cmdf__ctx, matches[j].cmdname);
+
+            if (matches[j].help) {
+                cmdf__fill(cmdf__ctx, ' ', namewidth - strlen(matches[j].cmdname) + 2);
+
+                for (summary = matches[j].help; isspace((unsigned char)*summary); summary++)
+                    ;
+
+                len = strcspn(summary, "\n");
+                room = winsize.w > namewidth + 3 ? winsize.w - namewidth - 3 : 0;
+                if (len > room && room > 3) {
+                    cmdf__write(cmdf__ctx, summary, room - 3);
+                    cmdf__puts(cmdf__ctx, "...");
+                }
+                else
+                    cmdf__write(cmdf__ctx, summary, len);
+            }
+
+            cmdf__puts(cmdf__ctx, "\n");
+        }
+
+        if (!n)
+            cmdf__printf(cmdf__ctx, "Nothing appropriate.\n");
+    }
+
+    if (!n)
+        retflag = CMDF_ERROR_ARGUMENT_ERROR;
+
+    cmdf__menu_leave(settings);
+
+    if (index == &scratch)
+        cmdf__apropos_drop(index);
+
+    return retflag;
+}
+#endif /* CMDF_APROPOS_SUPPORT */
+
+CMDF_RETURN cmdf__default_do_emptyline(cmdf_arglist *arglist /* Unusued */) {
+    return CMDF_OK;
+}
+
+CMDF_RETURN cmdf__default_do_exit(cmdf_arglist *arglist /* Unused */) {
+    cmdf__active_menu(cmdf__ctx)->exit_flag = 1;
+
+    return CMDF_OK;
+}
+
+CMDF_RETURN cmdf__default_do_noop(cmdf_arglist *arglist /* Unused */) {
+    return CMDF_OK;
+}
+
+/* Execute the command the dispatcher found, or report that there was none */
+CMDF_RETURN cmdf__default_do_command(const struct cmdf__entry_s *entry, cmdf_arglist *arglist) {
+    if (entry)
+        return entry->callback(arglist);
+
+    return CMDF_ERROR_UNKNOWN_COMMAND;
+}
+
+/*
+ * Cancellation. While foreground commands run, Ctrl-C (SIGINT) doesn't kill the process:
+ * it bumps cmdf__interrupts, and commands started before that see cmdf_cancelled() return
+ * nonzero. A second Ctrl-C before the cancelled command returns, or one at the prompt, is
+ * handed over to the previous SIGINT disposition, which normally kills the process. It is
+ * called in place, so an application that ignores or handles SIGINT keeps doing so, and
+ * cancellation keeps working after it returns.
+ */
+static volatile sig_atomic_t cmdf__interrupts = 0;      /* SIGINTs that cancelled commands */
+static volatile sig_atomic_t cmdf__interrupt_pending = 0;
+static volatile int cmdf__foreground = 0;               /* Foreground commands running */
+static CMDF_THREAD_LOCAL sig_atomic_t cmdf__generation = 0;  /* cmdf__interrupts at dispatch */
+static CMDF_THREAD_LOCAL int cmdf__invocations = 0;          /* Nested invocations running */
+
+#ifdef CMDF_THREAD_SUPPORT
+    static pthread_once_t cmdf__sigint_once = PTHREAD_ONCE_INIT;
+    #define CMDF__FOREGROUND_ADD(n) __atomic_add_fetch(&cmdf__foreground, (n), __ATOMIC_SEQ_CST)
+#else
+    static int cmdf__sigint_installed = 0;
+    #define CMDF__FOREGROUND_ADD(n) (cmdf__foreground = cmdf__foreground + (n))
+#endif
+
+#ifdef _WIN32
+    static void (*cmdf__prev_sigint)(int) = SIG_DFL;
+#else
+    static struct sigaction cmdf__prev_sigint;
+#endif
+
+/* Previous handlers taking siginfo get it passed on, so ours takes it too where it exists */
+#if !defined(_WIN32) && defined(SA_SIGINFO) && defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 199309L
+    #define CMDF__SIGINFO
+#endif
+
+#ifdef CMDF__SIGINFO
+void cmdf__sigint_handler(int signum, siginfo_t *info, void *context) {
+#else
+void cmdf__sigint_handler(int signum) {
+#endif
+    /* Windows resets the handler on every signal */
+    #ifdef _WIN32
+        signal(SIGINT, cmdf__sigint_handler);
+    #endif
+
+    if (cmdf__foreground && !cmdf__interrupt_pending) {
+        cmdf__interrupt_pending = 1;
+        cmdf__interrupts = cmdf__interrupts + 1;
+        return;
+    }
+
+    /* Nothing to cancel, or the user insists: do what would have been done without us */
+    #ifdef _WIN32
+        if (cmdf__prev_sigint == SIG_IGN)
+            return;
+
+        if (cmdf__prev_sigint != SIG_DFL && cmdf__prev_sigint != SIG_ERR) {
+            cmdf__prev_sigint(signum);
+            return;
+        }
+
+        signal(SIGINT, SIG_DFL);
+    #else
+        #ifdef CMDF__SIGINFO
+            if (cmdf__prev_sigint.sa_flags & SA_SIGINFO) {
+                cmdf__prev_sigint.sa_sigaction(signum, info, context);
+                return;
+            }
+        #endif
+
+        if (cmdf__prev_sigint.sa_handler == SIG_IGN)
+            return;
+
+        if (cmdf__prev_sigint.sa_handler != SIG_DFL) {
+            cmdf__prev_sigint.sa_handler(signum);
+            return;
+        }
+
+        /* The default action ends the process, so there's nothing to come back to */
+        sigaction(SIGINT, &cmdf__prev_sigint, NULL);
+    #endif
+
+    raise(signum);
+}
+
+void cmdf__sigint_install(void) {
+    #ifdef _WIN32
+        cmdf__prev_sigint = signal(SIGINT, cmdf__sigint_handler);
+    #else
+        struct sigaction action;
+
+        memset(&action, 0, sizeof(struct sigaction));
+        #ifdef CMDF__SIGINFO
+            action.sa_sigaction = cmdf__sigint_handler;
+            action.sa_flags = SA_SIGINFO;
+        #else
+            action.sa_handler = cmdf__sigint_handler;
+        #endif
+        sigemptyset(&action.sa_mask);
+
+        /* No SA_RESTART, so commands blocked in system calls get to see EINTR */
+        sigaction(SIGINT, &action, &cmdf__prev_sigint);
+    #endif
+}
+
+/*
+ * Start a foreground command invocation, returning the generation to restore when it ends.
+ * Only the outermost invocation of a thread sets up the handler and counts as running, so
+ * invocations within it, such as the commands of a batch, just start a new generation.
+ */
+sig_atomic_t cmdf__invocation_begin(void) {
+    sig_atomic_t prev_generation = cmdf__generation;
+
+    if (!cmdf__invocations++) {
+        #ifdef CMDF_THREAD_SUPPORT
+            pthread_once(&cmdf__sigint_once, cmdf__sigint_install);
+        #else
+            if (!cmdf__sigint_installed) {
+                cmdf__sigint_install();
+                cmdf__sigint_installed = 1;
+            }
+        #endif
+
+        CMDF__FOREGROUND_ADD(1);
+    }
+
+    cmdf__generation = cmdf__interrupts;
+
+    return prev_generation;
+}
+
+/*
+ * End a foreground command invocation. An interrupt it received is consumed, so the
+ * command that invoked it (such as a submenu's) is not cancelled as well.
+ * Returns nonzero if it was cancelled.
+ */
+int cmdf__invocation_end(sig_atomic_t prev_generation) {
+    int cancelled = (cmdf__generation != cmdf__interrupts);
+
+    if (cancelled)
+        cmdf__interrupt_pending = 0;
+
+    if (!--cmdf__invocations)
+        CMDF__FOREGROUND_ADD(-1);
+    cmdf__generation = cancelled ? cmdf__interrupts : prev_generation;
+
+    return cancelled;
+}
+
+/*
+ * Get a millisecond clock reading, for timing commands. Only differences are meaningful.
+ * Without a monotonic clock, readings are whole seconds.
+ */
+#if defined(_WIN32) || defined(CLOCK_MONOTONIC)
+    #define CMDF__CLOCK_GRANULARITY 1
+#else
+    #define CMDF__CLOCK_GRANULARITY 1000
+#endif
+
+unsigned long cmdf__clock_ms(void) {
+    #if defined(_WIN32)
+        return (unsigned long)GetTickCount();
+    #elif defined(CLOCK_MONOTONIC)
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (unsigned long)now.tv_sec * 1000 + (unsigned long)(now.tv_nsec / 1000000);
+    #else
+        return (unsigned long)time(NULL) * 1000;
+    #endif
+}
+
+/*
+ * A running command invocation, timed for its statistics and checked against its time
+ * limit. Lives on the stack of the thread running the command.
+ */
+struct cmdf__watch_s {
+    struct cmdf__command_info_s *info;          /* Command's state, or NULL if unknown */
+    unsigned int timeout;                       /* Time limit in seconds, or 0 for none */
+    unsigned long start;                        /* cmdf__clock_ms() when it started */
+    unsigned long elapsed;                      /* Milliseconds it ran, once it ended */
+    int expired;                                /* Set by the watchdog past the time limit */
+    struct cmdf__watch_s *parent;               /* Invocation this one runs within, if any */
+
+    #ifdef CMDF_THREAD_SUPPORT
+        struct cmdf__watch_s *next;             /* Next invocation with a time limit */
+    #endif
+};
+
+/* Innermost command invocation of the calling thread */
+static CMDF_THREAD_LOCAL struct cmdf__watch_s *cmdf__watch = NULL;
+
+/* Check whether an invocation with a time limit has certainly run past it at clock reading now */
+int cmdf__watch_overdue(const struct cmdf__watch_s *watch, unsigned long now) {
+    return now - watch->start >= watch->timeout * 1000UL + (CMDF__CLOCK_GRANULARITY - 1);
+}
+
+#ifdef CMDF_THREAD_SUPPORT
+/*
+ * libcmdf watchdog. Invocations with a time limit are linked in cmdf__watched while they run,
+ * and a thread started with the first of them marks those running past their limit once a
+ * second, so cmdf_cancelled() only has to load a flag.
+ */
+static struct cmdf__watch_s *cmdf__watched = NULL;
+static pthread_mutex_t cmdf__watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cmdf__watchdog_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_once_t cmdf__watchdog_once = PTHREAD_ONCE_INIT;
+
+void *cmdf__watchdog_main(void *arg /* Unused */) {
+    struct cmdf__watch_s *watch;
+    struct timespec deadline;
+    unsigned long now;
+
+    pthread_mutex_lock(&cmdf__watchdog_lock);
+
+    for (;;) {
+        /* Sleep until there is something to watch */
+        if (!cmdf__watched) {
+            pthread_cond_wait(&cmdf__watchdog_wakeup, &cmdf__watchdog_lock);
+            continue;
+        }
+
+        now = cmdf__clock_ms();
+        for (watch = cmdf__watched; watch; watch = watch->next)
+            if (cmdf__watch_overdue(watch, now))
+                __atomic_store_n(&watch->expired, 1, __ATOMIC_RELAXED);
+
+        deadline.tv_sec = time(NULL) + 1;
+        deadline.tv_nsec = 0;
+        pthread_cond_timedwait(&cmdf__watchdog_wakeup, &cmdf__watchdog_lock, &deadline);
+    }
+
+    return NULL;
+}
+
+void cmdf__watchdog_start(void) {
+    pthread_t watchdog;
+
+    if (pthread_create(&watchdog, NULL, cmdf__watchdog_main, NULL) == 0)
+        pthread_detach(watchdog);
+}
+#endif
+
+/* Start timing an invocation of the command with the given state, on the calling thread */
+void cmdf__watch_begin(struct cmdf__watch_s *watch, struct cmdf__command_info_s *info) {
+    watch->info = info;
+    watch->timeout = info ? CMDF__RELAXED_LOAD(info->timeout) : 0;
+    watch->start = cmdf__clock_ms();
+    watch->expired = 0;
+    watch->parent = cmdf__watch;
+    cmdf__watch = watch;
+
+    #ifdef CMDF_THREAD_SUPPORT
+        if (watch->timeout) {
+            pthread_once(&cmdf__watchdog_once, cmdf__watchdog_start);
+
+            pthread_mutex_lock(&cmdf__watchdog_lock);
+            watch->next = cmdf__watched;
+            cmdf__watched = watch;
+            pthread_cond_signal(&cmdf__watchdog_wakeup);
+            pthread_mutex_unlock(&cmdf__watchdog_lock);
+        }
+    #endif
+}
+
+/* Raise the longest run time in a command's statistics to ms, if that's longer */
+void cmdf__stats_max(struct cmdf_command_stats *stats, unsigned long ms) {
+    #ifdef CMDF_THREAD_SUPPORT
+        unsigned long max_ms = __atomic_load_n(&stats->max_ms, __ATOMIC_RELAXED);
+
+        while (ms > max_ms &&
+               !__atomic_compare_exchange_n(&stats->max_ms, &max_ms, ms, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    #else
+        if (ms > stats->max_ms)
+            stats->max_ms = ms;
+    #endif
+}
+
+/*
+ * Stop timing an invocation which returned retflag, and add it to the command's statistics.
+ * Returns CMDF_ERROR_TIMED_OUT if it ran past its time limit, or retflag otherwise.
+ */
+CMDF_RETURN cmdf__watch_end(struct cmdf__watch_s *watch, CMDF_RETURN retflag) {
+    unsigned long now = cmdf__clock_ms(), elapsed = now - watch->start;
+    struct cmdf_command_stats *stats;
+    int overrun;
+    #ifdef CMDF_THREAD_SUPPORT
+        struct cmdf__watch_s **link;
+    #endif
+
+    #ifdef CMDF_THREAD_SUPPORT
+        if (watch->timeout) {
+            pthread_mutex_lock(&cmdf__watchdog_lock);
+            for (link = &cmdf__watched; *link != watch; link = &(*link)->next)
+                ;
+
+            *link = watch->next;
+            pthread_mutex_unlock(&cmdf__watchdog_lock);
+        }
+    #endif
+
+    cmdf__watch = watch->parent;
+    watch->elapsed = elapsed;
+
+    /* Commands that don't poll cmdf_cancelled() are only caught once they return */
+    overrun = watch->timeout &&
+              (CMDF__RELAXED_LOAD(watch->expired) || cmdf__watch_overdue(watch, now));
+    if (overrun)
+        retflag = CMDF_ERROR_TIMED_OUT;
+
+    if (!watch->info)
+        return retflag;
+
+    stats = &watch->info->stats;
+    CMDF__RELAXED_ADD(stats->calls, 1);
+    CMDF__RELAXED_ADD(stats->total_ms, elapsed);
+    if (overrun)
+        CMDF__RELAXED_ADD(stats->overruns, 1);
+    if (overrun || retflag == CMDF_ERROR_CANCELLED)
+        CMDF__RELAXED_ADD(stats->cancellations, 1);
+
+    cmdf__stats_max(stats, elapsed);
+
+    return retflag;
+}
+
+/*
+ * Check whether the running command was asked to stop, either by Ctrl-C, by running past
+ * its time limit or, for background jobs, by the 'kill' command. Long-running callbacks
+ * should poll this and return early. Cheap enough to be called in tight loops.
+ */
+int cmdf_cancelled(void) {
+    struct cmdf__watch_s *watch;
+
+    /* Commands run by a command that ran out of time are cancelled as well */
+    for (watch = cmdf__watch; watch; watch = watch->parent) {
+        #ifdef CMDF_THREAD_SUPPORT
+            if (__atomic_load_n(&watch->expired, __ATOMIC_RELAXED))
+                return 1;
+        #else
+            /* No watchdog to do it for us */
+            if (watch->timeout && cmdf__watch_overdue(watch, cmdf__clock_ms()))
+                return 1;
+        #endif
+    }
+
+    #ifdef CMDF_THREAD_SUPPORT
+        if (cmdf__current_job)
+            return __atomic_load_n(&cmdf__current_job->cancelled, __ATOMIC_RELAXED);
+    #endif
+
+    return cmdf__generation != cmdf__interrupts;
+}
+
+/*
+ * Argument completions of a command for one argument position, as given by its completer.
+ * Candidates are kept sorted, so the ones starting with a prefix are found by binary search.
+ */
+struct cmdf__completions_s {
+    size_t argindex;                            /* Argument position, from 0 */
+    unsigned long filled;                       /* cmdf__clock_ms() when filled */
+    char **candidates;
+    size_t count, capacity;
+    struct cmdf__completions_s *next;           /* Next cached argument position */
+};
+
+void cmdf__completions_free(struct cmdf__completions_s *completions) {
+    while (completions->count)
+        CMDF_FREE(completions->candidates[--completions->count]);
+
+    CMDF_FREE(completions->candidates);
+    CMDF_FREE(completions);
+}
+
+/* Drop the cached completions of a command, with the lock held if there's one */
+void cmdf__completions_drop(struct cmdf__command_info_s *info) {
+    struct cmdf__completions_s *completions;
+
+    while ((completions = info->completions)) {
+        info->completions = completions->next;
+        cmdf__completions_free(completions);
+    }
+}
+
+int cmdf__completions_compare(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Find the completions of a command's argument starting with the given prefix. The command's
+ * completer is only run if they aren't cached, or the cache expired. Stores the first of
+ * them in matches, which stays valid until cmdf__completions_leave(), and returns their number.
+ * Must be paired with cmdf__completions_leave(), whatever it returns.
+ */
+size_t cmdf__completions_enter(struct cmdf__command_info_s *info, size_t argindex,
+                               const char *prefix, size_t len, const char * const **matches) {
+    struct cmdf__completions_s *completions, **link;
+    size_t low, high, i;
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&cmdf__completions_lock);
+    #endif
+
+    for (link = &info->completions; (completions = *link); link = &completions->next)
+        if (completions->argindex == argindex)
+            break;
+
+    if (completions && info->completion_ttl &&
+        cmdf__clock_ms() - completions->filled >= info->completion_ttl * 1000UL) {
+        *link = completions->next;
+        cmdf__completions_free(completions);
+        completions = NULL;
+    }
+
+    /* Ask the completer, and cache what it says */
+    if (!completions && info->completer &&
+        (completions = (struct cmdf__completions_s *)(CMDF_MALLOC(sizeof(struct cmdf__completions_s))))) {
+        memset(completions, 0, sizeof(struct cmdf__completions_s));
+        completions->argindex = argindex;
+
+        info->completer(completions, argindex);
+
+        qsort(completions->candidates, completions->count, sizeof(char *), cmdf__completions_compare);
+        completions->filled = cmdf__clock_ms();
+        completions->next = info->completions;
+        info->completions = completions;
+    }
+
+    if (!completions)
+        return 0;
+
+    for (low = 0, high = completions->count; low < high; ) {
+        i = low + (high - low) / 2;
+        if (strncmp(completions->candidates[i], prefix, len) < 0)
+            low = i + 1;
+        else
+            high = i;
+    }
+
+    for (high = low; high < completions->count &&
+                     strncmp(completions->candidates[high], prefix, len) == 0; high++)
+        ;
+
+    *matches = (const char * const *)(completions->candidates + low);
+
+    return high - low;
+}
+
+void cmdf__completions_leave(void) {
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__completions_lock);
+    #endif
+}
+
+/*
+ * Find the command whose argument is being completed, given the line up to the start of
+ * the word being completed. Returns its state if it has a completer, or NULL, and stores
+ * the position of the argument.
+ */
+struct cmdf__command_info_s *cmdf__completion_target(struct cmdf__context_s *ctx, const char *line,
+                                                     size_t start, size_t *argindex) {
+    char cmdname[CMDF_MAX_INPUT_BUFFER_LENGTH];
+    struct cmdf__entry_s entry;
+    size_t i = 0, len;
+
+    while (i < start && line[i] == ' ')
+        i++;
+
+    for (len = 0; i < start && line[i] != ' ' && len < sizeof(cmdname) - 1; i++)
+        cmdname[len++] = line[i];
+
+    cmdname[len] = '\0';
+
+    /* Count the arguments before it */
+    for (*argindex = 0; i < start; i++)
+        if (line[i] != ' ' && line[i - 1] == ' ')
+            (*argindex)++;
+
+    if (!cmdf__find_entry(ctx, ctx->settings_stack.top, cmdname, &entry) || !entry.info->completer)
+        return NULL;
+
+    return entry.info;
+}
+
+/*
+ * Complete the arguments of a command of the current menu with the given completer, or stop
+ * completing them with NULL. Completions are cached for ttl seconds, or until invalidated
+ * if it's 0. Completers are called with a lock held, so they mustn't call completion functions.
+ */
+CMDF_RETURN cmdf_set_command_completer(const char *cmdname, cmdf_completer_callback completer,
+                                       unsigned int ttl) {
+    struct cmdf__entry_s entry;
+
+    if (!cmdf__find_entry(cmdf__ctx, cmdf__active_menu(cmdf__ctx), cmdname, &entry))
+        return CMDF_ERROR_UNKNOWN_COMMAND;
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&cmdf__completions_lock);
+    #endif
+
+    entry.info->completer = completer;
+    entry.info->completion_ttl = ttl;
+    cmdf__completions_drop(entry.info);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__completions_lock);
+    #endif
+
+    return CMDF_OK;
+}
+
+/* Add a candidate to the completions a completer was asked for. The candidate is copied. */
+CMDF_RETURN cmdf_add_completion(cmdf_completions *completions, const char *candidate) {
+    char **candidates;
+
+    if (completions->count == completions->capacity) {
+        candidates = (char **)(CMDF_MALLOC(sizeof(char *) * (completions->capacity ? completions->capacity * 2 : 16)));
+        if (!candidates)
+            return CMDF_ERROR_OUT_OF_MEMORY;
+
+        if (completions->count)
+            memcpy(candidates, completions->candidates, sizeof(char *) * completions->count);
+
+        CMDF_FREE(completions->candidates);
+        completions->candidates = candidates;
+        completions->capacity = completions->capacity ? completions->capacity * 2 : 16;
+    }
+
+    if (!(completions->candidates[completions->count] = cmdf__strdup(candidate)))
+        return CMDF_ERROR_OUT_OF_MEMORY;
+
+    completions->count++;
+
+    return CMDF_OK;
+}
+
+/* Drop the cached completions of a command of the current menu, such as when they changed */
+CMDF_RETURN cmdf_invalidate_completions(const char *cmdname) {
+    struct cmdf__entry_s entry;
+
+    if (!cmdf__find_entry(cmdf__ctx, cmdf__active_menu(cmdf__ctx), cmdname, &entry))
+        return CMDF_ERROR_UNKNOWN_COMMAND;
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&cmdf__completions_lock);
+    #endif
+
+    cmdf__completions_drop(entry.info);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&cmdf__completions_lock);
+    #endif
+
+    return CMDF_OK;
+}
+
+/* Background jobs */
+#ifdef CMDF_THREAD_SUPPORT
+
+/*
+ * libcmdf worker pool, shared by all contexts. Started on the first background job.
+ * Queued jobs are linked from the oldest to the newest, and everything about jobs is
+ * protected by cmdf__jobs_lock.
+ */
+static pthread_t cmdf__workers[CMDF_WORKER_THREADS];
+static int cmdf__workers_started = 0;
+static struct cmdf__job_s *cmdf__jobs_head = NULL, *cmdf__jobs_tail = NULL;
+static pthread_cond_t cmdf__jobs_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cmdf__jobs_finished = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Add the statistics a job gathered in its copy of its command's state to the command's own,
+ * unless another command took over its slot since. Must be called with the lock held.
+ */
+void cmdf__jobs_fold(struct cmdf__job_s *job) {
+    const struct cmdf__entry_s *copy, *slot;
+    struct cmdf_command_stats *stats;
+
+    if (!job->entries)
+        return;
+
+    copy = job->entries + (job->info - job->infos);
+    slot = job->ctx->entries + job->menu.entry_start + (job->info - job->infos);
+    if (slot->callback != copy->callback || slot->cmdname != copy->cmdname)
+        return;
+
+    stats = &slot->info->stats;
+    CMDF__RELAXED_ADD(stats->calls, job->info->stats.calls);
+    CMDF__RELAXED_ADD(stats->cancellations, job->info->stats.cancellations);
+    CMDF__RELAXED_ADD(stats->overruns, job->info->stats.overruns);
+    CMDF__RELAXED_ADD(stats->total_ms, job->info->stats.total_ms);
+    cmdf__stats_max(stats, job->info->stats.max_ms);
+}
+
+void *cmdf__worker_main(void *arg /* Unused */) {
+    struct cmdf__output_buffer_s output;
+    struct cmdf__watch_s watch;
+    struct cmdf__job_s *job;
+    struct cmdf__context_s *ctx;
+    void (*orphaned)(struct cmdf__context_s *ctx);
+    CMDF_RETURN retval;
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+
+    for (;;) {
+        /* Take the oldest queued job, or wait for one to arrive */
+        if (!(job = cmdf__jobs_head)) {
+            pthread_cond_wait(&cmdf__jobs_queued, &cmdf__jobs_lock);
+            continue;
+        }
+
+        if (!(cmdf__jobs_head = job->next))
+            cmdf__jobs_tail = NULL;
+
+        /* Run it outside of the lock, in the context it was started from */
+        job->state = CMDF__JOB_RUNNING;
+        pthread_mutex_unlock(&cmdf__jobs_lock);
+
+        /* Output held for the feeding thread is kept in a spool from the start */
+        cmdf__ctx = job->ctx;
+        cmdf__current_job = job;
+        output.len = 0;
+        output.message = 0;
+        output.spool = job->held ? tmpfile() : NULL;
+        output.hold = (output.spool != NULL);
+        cmdf__job_output = &output;
+        cmdf__watch_begin(&watch, job->info);
+        retval = cmdf__watch_end(&watch, job->callback(job->arglist));
+        if (job->ctx->format == CMDF_OUTPUT_JSON)
+            cmdf__record_result(job->ctx, NULL, job->cmdline, job->id, retval, cmdf__clock_ms() - watch.start);
+        cmdf__flush(job->ctx);
+        if (output.hold)
+            job->output = output.spool;
+        else if (output.spool)
+            fclose(output.spool);
+        cmdf__job_output = NULL;
+        cmdf__current_job = NULL;
+
+        pthread_mutex_lock(&cmdf__jobs_lock);
+        cmdf__jobs_fold(job);
+        job->retval = retval;
+        job->state = job->cancelled ? CMDF__JOB_KILLED : CMDF__JOB_DONE;
+        pthread_cond_broadcast(&cmdf__jobs_finished);
+
+        /* The last job of a detached context releases it, without the lock */
+        if ((orphaned = job->ctx->orphaned) && !cmdf__jobs_stop(job->ctx)) {
+            ctx = job->ctx;
+            ctx->orphaned = NULL;
+            pthread_mutex_unlock(&cmdf__jobs_lock);
+            orphaned(ctx);
+            pthread_mutex_lock(&cmdf__jobs_lock);
+        }
+    }
+
+    return NULL;
+}
+
+/* Report a job that's still pending in a job record, in JSON output */
+void cmdf__jobs_record(struct cmdf__context_s *ctx, int id, const char *cmdline, const char *state) {
+    cmdf__record_begin(ctx, "job");
+    cmdf__record_number(ctx, "job", id);
+    cmdf__record_key(ctx, "command");
+    cmdf__json_string(ctx, cmdline);
+    cmdf__record_key(ctx, "state");
+    cmdf__json_string(ctx, state);
+    cmdf__record_end(ctx);
+}
+
+/*
+ * Queue a command of the given menu to be run by the worker pool. The job works with a copy
+ * of the menu, as the menu itself keeps changing in the foreground. Commands that act on
+ * the foreground, such as exit, or on jobs are refused, with CMDF_ERROR_ARGUMENT_ERROR.
+ * That leaves the slots of a context's jobs to be freed by the thread driving it only,
+ * so it can use what they hold once it lets go of the lock.
+ * On success, the job takes ownership of the argument list and the command line.
+ * Otherwise, they are left to the caller.
+ */
+CMDF_RETURN cmdf__jobs_submit(struct cmdf__context_s *ctx, const struct cmdf__settings_s *settings,
+                              const struct cmdf__entry_s *entry, cmdf_arglist *arglist, char *cmdline) {
+    struct cmdf__job_s *job = NULL;
+    struct cmdf__entry_s *entries = NULL;
+    struct cmdf__command_info_s *infos = NULL, *info = entry->info;
+    const struct cmdf__entry_s *source;
+    int i, id;
+
+    if (entry->callback == cmdf__default_do_exit || entry->callback == cmdf__default_do_wait ||
+        entry->callback == cmdf__default_do_jobs || entry->callback == cmdf__default_do_kill)
+        return CMDF_ERROR_ARGUMENT_ERROR;
+
+    /* Once a submenu exits, the foreground reuses the slots of its commands, so jobs take
+     * a copy of them. Catalog commands keep their slots for as long as the catalog lives. */
+    if (!settings->catalog) {
+        source = cmdf__menu_entries(ctx, settings);
+        entries = (struct cmdf__entry_s *)(CMDF_MALLOC(sizeof(struct cmdf__entry_s) *
+                                                       (settings->entry_count + 1)));
+        infos = (struct cmdf__command_info_s *)(CMDF_MALLOC(sizeof(struct cmdf__command_info_s) *
+                                                            (settings->entry_count + 1)));
+        if (!entries || !infos) {
+            CMDF_FREE(entries);
+            CMDF_FREE(infos);
+            return CMDF_ERROR_OUT_OF_MEMORY;
+        }
+
+        memset(infos, 0, sizeof(struct cmdf__command_info_s) * (settings->entry_count + 1));
+        for (i = 0; i < settings->entry_count; i++) {
+            entries[i] = source[i];
+            entries[i].info = infos + i;
+            infos[i].timeout = CMDF__RELAXED_LOAD(source[i].info->timeout);
+            infos[i].completer = source[i].info->completer;
+            infos[i].completion_ttl = source[i].info->completion_ttl;
+
+            if (source[i].info == entry->info)
+                info = infos + i;
+        }
+    }
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+
+    /* Start the worker pool, if we haven't already */
+    if (!cmdf__workers_started) {
+        for (i = 0; i < CMDF_WORKER_THREADS; i++) {
+            if (pthread_create(cmdf__workers + cmdf__workers_started, NULL, cmdf__worker_main, NULL) == 0) {
+                pthread_detach(cmdf__workers[cmdf__workers_started]);
+                cmdf__workers_started++;
+            }
+        }
+    }
+
+    /* Find a free slot in the job table */
+    for (i = 0; i < CMDF_MAX_JOBS && cmdf__workers_started; i++) {
+        if (ctx->jobs[i].state == CMDF__JOB_FREE) {
+            job = ctx->jobs + i;
+            break;
+        }
+    }
+
+    if (!job) {
+        pthread_mutex_unlock(&cmdf__jobs_lock);
+        CMDF_FREE(entries);
+        CMDF_FREE(infos);
+        return CMDF_ERROR_TOO_MANY_JOBS;
+    }
+
+    job->id = id = ++ctx->next_job_id;
+    job->state = CMDF__JOB_QUEUED;
+    job->cmdline = cmdline;
+    job->callback = entry->callback;
+    job->info = info;
+    job->entries = entries;
+    job->infos = infos;
+    job->arglist = arglist;
+    job->cancelled = 0;
+    job->output = NULL;
+    job->ctx = ctx;
+    job->menu = *settings;
+    job->next = NULL;
+
+    /* Readline is redrawing the line being edited, which only the feeding thread may do */
+    #ifdef CMDF_READLINE_SUPPORT
+        job->held = (ctx->feed_buffer.mode == CMDF__FEED_READLINE);
+    #else
+        job->held = 0;
+    #endif
+
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+
+    /* Announce it before it's queued, so it comes before its output. Writing may block on
+     * the context's I/O backend, so it's done without the lock. */
+    if (ctx->format == CMDF_OUTPUT_JSON)
+        cmdf__jobs_record(ctx, id, cmdline, "queued");
+    else
+        cmdf__printf(ctx, "[%d] %s\n", id, cmdline);
+
+    cmdf__drain(ctx);
+
+    /* Append it to the queue */
+    pthread_mutex_lock(&cmdf__jobs_lock);
+
+    if (cmdf__jobs_tail)
+        cmdf__jobs_tail->next = job;
+    else
+        cmdf__jobs_head = job;
+
+    cmdf__jobs_tail = job;
+
+    pthread_cond_signal(&cmdf__jobs_queued);
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+
+    return CMDF_OK;
+}
+
+/* Remove a job from the worker pool's queue. Must be called with the lock held. */
+void cmdf__jobs_dequeue(struct cmdf__job_s *job) {
+    struct cmdf__job_s **linkptr, *prev = NULL;
+
+    for (linkptr = &cmdf__jobs_head; *linkptr; prev = *linkptr, linkptr = &(*linkptr)->next) {
+        if (*linkptr == job) {
+            *linkptr = job->next;
+            if (cmdf__jobs_tail == job)
+                cmdf__jobs_tail = prev;
+
+            return;
+        }
+    }
+}
+
+/* Free a finished or killed job's slot. Must be called with the lock held. */
+void cmdf__jobs_free(struct cmdf__job_s *job) {
+    int i;
+
+    if (job->output)
+        fclose(job->output);
+
+    /* Its copy of the menu's commands is its own, so their caches are dropped without locks */
+    for (i = 0; job->infos && i < job->menu.entry_count; i++) {
+        cmdf__completions_drop(job->infos + i);
+        cmdf__help_drop(job->infos + i);
+    }
+
+    CMDF_FREE(job->entries);
+    CMDF_FREE(job->infos);
+    job->entries = NULL;
+    job->infos = NULL;
+
+    cmdf_free_arglist(job->arglist);
+    CMDF_FREE(job->cmdline);
+    job->output = NULL;
+    job->state = CMDF__JOB_FREE;
+}
+
+/*
+ * Report finished and killed jobs, and free their slots in the job table. The jobs are
+ * only taken out of the table with the lock held, as writing the reports may block on
+ * the context's I/O backend.
+ */
+void cmdf__jobs_report(struct cmdf__context_s *ctx) {
+    struct cmdf__job_report_s reports[CMDF_MAX_JOBS], *report;
+    struct cmdf__job_s *job;
+    int count = 0, i;
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+
+    for (job = ctx->jobs; job < ctx->jobs + CMDF_MAX_JOBS; job++) {
+        if (job->state != CMDF__JOB_DONE && job->state != CMDF__JOB_KILLED)
+            continue;
+
+        report = reports + count++;
+        report->id = job->id;
+        report->state = job->state;
+        report->retval = job->retval;
+        report->cmdline = job->cmdline;
+        report->output = job->output;
+        job->cmdline = NULL;
+        job->output = NULL;
+        cmdf__jobs_free(job);
+    }
+
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+
+    for (i = 0, report = reports; i < count; i++, report++) {
+        /* Output held for this thread comes before the report */
+        if (report->output) {
+            cmdf__drain(ctx);
+            cmdf__spool_forward(ctx, report->output);
+            fclose(report->output);
+        }
+
+        /* In JSON output, every job already has its result record */
+        if (ctx->format == CMDF_OUTPUT_JSON)
+            ;
+        else if (report->state == CMDF__JOB_KILLED)
+            cmdf__printf(ctx, "[%d] Killed     %s\n", report->id, report->cmdline);
+        else if (report->retval == CMDF_OK)
+            cmdf__printf(ctx, "[%d] Done       %s\n", report->id, report->cmdline);
+        else if (report->retval == CMDF_ERROR_TIMED_OUT)
+            cmdf__printf(ctx, "[%d] Timed out  %s\n", report->id, report->cmdline);
+        else
+            cmdf__printf(ctx, "[%d] Exit %-5d %s\n", report->id, report->retval, report->cmdline);
+
+        CMDF_FREE(report->cmdline);
+    }
+}
+
+/*
+ * Cancel all queued jobs of a context, and ask its running ones to stop. Returns whether
+ * any are still running. Must be called with the lock held.
+ */
+int cmdf__jobs_stop(struct cmdf__context_s *ctx) {
+    struct cmdf__job_s *job;
+    int running = 0;
+
+    for (job = ctx->jobs; job < ctx->jobs + CMDF_MAX_JOBS; job++) {
+        if (job->state == CMDF__JOB_QUEUED) {
+            cmdf__jobs_dequeue(job);
+            job->state = CMDF__JOB_KILLED;
+        }
+        else if (job->state == CMDF__JOB_RUNNING) {
+            __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+            running = 1;
+        }
+    }
+
+    return running;
+}
+
+/*
+ * Stop the jobs of a context that's going away without waiting for them. If some are still
+ * running, the worker finishing the last one calls orphaned on the context, which must
+ * release it then, and 1 is returned. Otherwise it's 0, and the context can be released
+ * right away. Must be called with the lock held.
+ */
+int cmdf__jobs_detach(struct cmdf__context_s *ctx, void (*orphaned)(struct cmdf__context_s *ctx)) {
+    if (!cmdf__jobs_stop(ctx))
+        return 0;
+
+    ctx->orphaned = orphaned;
+
+    return 1;
+}
+
+/* Cancel all queued jobs of a context, wait for its running ones, and free them all */
+void cmdf__jobs_cancel_all(struct cmdf__context_s *ctx) {
+    struct cmdf__job_s *job;
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+
+    while (cmdf__jobs_stop(ctx))
+        pthread_cond_wait(&cmdf__jobs_finished, &cmdf__jobs_lock);
+
+    for (job = ctx->jobs; job < ctx->jobs + CMDF_MAX_JOBS; job++)
+        if (job->state != CMDF__JOB_FREE)
+            cmdf__jobs_free(job);
+
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+}
+
+/* Parse a job ID argument. Returns the matching job, or NULL if there is none. */
+struct cmdf__job_s *cmdf__jobs_find(struct cmdf__context_s *ctx, const char *idstr) {
+    char *endptr;
+    long id;
+    int i;
+
+    /* Allow the shell-like "%N" form */
+    if (*idstr == '%')
+        idstr++;
+
+    id = strtol(idstr, &endptr, 10);
+    if (*idstr == '\0' || *endptr != '\0')
+        return NULL;
+
+    for (i = 0; i < CMDF_MAX_JOBS; i++)
+        if (ctx->jobs[i].state != CMDF__JOB_FREE && ctx->jobs[i].id == id)
+            return ctx->jobs + i;
+
+    return NULL;
+}
+
+CMDF_RETURN cmdf__default_do_jobs(cmdf_arglist *arglist /* Unused */) {
+    enum cmdf__job_state states[CMDF_MAX_JOBS];
+    struct cmdf__job_s *job;
+    int i;
+
+    /* Note the state of the pending jobs, then list them without the lock */
+    pthread_mutex_lock(&cmdf__jobs_lock);
+
+    for (i = 0; i < CMDF_MAX_JOBS; i++)
+        states[i] = cmdf__ctx->jobs[i].state;
+
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+
+    for (i = 0, job = cmdf__ctx->jobs; i < CMDF_MAX_JOBS; i++, job++) {
+        if (states[i] != CMDF__JOB_QUEUED && states[i] != CMDF__JOB_RUNNING)
+            continue;
+
+        if (cmdf__ctx->format == CMDF_OUTPUT_JSON)
+            cmdf__jobs_record(cmdf__ctx, job->id, job->cmdline,
+                              states[i] == CMDF__JOB_QUEUED ? "queued" : "running");
+        else
+            cmdf__printf(cmdf__ctx, "[%d] %-10s %s\n", job->id,
+                         states[i] == CMDF__JOB_QUEUED ? "Queued" : "Running", job->cmdline);
+    }
+
+    /* Then report the finished ones */
+    cmdf__jobs_report(cmdf__ctx);
+
+    return CMDF_OK;
+}
+
+CMDF_RETURN cmdf__default_do_wait(cmdf_arglist *arglist) {
+    struct cmdf__job_s *job = NULL, *iter;
+    struct timespec deadline;
+    int pending;
+
+    if (arglist && arglist->count > 1) {
+        cmdf__printf(cmdf__ctx, "Too many arguments for the 'wait' command!\n");
+        return CMDF_ERROR_TOO_MANY_ARGS;
+    }
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+
+    if (arglist && !(job = cmdf__jobs_find(cmdf__ctx, arglist->args[0]))) {
+        pthread_mutex_unlock(&cmdf__jobs_lock);
+        cmdf__printf(cmdf__ctx, "No such job: '%s'.\n", arglist->args[0]);
+        return CMDF_ERROR_ARGUMENT_ERROR;
+    }
+
+    /* Wait for the given job, or for all of them */
+    do {
+        for (iter = cmdf__ctx->jobs, pending = 0; iter < cmdf__ctx->jobs + CMDF_MAX_JOBS; iter++)
+            if ((!job || job == iter) &&
+                (iter->state == CMDF__JOB_QUEUED || iter->state == CMDF__JOB_RUNNING))
+                pending = 1;
+
+        /* Wake up now and then, so Ctrl-C can stop the wait */
+        if (pending) {
+            deadline.tv_sec = time(NULL) + 1;
+            deadline.tv_nsec = 0;
+            pthread_cond_timedwait(&cmdf__jobs_finished, &cmdf__jobs_lock, &deadline);
+        }
+    } while (pending && !cmdf_cancelled());
+
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+
+    cmdf__jobs_report(cmdf__ctx);
+
+    return CMDF_OK;
+}
+
+CMDF_RETURN cmdf__default_do_kill(cmdf_arglist *arglist) {
+    enum cmdf__job_state state = CMDF__JOB_FREE;
+    struct cmdf__job_s *job;
+
+    if (!arglist || arglist->count != 1) {
+        cmdf__printf(cmdf__ctx, "Usage: kill <job ID>\n");
+        return CMDF_ERROR_ARGUMENT_ERROR;
+    }
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+
+    /* Queued jobs are cancelled right away, running ones once they notice */
+    if ((job = cmdf__jobs_find(cmdf__ctx, arglist->args[0]))) {
+        state = job->state;
+        if (state == CMDF__JOB_QUEUED) {
+            cmdf__jobs_dequeue(job);
+            job->state = CMDF__JOB_KILLED;
+            pthread_cond_broadcast(&cmdf__jobs_finished);
+        }
+        else if (state == CMDF__JOB_RUNNING)
+            __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+
+    if (!job) {
+        cmdf__printf(cmdf__ctx, "No such job: '%s'.\n", arglist->args[0]);
+        return CMDF_ERROR_ARGUMENT_ERROR;
+    }
+
+    /* A queued job never ran, so nothing else will report how it went */
+    if (state == CMDF__JOB_QUEUED && cmdf__ctx->format == CMDF_OUTPUT_JSON)
+        cmdf__record_result(cmdf__ctx, NULL, job->cmdline, job->id, CMDF_ERROR_CANCELLED, 0);
+    else if (state == CMDF__JOB_RUNNING)
+        cmdf__printf(cmdf__ctx, "Job %d was asked to stop.\n", job->id);
+
+    cmdf__jobs_report(cmdf__ctx);
+
+    return CMDF_OK;
+}
+
+#endif /* CMDF_THREAD_SUPPORT */
+
+/*
+ * Execute a single command, which must be writable and trimmed, against the
+ * given settings. The command is split in place into its name and its arguments.
+ * If background is set, or the command was registered with CMDF_COMMAND_ASYNC,
+ * it is handed over to the worker pool instead (if thread support is enabled).
+ */
+CMDF_RETURN cmdf__exec_command(struct cmdf__context_s *ctx, struct cmdf__settings_s *settings,
+                               char *cmdline, int background) {
+    struct cmdf__context_s *prev_ctx;
+    struct cmdf__entry_s entry;
+    struct cmdf__watch_s watch;
+    sig_atomic_t prev_generation;
+    char *argsptr, *spcptr;
+    cmdf_arglist *cmd_args;
+    CMDF_RETURN retflag;
+    int found;
+    #ifdef CMDF_THREAD_SUPPORT
+        char *jobline;
+    #endif
+
+    /* Split by first space.
+     * This should be the command, followed by arguments. */
+    if ((spcptr = strchr(cmdline, ' '))) {
+        *spcptr = '\0';
+        argsptr = spcptr + 1;
+    }
+    else
+        argsptr = NULL;
+
+    found = cmdf__find_entry(ctx, settings, cmdline, &entry);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        if (found && (background || (entry.flags & CMDF_COMMAND_ASYNC))) {
+            /* Keep a copy of the command line for the job table, since the
+             * arguments are about to be parsed in place. */
+            jobline = (char *)(CMDF_MALLOC(sizeof(char) * (strlen(cmdline) + 1 +
+                                                           (argsptr ? strlen(argsptr) + 1 : 0))));
+            if (!jobline)
+                return CMDF_ERROR_OUT_OF_MEMORY;
+
+            strcpy(jobline, cmdline);
+            if (argsptr) {
+                strcat(jobline, " ");
+                strcat(jobline, argsptr);
+            }
+
+            cmd_args = cmdf_parse_arguments(argsptr);
+
+            retflag = cmdf__jobs_submit(ctx, settings, &entry, cmd_args, jobline);
+            if (retflag != CMDF_OK) {
+                cmdf__printf(ctx, "Unable to run '%s' in the background.\n", cmdline);
+                cmdf_free_arglist(cmd_args);
+                CMDF_FREE(jobline);
+            }
+
+            return retflag;
+        }
+    #endif
+
+    /* Parse arguments */
+    cmd_args = cmdf_parse_arguments(argsptr);
+
+    /* Execute the entry found above, with ctx as the calling thread's context while it runs.
+     * Meanwhile, Ctrl-C cancels the command rather than the process, and the
+     * command is timed against its time limit. Unknown commands aren't timed. */
+    prev_ctx = cmdf__ctx;
+    cmdf__ctx = ctx;
+    prev_generation = cmdf__invocation_begin();
+    if (found) {
+        cmdf__watch_begin(&watch, entry.info);
+        retflag = cmdf__watch_end(&watch, settings->do_command(&entry, cmd_args));
+    }
+    else {
+        retflag = settings->do_command(NULL, cmd_args);
+        watch.elapsed = 0;
+    }
+    if (cmdf__invocation_end(prev_generation))
+        retflag = CMDF_ERROR_CANCELLED;
+    cmdf__ctx = prev_ctx;
+
+    /* Programs reading JSON output get the outcome of every command */
+    if (ctx->format == CMDF_OUTPUT_JSON)
+        cmdf__record_result(ctx, found ? NULL : settings, cmdline, 0, retflag, watch.elapsed);
+    else switch (retflag) {
+        case CMDF_ERROR_UNKNOWN_COMMAND:
+            cmdf__printf(ctx, "Unknown command '%s'.\n", cmdline);
+            if (!found)
+                cmdf__print_suggestions(ctx, settings, cmdline);
+            break;
+        case CMDF_ERROR_CANCELLED:
+            cmdf__printf(ctx, "\nCommand '%s' was interrupted.\n", cmdline);
+            break;
+        case CMDF_ERROR_TIMED_OUT:
+            cmdf__printf(ctx, "\nCommand '%s' ran past its %u second time limit.\n",
+                    cmdline, watch.timeout);
+            break;
+    }
+
+    /* Free arguments */
+    cmdf_free_arglist(cmd_args);
+
+    return retflag;
+}
+
+/*
+ * Execute a single input line, which must be writable and trimmed, against the
+ * given settings of ctx. A line may hold several commands separated by ';' (always run
+ * the next command), '&&' (run it only if the previous one succeeded) or '||'
+ * (run it only if the previous one failed). Separators inside quotes are ignored.
+ * If thread support is enabled, a command ending with '&' is run in the background.
+ * Returns the return code of the last command executed.
+ */
+CMDF_RETURN cmdf__exec_line(struct cmdf__context_s *ctx, struct cmdf__settings_s *settings, char *line) {
+    enum seqops { ALWAYS, ON_SUCCESS, ON_FAILURE } op = ALWAYS, nextop;
+    char *segptr, *strptr, *endptr;
+    int in_quotes = 0, last, background = 0;
+    CMDF_RETURN retflag = CMDF_OK;
+
+    /* If input is empty, call do_emptyline command. */
+    if (line[0] == '\0')
+        return settings->do_emptyline(NULL);
+
+    for (segptr = strptr = line; ; segptr = strptr, op = nextop) {
+        /* Look for the end of the current command: either a separator outside of
+         * quotes, or the end of the line. */
+        while (*strptr) {
+            if (*strptr == '\"')
+                in_quotes = !in_quotes;
+            else if (!in_quotes && (*strptr == ';' ||
+                     ((*strptr == '&' || *strptr == '|') && strptr[1] == *strptr)))
+                break;
+
+            strptr++;
+        }
+
+        /* Determine how the next command is conditioned, and terminate this one */
+        last = (*strptr == '\0');
+        nextop = *strptr == ';' ? ALWAYS : (*strptr == '&' ? ON_SUCCESS : ON_FAILURE);
+        if (!last) {
+            endptr = strptr;
+            strptr += (*strptr == ';') ? 1 : 2;
+            *endptr = '\0';
+        }
+
+        /* Trim the command in place */
+        while (isspace((int)*segptr))
+            segptr++;
+
+        endptr = strchr(segptr, '\0');
+        while (endptr != segptr && isspace((int)*(endptr - 1)))
+            *(--endptr) = '\0';
+
+        /* Check for a trailing '&', which requests running the command in the background */
+        #ifdef CMDF_THREAD_SUPPORT
+            if ((background = (endptr != segptr && *(endptr - 1) == '&'))) {
+                *(--endptr) = '\0';
+                while (endptr != segptr && isspace((int)*(endptr - 1)))
+                    *(--endptr) = '\0';
+            }
+        #endif
+
+        /* Execute it, if its condition holds, against the menu active by now, which is
+         * a submenu if an earlier command opened one. Empty commands are skipped. */
+        if (*segptr != '\0' && (op == ALWAYS || (op == ON_SUCCESS) == (retflag == CMDF_OK))) {
+            settings = ctx->settings_stack.top;
+            retflag = cmdf__exec_command(ctx, settings, segptr, background);
+            cmdf__flush(ctx);
+        }
+
+        /* An interrupted command stops the whole line */
+        if (last || settings->exit_flag || retflag == CMDF_ERROR_CANCELLED)
+            break;
+    }
+
+    return retflag;
+}
+
+/* Prompt for a line of input of ctx and read it, without editing. Returns NULL at EOF. */
+char *cmdf__read_line(struct cmdf__context_s *ctx, const char *prompt, char *buff, size_t size) {
+    /* Programs reading JSON output don't need prompting */
+    if (ctx->format != CMDF_OUTPUT_JSON)
+        cmdf__puts(ctx, prompt);
+    cmdf__flush(ctx);
+
+    if (ctx->io.read_line)
+        return ctx->io.read_line(ctx->io.data, buff, size);
+
+    return CMDF_FGETS(buff, (int)size, CMDF_STDIN);
+}
+
+void cmdf__default_commandloop(struct cmdf__context_s *ctx) {
+    #ifndef CMDF_READLINE_SUPPORT
+        char inputbuff[CMDF_MAX_INPUT_BUFFER_LENGTH];
+    #else
+        char *inputbuff;
+    #endif
+
+    #ifdef CMDF_LINEEDIT_SUPPORT
+        char *block;
+    #endif
+
+    struct cmdf__context_s *prev_ctx = cmdf__ctx;
+    struct cmdf__settings_s *settings;
+
+    /* Only the foreground reads input for the menus of ctx */
+    if (cmdf__job_of(ctx))
+        return;
+
+    settings = ctx->settings_stack.top;
+
+    /* Make ctx the calling thread's context for the whole loop, so completion sees it */
+    cmdf__ctx = ctx;
+
+    /* Print intro, if any. */
+    if (settings->intro)
+        cmdf__printf(ctx, "\n%s\n\n", settings->intro);
+
+    while (!settings->exit_flag) {
+        /* Report background jobs that finished since the last prompt */
+        #ifdef CMDF_THREAD_SUPPORT
+            cmdf__jobs_report(ctx);
+        #endif
+
+        /* Print prompt and get input */
+        #if defined(CMDF_LINEEDIT_SUPPORT)
+            if (cmdf__lineedit_read(ctx, settings->prompt, inputbuff, sizeof(inputbuff), &block) == -1) {
+                settings->exit_flag = 1;
+                continue;
+            }
+
+            /* Pasted lines run as one batch, without prompting in between */
+            if (block) {
+                cmdf__lineedit_run(ctx, block);
+                continue;
+            }
+        #elif !defined(CMDF_READLINE_SUPPORT)
+            /* Check for EOF */
+            if (!cmdf__read_line(ctx, settings->prompt, inputbuff, sizeof(inputbuff))) {
+                settings->exit_flag = 1;
+                continue;
+            }
+        #else
+            cmdf__flush(ctx);
+
+            /* Readline only edits the console. Lines read from a backend are freed the same way. */
+            if (!ctx->io.read_line)
+                inputbuff = readline(settings->prompt);
+            else if ((inputbuff = (char *)malloc(CMDF_MAX_INPUT_BUFFER_LENGTH)) &&
+                     !cmdf__read_line(ctx, settings->prompt, inputbuff, CMDF_MAX_INPUT_BUFFER_LENGTH)) {
+                free(inputbuff);
+                inputbuff = NULL;
+            }
+
+            /* EOF, or failure to allocate a buffer. Means we probably need to exit. */
+            if (!inputbuff) {
+                settings->exit_flag = 1;
+                continue;
+            }
+        #endif
+
+        /* Trim string */
+        cmdf__trim(inputbuff);
+
+        /* If line has something in it and readline is enabled, save this to history. */
+        #ifdef CMDF_READLINE_SUPPORT
+            if (inputbuff[0] != '\0')
+                add_history(inputbuff);
+        #elif defined(CMDF_LINEEDIT_SUPPORT)
+            if (inputbuff[0] != '\0')
+                cmdf__history_add(ctx, inputbuff);
+        #endif
+
+        cmdf__exec_line(ctx, settings, inputbuff);
+
+        #ifdef CMDF_READLINE_SUPPORT
+            /* Free buffer */
+            free(inputbuff);
+        #endif
+    }
+
+    cmdf__flush(ctx);
+
+    /* Pop out settings from settings stack */
+    ctx->settings_stack.size--;
+    ctx->settings_stack.top--;
+
+    cmdf__ctx = prev_ctx;
+}
+
+/*
+ * Execute an array of command lines in one go, as if they were typed at the prompt.
+ * Per-call setup is done once for the whole batch. Each line runs against the menu that
+ * is active when it starts, so lines following one that opens a submenu go to the submenu,
+ * and submenus exiting are popped off the stack. Execution stops early if the menu active
+ * at the start requests exit, or a command is interrupted. If results is not NULL, the
+ * return code of every executed line is stored in it. Returns the number of lines executed.
+ */
+size_t cmdf_exec_batch(const char *const *lines, size_t n, CMDF_RETURN *results) {
+    return cmdf_exec_batch_ctx(cmdf__ctx, lines, n, results);
+}
+
+size_t cmdf_exec_batch_ctx(cmdf_context *ctx, const char *const *lines, size_t n,
+                           CMDF_RETURN *results) {
+    struct cmdf__settings_s *base = ctx->settings_stack.top, *settings;
+    struct cmdf__context_s *prev_ctx = cmdf__ctx;
+    char linebuff[CMDF_MAX_INPUT_BUFFER_LENGTH], *line;
+    sig_atomic_t prev_generation;
+    size_t i, len;
+    CMDF_RETURN retflag = CMDF_OK;
+
+    /* Become the foreground once for the whole batch, rather than once per command.
+     * A Ctrl-C landing between two commands then cancels the batch. */
+    cmdf__ctx = ctx;
+    prev_generation = cmdf__invocation_begin();
+
+    for (i = 0; i < n && !base->exit_flag; i++) {
+        settings = ctx->settings_stack.top;
+
+        /* Copy the line to a writable buffer, falling back to the heap for long lines */
+        len = strlen(lines[i]);
+        line = len < sizeof(linebuff) ? linebuff : (char *)(CMDF_MALLOC(sizeof(char) * (len + 1)));
+
+        if (line) {
+            memcpy(line, lines[i], len + 1);
+            cmdf__trim(line);
+
+            retflag = cmdf__exec_line(ctx, settings, line);
+
+            if (line != linebuff)
+                CMDF_FREE(line);
+        }
+        else
+            retflag = CMDF_ERROR_OUT_OF_MEMORY;
+
+        /* If the line opened a submenu, print its intro */
+        if (ctx->settings_stack.top != settings && ctx->settings_stack.top->intro) {
+            cmdf__printf(ctx, "\n%s\n\n", ctx->settings_stack.top->intro);
+            cmdf__flush(ctx);
+        }
+
+        /* Pop out exited submenus opened within the batch */
+        while (ctx->settings_stack.top != base && ctx->settings_stack.top->exit_flag) {
+            ctx->settings_stack.size--;
+            ctx->settings_stack.top--;
+        }
+
+        /* Commands consume the interrupts they receive, so any left arrived in between */
+        if (cmdf__generation != cmdf__interrupts) {
+            cmdf__generation = cmdf__interrupts;
+            cmdf__interrupt_pending = 0;
+            retflag = CMDF_ERROR_CANCELLED;
+        }
+
+        if (results)
+            results[i] = retflag;
+
+        /* An interrupted line stops the whole batch */
+        if (retflag == CMDF_ERROR_CANCELLED) {
+            i++;
+            break;
+        }
+    }
+
+    cmdf__invocation_end(prev_generation);
+    cmdf__ctx = prev_ctx;
+
+    return i;
+}
+
+/* Print the prompt of the active menu, for the event loop interface */
+void cmdf__feed_prompt(struct cmdf__context_s *ctx) {
+    /* Report background jobs that finished since the last prompt */
+    #ifdef CMDF_THREAD_SUPPORT
+        cmdf__jobs_report(ctx);
+    #endif
+
+    if (ctx->format != CMDF_OUTPUT_JSON)
+        cmdf__puts(ctx, ctx->settings_stack.top->prompt);
+    cmdf__flush(ctx);
+}
+
+/*
+ * Print the intro and the first prompt, before feeding any input.
+ * If readline is enabled, this installs readline's callback interface instead,
+ * and input should be read with cmdf_feed_readline(), unless ctx writes to an I/O backend.
+ */
+void cmdf_feed_begin(void) {
+    cmdf_feed_begin_ctx(cmdf__ctx);
+}
+
+void cmdf_feed_begin_ctx(cmdf_context *ctx) {
+    if (ctx->settings_stack.top->intro)
+        cmdf__printf(ctx, "\n%s\n\n", ctx->settings_stack.top->intro);
+
+    /* Readline only edits the console, so contexts with an I/O backend are fed plainly */
+    #ifdef CMDF_READLINE_SUPPORT
+        if (!ctx->io.write) {
+            ctx->feed_buffer.mode = CMDF__FEED_READLINE;
+            cmdf__readline_ctx = ctx;
+            cmdf__flush(ctx);
+            rl_callback_handler_install(ctx->settings_stack.top->prompt, cmdf__readline_line_handler);
+            return;
+        }
+    #endif
+
+    ctx->feed_buffer.mode = CMDF__FEED_PLAIN;
+    cmdf__feed_prompt(ctx);
+}
+
+/* Pop out exited menus from settings stack */
+void cmdf__feed_pop_exited(struct cmdf__context_s *ctx) {
+    while (ctx->settings_stack.size && ctx->settings_stack.top->exit_flag) {
+        ctx->settings_stack.size--;
+        ctx->settings_stack.top--;
+    }
+}
+
+/* Execute a fed, writable line against the active menu */
+void cmdf__feed_line(struct cmdf__context_s *ctx, char *line) {
+    struct cmdf__settings_s *settings = ctx->settings_stack.top;
+
+    cmdf__trim(line);
+    cmdf__exec_line(ctx, settings, line);
+
+    /* If the command opened a submenu, print its intro */
+    if (ctx->settings_stack.top != settings && ctx->settings_stack.top->intro)
+        cmdf__printf(ctx, "\n%s\n\n", ctx->settings_stack.top->intro);
+
+    cmdf__feed_pop_exited(ctx);
+}
+
+/*
+ * Feed input to the interpreter, without blocking. Input is buffered until a complete
+ * line arrives, and every complete line is then executed. Lines longer than the input
+ * buffer are split, just like fgets() would. A menu that exits is popped off the stack.
+ * Feeding zero bytes signals end of input, which executes any partial line and exits
+ * all menus.
+ *
+ * Callbacks opening submenus should only call cmdf_init() and register their commands,
+ * without calling cmdf_commandloop(): the following lines are fed to the new menu.
+ *
+ * Returns CMDF_OK, or CMDF_EXITED once the last menu exited.
+ */
+CMDF_RETURN cmdf_feed(const char *bytes, size_t len) {
+    return cmdf_feed_ctx(cmdf__ctx, bytes, len);
+}
+
+CMDF_RETURN cmdf_feed_ctx(cmdf_context *ctx, const char *bytes, size_t len) {
+    const char *endptr = bytes + len, *nlptr;
+    size_t chunk, space;
+    int executed = 0;
+
+    while (bytes != endptr && ctx->settings_stack.size) {
+        /* Append as much as we can of the current line to the buffer */
+        nlptr = (const char *)(memchr(bytes, '\n', endptr - bytes));
+        chunk = (nlptr ? nlptr + 1 : endptr) - bytes;
+        space = sizeof(ctx->feed_buffer.buff) - 1 - ctx->feed_buffer.length;
+
+        if (chunk >= space) {
+            chunk = space;
+            nlptr = bytes + chunk - 1;
+        }
+
+        memcpy(ctx->feed_buffer.buff + ctx->feed_buffer.length, bytes, chunk);
+        ctx->feed_buffer.length += chunk;
+        bytes += chunk;
+
+        /* Wait for the rest of the line, unless the buffer is full */
+        if (!nlptr)
+            break;
+
+        ctx->feed_buffer.buff[ctx->feed_buffer.length] = '\0';
+        ctx->feed_buffer.length = 0;
+
+        cmdf__feed_line(ctx, ctx->feed_buffer.buff);
+        executed = 1;
+    }
+
+    /* On end of input, execute what's left and exit every menu */
+    if (len == 0 && ctx->settings_stack.size) {
+        if (ctx->feed_buffer.length) {
+            ctx->feed_buffer.buff[ctx->feed_buffer.length] = '\0';
+            ctx->feed_buffer.length = 0;
+
+            cmdf__feed_line(ctx, ctx->feed_buffer.buff);
+        }
+
+        ctx->settings_stack.top -= ctx->settings_stack.size;
+        ctx->settings_stack.size = 0;
+    }
+
+    if (!ctx->settings_stack.size) {
+        ctx->feed_buffer.mode = CMDF__FEED_INACTIVE;
+        return CMDF_EXITED;
+    }
+
+    if (executed)
+        cmdf__feed_prompt(ctx);
+
+    return CMDF_OK;
+}
+
+/* Line being edited, while it's moved out of the way of output */
+struct cmdf__edited_line_s {
+    char *text;
+    int point;
+};
+
+/* Move the line being edited in ctx out of the way of output, saving it to line */
+void cmdf__async_begin(struct cmdf__context_s *ctx, struct cmdf__edited_line_s *line) {
+    line->text = NULL;
+    line->point = 0;
+
+    switch (ctx->feed_buffer.mode) {
+        case CMDF__FEED_PLAIN:
+            /* The line being edited belongs to the terminal, so just start a fresh one */
+            cmdf__puts(ctx, "\n");
+            break;
+        #ifdef CMDF_READLINE_SUPPORT
+            case CMDF__FEED_READLINE:
+                /* Save the line being edited and clear it, along with the prompt */
+                line->point = rl_point;
+                line->text = rl_copy_text(0, rl_end);
+                rl_save_prompt();
+                rl_replace_line("", 0);
+                rl_redisplay();
+                break;
+        #endif
+        default:
+            break;
+    }
+}
+
+/* Write out the output printed since cmdf__async_begin(), and redraw the prompt and line */
+void cmdf__async_end(struct cmdf__context_s *ctx, struct cmdf__edited_line_s *line) {
+    cmdf__flush(ctx);
+
+    switch (ctx->feed_buffer.mode) {
+        case CMDF__FEED_PLAIN:
+            cmdf__feed_prompt(ctx);
+            break;
+        #ifdef CMDF_READLINE_SUPPORT
+            case CMDF__FEED_READLINE:
+                rl_restore_prompt();
+                rl_replace_line(line->text ? line->text : "", 0);
+                rl_point = line->point;
+                rl_redisplay();
+                free(line->text);
+                break;
+        #endif
+        default:
+            break;
+    }
+}
+
+/*
+ * Print output that did not come from a command, such as a notification from
+ * elsewhere in the program's event loop, without garbling the prompt. If a line is
+ * being edited, it is moved out of the way and redrawn after the output.
+ * Must be called from the thread feeding the interpreter.
+ */
+void cmdf_print_async(const char *format, ...) {
+    struct cmdf__edited_line_s line;
+    va_list args;
+
+    cmdf__async_begin(cmdf__ctx, &line);
+
+    va_start(args, format);
+    cmdf__vprintf(cmdf__ctx, format, args);
+    va_end(args);
+
+    cmdf__async_end(cmdf__ctx, &line);
+}
+
+#ifdef CMDF_THREAD_SUPPORT
+
+/*
+ * Report background jobs that finished since the last prompt, along with any output
+ * held for this thread, the way cmdf_print_async() prints. Event loops may call it
+ * periodically, so that reports don't wait for the next line of input.
+ * cmdf_feed_readline() calls it before reading. Does nothing if no job finished.
+ * Must be called from the thread feeding the interpreter.
+ */
+void cmdf_feed_jobs(void) {
+    struct cmdf__edited_line_s line;
+    struct cmdf__job_s *job;
+    int finished = 0;
+
+    if (cmdf__ctx->feed_buffer.mode == CMDF__FEED_INACTIVE)
+        return;
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+    for (job = cmdf__ctx->jobs; job < cmdf__ctx->jobs + CMDF_MAX_JOBS && !finished; job++)
+        finished = (job->state == CMDF__JOB_DONE || job->state == CMDF__JOB_KILLED);
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+
+    if (!finished)
+        return;
+
+    cmdf__async_begin(cmdf__ctx, &line);
+    cmdf__jobs_report(cmdf__ctx);
+    cmdf__async_end(cmdf__ctx, &line);
+}
+
+#endif /* CMDF_THREAD_SUPPORT */
+
+/* Get the file descriptor the interpreter reads its input from, to poll it */
+int cmdf_get_input_fd(void) {
+    #ifdef _WIN32
+        return _fileno(CMDF_STDIN);
+    #else
+        return fileno(CMDF_STDIN);
+    #endif
+}
+
+/* Unix domain socket server */
+#ifdef CMDF_SERVER_SUPPORT
+
+/* libcmdf server session. Every connection gets its own interpreter state. */
+struct cmdf__session_s {
+    int fd;                                     /* Connection socket, non-blocking */
+    int epoll_fd;                               /* Of the server, to poll fd with */
+    char *queue;                                /* Output the socket didn't take yet */
+    size_t queued, capacity;
+    int broken;                                 /* Output was lost, so the session must end */
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_t lock;                   /* Background jobs write to the queue, too */
+        cmdf_server *server;                    /* Waiting for it to be freed, once it's detached */
+    #endif
+
+    struct cmdf__context_s ctx;                 /* Session state; writes with cmdf__session_write() */
+};
+
+/* libcmdf server */
+struct cmdf__server_s {
+    int listen_fd, epoll_fd;
+    struct sockaddr_un addr;
+    int bound;                                  /* Set once we own the socket file */
+    struct cmdf__settings_s menu;               /* Top-level menu every session starts from */
+    cmdf_catalog *owned_catalog;                /* Catalog built for the menu, if it had none */
+    struct cmdf__session_s *sessions[CMDF_MAX_SESSIONS];
+
+    #ifdef CMDF_THREAD_SUPPORT
+        int detached;                           /* Ended sessions whose jobs are still running */
+    #endif
+};
+
+/* Bind the server's socket, replacing a stale socket file left by a previous run */
+int cmdf__server_bind(cmdf_server *server) {
+    int probe_fd, retval;
+
+    if (bind(server->listen_fd, (struct sockaddr *)&server->addr, sizeof(server->addr)) == 0)
+        return 0;
+
+    if (errno != EADDRINUSE)
+        return -1;
+
+    /* Only replace the socket file if nobody is listening on it */
+    if ((probe_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    retval = connect(probe_fd, (struct sockaddr *)&server->addr, sizeof(server->addr));
+    close(probe_fd);
+
+    if (retval == 0 || errno != ECONNREFUSED) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    unlink(server->addr.sun_path);
+
+    return bind(server->listen_fd, (struct sockaddr *)&server->addr, sizeof(server->addr));
+}
+
+/*
+ * Serve the interpreter on a Unix domain socket. Every connection gets a session of
+ * its own, starting from the top-level menu of the interpreter that is active now,
+ * and is served by cmdf_server_dispatch(). Unless that menu uses a catalog, which the
+ * sessions share, its commands are copied now, so commands registered to it later
+ * aren't served. SIGPIPE is ignored, unless it is handled already, so a client going
+ * away can't kill the process.
+ * Returns NULL on failure, with errno set.
+ */
+cmdf_server *cmdf_server_open(const char *path) {
+    cmdf_server *server;
+    struct epoll_event event;
+    struct sigaction sigpipe_action;
+    const struct cmdf__entry_s *entry;
+    struct cmdf__entry_s shared;
+    CMDF_RETURN retflag;
+    int i;
+
+    if (strlen(path) >= sizeof(server->addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    server = (cmdf_server *)(CMDF_MALLOC(sizeof(cmdf_server)));
+    if (!server) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(server, 0, sizeof(cmdf_server));
+    server->addr.sun_family = AF_UNIX;
+    strcpy(server->addr.sun_path, path);
+    server->listen_fd = server->epoll_fd = -1;
+
+    /* Sessions share the commands of the top-level menu through a catalog, so
+     * they don't need copies of their own */
+    if (!cmdf__ctx->settings_stack.size) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    server->menu = cmdf__ctx->settings_stack.stack[0];
+    server->menu.exit_flag = 0;
+
+    if (!server->menu.catalog) {
+        if (!(server->owned_catalog = cmdf_catalog_create(0))) {
+            errno = ENOMEM;
+            goto error;
+        }
+
+        for (i = 0; i < server->menu.entry_count; i++) {
+            entry = cmdf__ctx->entries + server->menu.entry_start + i;
+            retflag = cmdf_catalog_register_command(server->owned_catalog, entry->callback,
+                                                    entry->cmdname, entry->help, entry->flags);
+            if (retflag != CMDF_OK) {
+                errno = (retflag == CMDF_ERROR_OUT_OF_MEMORY) ? ENOMEM : ENOSPC;
+                goto error;
+            }
+        }
+
+        cmdf_catalog_freeze(server->owned_catalog);
+        server->menu.entry_start = 0;
+
+        server->menu.catalog = server->owned_catalog;
+
+        /* Sessions are held to the same time limits */
+        for (i = 0; i < cmdf__ctx->settings_stack.stack[0].entry_count; i++) {
+            entry = cmdf__ctx->entries + cmdf__ctx->settings_stack.stack[0].entry_start + i;
+            if (cmdf__find_entry(cmdf__ctx, &server->menu, entry->cmdname, &shared))
+                shared.info->timeout = entry->info->timeout;
+        }
+    }
+
+    /* Create the listening socket and the epoll instance watching it */
+    if ((server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        goto error;
+
+    if (cmdf__server_bind(server) == -1)
+        goto error;
+
+    server->bound = 1;
+    if (listen(server->listen_fd, SOMAXCONN) == -1)
+        goto error;
+
+    if ((server->epoll_fd = epoll_create1(0)) == -1)
+        goto error;
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) == -1)
+        goto error;
+
+    /* Don't let writes to disconnected clients kill us */
+    if (sigaction(SIGPIPE, NULL, &sigpipe_action) == 0 && sigpipe_action.sa_handler == SIG_DFL) {
+        sigpipe_action.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &sigpipe_action, NULL);
+    }
+
+    return server;
+
+error:
+    cmdf_server_close(server);
+    return NULL;
+}
+
+/* Get the server's epoll file descriptor. It becomes readable when there's work to dispatch. */
+int cmdf_server_get_fd(cmdf_server *server) {
+    return server->epoll_fd;
+}
+
+/*
+ * Poll a session for input while it has no output waiting, and otherwise only for its
+ * socket to take more, so a client that doesn't read can't queue up more by typing.
+ * Must be called with the session locked.
+ */
+void cmdf__session_poll(struct cmdf__session_s *session) {
+    struct epoll_event event;
+
+    event.events = session->queued ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = session;
+    epoll_ctl(session->epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+}
+
+/* Give up on a session's output. Shutting its socket down wakes the server up to end it. */
+void cmdf__session_break(struct cmdf__session_s *session) {
+    session->broken = 1;
+    session->queued = 0;
+    shutdown(session->fd, SHUT_RDWR);
+}
+
+/* Write output of a session without blocking. Returns how much the socket took. */
+size_t cmdf__session_send(struct cmdf__session_s *session, const char *buff, size_t len) {
+    size_t total = 0;
+    ssize_t sent;
+
+    while (total < len) {
+        if ((sent = write(session->fd, buff + total, len - total)) > 0)
+            total += (size_t)sent;
+        else if (sent == -1 && errno == EINTR)
+            continue;
+        else {
+            if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+                cmdf__session_break(session);
+            break;
+        }
+    }
+
+    return total;
+}
+
+/* Send the output queued for a session, as far as its socket takes it. Must be called locked. */
+void cmdf__session_flush(struct cmdf__session_s *session) {
+    size_t sent = cmdf__session_send(session, session->queue, session->queued);
+
+    if (session->broken)
+        return;
+
+    memmove(session->queue, session->queue + sent, session->queued - sent);
+    session->queued -= sent;
+
+    if (!session->queued)
+        cmdf__session_poll(session);
+}
+
+/*
+ * I/O backend of sessions. Output goes out right away if the socket takes it, and is queued
+ * otherwise, so a client that stops reading never blocks the server. A client that lets
+ * more than CMDF_MAX_SESSION_OUTPUT pile up is disconnected.
+ */
+size_t cmdf__session_write(void *data, const char *buff, size_t len) {
+    struct cmdf__session_s *session = (struct cmdf__session_s *)data;
+    size_t sent = 0, rest, capacity;
+    char *queue;
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&session->lock);
+    #endif
+
+    /* Output can't jump the queue */
+    if (!session->queued && !session->broken)
+        sent = cmdf__session_send(session, buff, len);
+
+    rest = len - sent;
+
+    /* Make room for the rest */
+    if (rest && !session->broken && session->queued + rest > session->capacity) {
+        for (capacity = session->capacity ? session->capacity : CMDF_OUTPUT_BUFFER_SIZE;
+             capacity < session->queued + rest; capacity *= 2)
+            ;
+
+        if (session->queued + rest > CMDF_MAX_SESSION_OUTPUT ||
+            !(queue = (char *)(CMDF_MALLOC(sizeof(char) * capacity)))) {
+            cmdf__session_break(session);
+        }
+        else {
+            if (session->queue) {
+                memcpy(queue, session->queue, session->queued);
+                CMDF_FREE(session->queue);
+            }
+
+            session->queue = queue;
+            session->capacity = capacity;
+        }
+    }
+
+    if (rest && !session->broken) {
+        memcpy(session->queue + session->queued, buff + sent, rest);
+        session->queued += rest;
+
+        /* The socket is full, so wait for it to take more */
+        if (session->queued == rest)
+            cmdf__session_poll(session);
+    }
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&session->lock);
+    #endif
+
+    /* Output of a broken session is dropped */
+    return len;
+}
+
+/* Accept a new connection and start its session */
+void cmdf__server_accept(cmdf_server *server) {
+    struct cmdf__session_s *session = NULL;
+    struct epoll_event event;
+    int fd, slot;
+
+    if ((fd = accept(server->listen_fd, NULL, NULL)) == -1)
+        return;
+
+    /* Find a free slot, and set up the session */
+    for (slot = 0; slot < CMDF_MAX_SESSIONS && server->sessions[slot]; slot++)
+        ;
+
+    if (slot == CMDF_MAX_SESSIONS ||
+        !(session = (struct cmdf__session_s *)(CMDF_MALLOC(sizeof(struct cmdf__session_s))))) {
+        close(fd);
+        return;
+    }
+
+    memset(session, 0, sizeof(struct cmdf__session_s));
+    session->fd = fd;
+    session->epoll_fd = server->epoll_fd;
+
+    /* Output is written without blocking, through the session's queue */
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1 ||
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        CMDF_FREE(session);
+        return;
+    }
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_init(&session->lock, NULL);
+        session->server = server;
+    #endif
+
+    session->ctx.io.data = session;
+    session->ctx.io.write = cmdf__session_write;
+
+    /* Start from the top-level menu, sharing its catalog */
+    session->ctx.settings_stack.stack[0] = server->menu;
+    session->ctx.settings_stack.top = session->ctx.settings_stack.stack;
+    session->ctx.settings_stack.size = 1;
+
+    server->sessions[slot] = session;
+
+    /* Greet the client */
+    if (session->ctx.settings_stack.top->intro)
+        cmdf__printf(&session->ctx, "\n%s\n\n", session->ctx.settings_stack.top->intro);
+
+    session->ctx.feed_buffer.mode = CMDF__FEED_PLAIN;
+    cmdf__feed_prompt(&session->ctx);
+}
+
+/* Free an ended session. Its caches and whatever is left of its jobs must not outlive it. */
+void cmdf__session_free(struct cmdf__session_s *session) {
+    cmdf__context_release(&session->ctx);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_destroy(&session->lock);
+    #endif
+
+    if (session->queue)
+        CMDF_FREE(session->queue);
+
+    CMDF_FREE(session);
+}
+
+/* Free a detached session after its last job, and let the server know */
+#ifdef CMDF_THREAD_SUPPORT
+void cmdf__session_orphaned(struct cmdf__context_s *ctx) {
+    struct cmdf__session_s *session = (struct cmdf__session_s *)(ctx->io.data);
+    cmdf_server *server = session->server;
+
+    cmdf__session_free(session);
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+    server->detached--;
+    pthread_cond_broadcast(&cmdf__jobs_finished);
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+}
+#endif
+
+/*
+ * End a session, closing its connection. Its background jobs are asked to stop, but
+ * waiting for them would hold up every other session, so a session with jobs still
+ * running is detached instead, and freed by the worker finishing the last one.
+ */
+void cmdf__server_end_session(cmdf_server *server, int slot) {
+    struct cmdf__session_s *session = server->sessions[slot];
+    int detached = 0;
+
+    server->sessions[slot] = NULL;
+
+    /* Its suspended coroutine commands are on this thread, while its jobs may end on another */
+    #ifdef CMDF_COROUTINE_SUPPORT
+        cmdf__coroutines_cancel(&session->ctx);
+    #endif
+
+    cmdf__flush(&session->ctx);
+
+    /* Send what the socket takes of the last output, and drop whatever jobs write after it.
+     * Closing it removes it from the epoll set, too. */
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&session->lock);
+    #endif
+
+    if (!session->broken)
+        cmdf__session_send(session, session->queue, session->queued);
+
+    session->broken = 1;
+    session->queued = 0;
+    close(session->fd);
+
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_unlock(&session->lock);
+
+        pthread_mutex_lock(&cmdf__jobs_lock);
+        detached = cmdf__jobs_detach(&session->ctx, cmdf__session_orphaned);
+        server->detached += detached;
+        pthread_mutex_unlock(&cmdf__jobs_lock);
+    #endif
+
+    if (!detached)
+        cmdf__session_free(session);
+}
+
+/*
+ * Wait up to timeout milliseconds (-1 to wait forever, 0 not to wait at all) for new
+ * connections and client input, and serve them. Every complete line a client sends is
+ * executed in its own session, and the session ends when its last menu exits or the
+ * client disconnects. Returns CMDF_OK, or CMDF_ERROR_SYSTEM if waiting failed.
+ */
+CMDF_RETURN cmdf_server_dispatch(cmdf_server *server, int timeout) {
+    struct epoll_event events[CMDF_MAX_SESSIONS + 1];
+    struct cmdf__session_s *session;
+    char buff[CMDF_MAX_INPUT_BUFFER_LENGTH];
+    int count, i, slot;
+    ssize_t nread;
+    CMDF_RETURN retflag;
+
+    if ((count = epoll_wait(server->epoll_fd, events, CMDF_MAX_SESSIONS + 1, timeout)) == -1)
+        return errno == EINTR ? CMDF_OK : CMDF_ERROR_SYSTEM;
+
+    for (i = 0; i < count; i++) {
+        if (!(session = (struct cmdf__session_s *)(events[i].data.ptr))) {
+            cmdf__server_accept(server);
+            continue;
+        }
+
+        /* Send queued output once the socket takes more. Input waits until it's all sent. */
+        if (events[i].events & EPOLLOUT) {
+            #ifdef CMDF_THREAD_SUPPORT
+                pthread_mutex_lock(&session->lock);
+            #endif
+
+            cmdf__session_flush(session);
+
+            #ifdef CMDF_THREAD_SUPPORT
+                pthread_mutex_unlock(&session->lock);
+            #endif
+        }
+
+        /* Feed whatever arrived to the session. EOF or an error ends it, as does lost output. */
+        retflag = CMDF_OK;
+        if (!session->broken && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            nread = read(session->fd, buff, sizeof(buff));
+            if (nread == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+
+            retflag = cmdf_feed_ctx(&session->ctx, buff, nread > 0 ? (size_t)nread : 0);
+            cmdf__flush(&session->ctx);
+        }
+
+        if (retflag == CMDF_EXITED || session->broken) {
+            for (slot = 0; server->sessions[slot] != session; slot++)
+                ;
+
+            cmdf__server_end_session(server, slot);
+        }
+    }
+
+    return CMDF_OK;
+}
+
+/* Stop serving, ending every session and removing the socket file */
+void cmdf_server_close(cmdf_server *server) {
+    int slot;
+
+    if (!server)
+        return;
+
+    for (slot = 0; slot < CMDF_MAX_SESSIONS; slot++)
+        if (server->sessions[slot])
+            cmdf__server_end_session(server, slot);
+
+    /* Jobs of detached sessions still use the menu */
+    #ifdef CMDF_THREAD_SUPPORT
+        pthread_mutex_lock(&cmdf__jobs_lock);
+        while (server->detached)
+            pthread_cond_wait(&cmdf__jobs_finished, &cmdf__jobs_lock);
+        pthread_mutex_unlock(&cmdf__jobs_lock);
+    #endif
+
+    if (server->epoll_fd != -1)
+        close(server->epoll_fd);
+
+    if (server->listen_fd != -1)
+        close(server->listen_fd);
+
+    if (server->bound)
+        unlink(server->addr.sun_path);
+
+    if (server->owned_catalog)
+        cmdf_catalog_destroy(server->owned_catalog);
+
+    CMDF_FREE(server);
+}
+
+#endif /* CMDF_SERVER_SUPPORT */
+
+/* Utility Functions */
+#ifdef _WIN32
+    struct cmdf_windowsize cmdf_get_window_size_win(void) {
+        CONSOLE_SCREEN_BUFFER_INFO csbi;
+        struct cmdf_windowsize winsize = { 0, 0 };
+
+        /* If this fails, return the zeroed structure as-is */
+        if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi) == 0)
+            return winsize;
+
+        winsize.w = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+        winsize.h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+
+        return winsize;
+    }
+#else
+    struct cmdf_windowsize cmdf_get_window_size_unix(void) {
+        struct cmdf_windowsize cm_winsize;
+        struct winsize ws;
+        int stdin_fd = fileno(CMDF_STDIN);
+
+        memset(&cm_winsize, 0, sizeof(struct cmdf_windowsize));
+
+        /* if this ioctl() fails, return the zeroed struct as-is */
+        if (ioctl(stdin_fd, TIOCGWINSZ, &ws) == -1)
+            return cm_winsize;
+
+        cm_winsize.w = ws.ws_col;
+        cm_winsize.h = ws.ws_row;
+
+        return cm_winsize;
+    }
+
+#endif /* Utility functions */
+
+/*
+ * Terminal size, cached in every context. A SIGWINCH handler counts resizes, and a context
+ * only measures its terminal again after one. Programs handling SIGWINCH themselves, and
+ * systems without it, measure every time instead.
+ */
+#if !defined(_WIN32) && defined(SIGWINCH) && defined(SA_RESTART)
+    #define CMDF__COUNT_RESIZES
+
+    static volatile sig_atomic_t cmdf__resizes = 1;      /* Contexts start at 0, unmeasured */
+    static int cmdf__resizes_counted = 0;                /* Set if the handler was installed */
+
+    #ifdef CMDF_THREAD_SUPPORT
+        static pthread_once_t cmdf__sigwinch_once = PTHREAD_ONCE_INIT;
+    #else
+        static int cmdf__sigwinch_installed = 0;
+    #endif
+
+    void cmdf__sigwinch_handler(int signum) {
+        cmdf__resizes = cmdf__resizes + 1;
+    }
+
+    void cmdf__sigwinch_install(void) {
+        struct sigaction action;
+
+        if (sigaction(SIGWINCH, NULL, &action) == 0 && action.sa_handler == SIG_DFL) {
+            memset(&action, 0, sizeof(struct sigaction));
+            action.sa_handler = cmdf__sigwinch_handler;
+            sigemptyset(&action.sa_mask);
+
+            /* Resizes shouldn't interrupt reading input */
+            action.sa_flags = SA_RESTART;
+            cmdf__resizes_counted = (sigaction(SIGWINCH, &action, NULL) == 0);
+        }
+    }
+#endif
+
+/*
+ * Measure the terminal ctx prints to. Without one, the console's input may still be a
+ * terminal; otherwise, and for I/O backends, $COLUMNS and $LINES are used, or 80x24.
+ */
+struct cmdf_windowsize cmdf__measure_window(struct cmdf__context_s *ctx) {
+    struct cmdf_windowsize winsize;
+    const char *env;
+
+    #ifdef _WIN32
+        memset(&winsize, 0, sizeof(struct cmdf_windowsize));
+        if (!ctx->out && !ctx->io.write)
+            winsize = cmdf_get_window_size_win();
+    #else
+        struct winsize ws;
+
+        memset(&winsize, 0, sizeof(struct cmdf_windowsize));
+        if (!ctx->io.write && (ioctl(fileno(cmdf__output(ctx)), TIOCGWINSZ, &ws) == 0 ||
+            (!ctx->out && ioctl(fileno(CMDF_STDIN), TIOCGWINSZ, &ws) == 0))) {
+            winsize.w = ws.ws_col;
+            winsize.h = ws.ws_row;
+        }
+    #endif
+
+    if (!winsize.w)
+        winsize.w = ((env = getenv("COLUMNS")) && atoi(env) > 0) ? atoi(env) : 80;
+
+    if (!winsize.h)
+        winsize.h = ((env = getenv("LINES")) && atoi(env) > 0) ? atoi(env) : 24;
+
+    return winsize;
+}
+
+/* Get the size of the terminal ctx prints to, measuring it only if it might have changed */
+struct cmdf_windowsize cmdf__window_size(struct cmdf__context_s *ctx) {
+    #ifdef CMDF__COUNT_RESIZES
+        sig_atomic_t resizes;
+
+        #ifdef CMDF_THREAD_SUPPORT
+            pthread_once(&cmdf__sigwinch_once, cmdf__sigwinch_install);
+
+            /* Background jobs leave the context's cache to the thread driving it */
+            if (cmdf__current_job)
+                return cmdf__measure_window(ctx);
+        #else
+            if (!cmdf__sigwinch_installed) {
+                cmdf__sigwinch_installed = 1;
+                cmdf__sigwinch_install();
+            }
+        #endif
+
+        resizes = cmdf__resizes;
+        if (!cmdf__resizes_counted || ctx->winsize_resizes != resizes) {
+            ctx->winsize = cmdf__measure_window(ctx);
+            ctx->winsize_resizes = resizes;
+        }
+
+        return ctx->winsize;
+    #else
+        return cmdf__measure_window(ctx);
+    #endif
+}
+
+/* Built-in line editor */
+#ifdef CMDF_LINEEDIT_SUPPORT
+
+/* Get the line the given number of lines back in history, from 1 for the latest */
+const char *cmdf__history_line(const struct cmdf__history_s *history, int back) {
+    return history->lines[(history->first + history->count - back) % CMDF_HISTORY_SIZE];
+}
+
+/* Add a line to the history ring, which takes ownership of it, dropping the oldest once full */
+void cmdf__history_push(struct cmdf__history_s *history, char *line) {
+    if (history->count == CMDF_HISTORY_SIZE) {
+        CMDF_FREE(history->lines[history->first]);
+        history->lines[history->first] = line;
+        history->first = (history->first + 1) % CMDF_HISTORY_SIZE;
+    }
+    else
+        history->lines[(history->first + history->count++) % CMDF_HISTORY_SIZE] = line;
+}
+
+/*
+ * Add a line to the context's history. An earlier copy of it is moved up to be the latest,
+ * so the ring holds distinct lines; it's looked for linearly, as the ring is small.
+ * If there's a history file, the line is appended to it, unless it repeats the latest one.
+ */
+void cmdf__history_add(cmdf_context *ctx, const char *line) {
+    struct cmdf__history_s *history = &ctx->history;
+    char record[CMDF_MAX_INPUT_BUFFER_LENGTH + 1];
+    size_t len = strlen(line);
+    char *copy = NULL;
+    int back, slot, next;
+
+    for (back = 1; back <= history->count; back++)
+        if (strcmp(cmdf__history_line(history, back), line) == 0)
+            break;
+
+    /* A line repeating the latest one changes nothing, in the ring or in the file */
+    if (back == 1 && history->count)
+        return;
+
+    if (history->persistent && len < CMDF_MAX_INPUT_BUFFER_LENGTH) {
+        memcpy(record, line, len);
+        record[len] = '\n';
+        while (write(history->fd, record, len + 1) == -1 && errno == EINTR)
+            ;
+    }
+
+    /* Take the earlier copy out, closing the gap */
+    if (back <= history->count) {
+
+        slot = (history->first + history->count - back) % CMDF_HISTORY_SIZE;
+        copy = history->lines[slot];
+        for (; back > 1; back--, slot = next) {
+            next = (slot + 1) % CMDF_HISTORY_SIZE;
+            history->lines[slot] = history->lines[next];
+        }
+
+        history->count--;
+    }
 
-const char *cmdf_get_doc_header(void) {
-    return cmdf__settings_stack.top->doc_header;
+    if (copy || (copy = cmdf__strdup(line)))
+        cmdf__history_push(history, copy);
 }
 
-const char *cmdf_get_undoc_header(void) {
-    return cmdf__settings_stack.top->undoc_header;
+/*
+ * Replace a history file, whose descriptor is fd, with the given lines of its map, oldest last.
+ * The lines are written to a new file which is then renamed over it, so the file is never
+ * seen half written. Returns the new file's descriptor, or fd if it couldn't be replaced.
+ */
+int cmdf__history_compact(const char *path, int fd, const char *map, const size_t *starts,
+                          const size_t *lens, int found) {
+    char *tmppath = (char *)(CMDF_MALLOC(strlen(path) + sizeof(".tmp")));
+    int tmpfd = -1, i;
+    ssize_t written;
+
+    if (tmppath) {
+        strcat(strcpy(tmppath, path), ".tmp");
+        tmpfd = open(tmppath, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0600);
+    }
+
+    /* Every line is followed by its newline in the map */
+    for (i = found - 1; tmpfd != -1 && i >= 0; i--) {
+        while ((written = write(tmpfd, map + starts[i], lens[i] + 1)) == -1 && errno == EINTR)
+            ;
+
+        if (written != (ssize_t)(lens[i] + 1)) {
+            close(tmpfd);
+            tmpfd = -1;
+            remove(tmppath);
+        }
+    }
+
+    if (tmpfd != -1 && rename(tmppath, path) == -1) {
+        close(tmpfd);
+        tmpfd = -1;
+        remove(tmppath);
+    }
+
+    CMDF_FREE(tmppath);
+
+    if (tmpfd == -1)
+        return fd;
+
+    close(fd);
+    return tmpfd;
 }
 
-char cmdf_get_ruler(void) {
-    return cmdf__settings_stack.top->ruler;
+/*
+ * Load the latest distinct lines of a history file, and append new lines to it from now on.
+ * The file is mapped rather than read, and scanned from its end, so only as much of it is
+ * touched as the history can hold. Lines are appended with a single write() each, so a file
+ * past CMDF_HISTORY_FILE_SIZE is rewritten here with just the lines loaded, if that
+ * shrinks it by half. Returns CMDF_OK, or CMDF_ERROR_SYSTEM with errno set.
+ */
+CMDF_RETURN cmdf_set_history_file(const char *path) {
+    struct cmdf__history_s *history = &cmdf__ctx->history;
+    size_t starts[CMDF_HISTORY_SIZE], lens[CMDF_HISTORY_SIZE];
+    size_t start, end, len, kept = 0;
+    const char *map = NULL;
+    struct stat st;
+    int fd, found = 0, i;
+    char *line;
+
+    if ((fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600)) == -1)
+        return CMDF_ERROR_SYSTEM;
+
+    if (fstat(fd, &st) == -1 ||
+        (st.st_size && (map = (const char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                                                  fd, 0)) == (const char *)MAP_FAILED)) {
+        close(fd);
+        return CMDF_ERROR_SYSTEM;
+    }
+
+    /* Collect the latest distinct lines, going backwards */
+    for (end = (size_t)st.st_size; end && found < CMDF_HISTORY_SIZE; end = start) {
+        if (map[end - 1] == '\n' && !--end)
+            break;
+
+        for (start = end; start && map[start - 1] != '\n'; start--)
+            ;
+
+        if ((len = end - start) == 0 || len >= CMDF_MAX_INPUT_BUFFER_LENGTH)
+            continue;
+
+        for (i = 0; i < found; i++)
+            if (lens[i] == len && memcmp(map + starts[i], map + start, len) == 0)
+                break;
+
+        if (i == found) {
+            kept += len + 1;
+            starts[found] = start;
+            lens[found++] = len;
+        }
+    }
+
+    /* They replace the current history, oldest first */
+    while (history->count)
+        CMDF_FREE(history->lines[(history->first + --history->count) % CMDF_HISTORY_SIZE]);
+
+    history->first = 0;
+    for (i = found - 1; i >= 0; i--) {
+        if (!(line = (char *)(CMDF_MALLOC(lens[i] + 1))))
+            break;
+
+        memcpy(line, map + starts[i], lens[i]);
+        line[lens[i]] = '\0';
+        cmdf__history_push(history, line);
+    }
+
+    /* Make sure lines appended later start on a line of their own.
+     * A complete file that mostly holds older lines is compacted instead. */
+    if (map) {
+        if ((size_t)st.st_size > CMDF_HISTORY_FILE_SIZE && kept <= (size_t)st.st_size / 2 &&
+            map[st.st_size - 1] == '\n')
+            fd = cmdf__history_compact(path, fd, map, starts, lens, found);
+        else if (map[st.st_size - 1] != '\n')
+            while (write(fd, "\n", 1) == -1 && errno == EINTR)
+                ;
+
+        munmap((void *)map, (size_t)st.st_size);
+    }
+
+    if (history->persistent)
+        close(history->fd);
+
+    history->fd = fd;
+    history->persistent = 1;
+
+    return CMDF_OK;
 }
 
-int cmdf_get_command_count(void) {
-    return cmdf__settings_stack.top->entry_count;
+/* State of a line being edited */
+struct cmdf__lineedit_s {
+    struct cmdf__context_s *ctx;
+    const char *prompt;
+    char *buff;                                 /* Line being edited, always terminated */
+    size_t size, len, pos;                      /* Buffer size, line length and cursor position */
+    int fd;                                     /* Output file descriptor */
+    int history_index;                          /* Lines back in history, or 0 for a new line */
+    char saved[CMDF_MAX_INPUT_BUFFER_LENGTH];   /* The new line, while browsing history */
+    size_t prefix_len;                          /* Length of its start browsing matches */
+    int tabs;                                   /* Consecutive Tab presses */
+    int searching;                              /* Set during a reverse incremental search */
+    char query[64];                             /* Text searched for */
+    char search_prompt[96];                     /* Prompt shown while searching */
+    char *block;                                /* Complete lines pasted or typed ahead, if any */
+    size_t block_len, block_size;
+};
+
+/*
+ * Output of the line editor, collected so a whole screen update takes one write().
+ * Anything that doesn't fit is written out as it fills up.
+ */
+struct cmdf__lineedit_out_s {
+    char buff[CMDF_MAX_INPUT_BUFFER_LENGTH + 256];
+    size_t len;
+    int fd;
+};
+
+void cmdf__lineedit_flush(struct cmdf__lineedit_out_s *out) {
+    size_t written = 0;
+    ssize_t nwritten;
+
+    while (written < out->len) {
+        if ((nwritten = write(out->fd, out->buff + written, out->len - written)) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        written += nwritten;
+    }
+
+    out->len = 0;
 }
 
-/* Setters */
-void cmdf_set_prompt(const char *new_prompt) {
-    cmdf__settings_stack.top->prompt = new_prompt ? new_prompt : cmdf__default_prompt;
+void cmdf__lineedit_append(struct cmdf__lineedit_out_s *out, const char *str, size_t len) {
+    size_t chunk;
+
+    while (len) {
+        if (out->len == sizeof(out->buff))
+            cmdf__lineedit_flush(out);
+
+        chunk = sizeof(out->buff) - out->len;
+        if (chunk > len)
+            chunk = len;
+
+        memcpy(out->buff + out->len, str, chunk);
+        out->len += chunk;
+        str += chunk;
+        len -= chunk;
+    }
 }
 
-void cmdf_set_intro(const char *new_intro) {
-    cmdf__settings_stack.top->intro = new_intro ? new_intro : cmdf__default_intro;
+/* Write a string out right away */
+void cmdf__lineedit_puts(int fd, const char *str) {
+    struct cmdf__lineedit_out_s out;
+
+    out.len = 0;
+    out.fd = fd;
+    cmdf__lineedit_append(&out, str, strlen(str));
+    cmdf__lineedit_flush(&out);
 }
 
-void cmdf_set_doc_header(const char *new_doc_header) {
-    cmdf__settings_stack.top->doc_header = new_doc_header ? new_doc_header : cmdf__default_doc_header;
+/*
+ * Redraw the prompt and the line, on a single terminal row. If they don't fit, the line
+ * is scrolled horizontally to keep the cursor in view.
+ */
+void cmdf__lineedit_refresh(struct cmdf__lineedit_s *edit) {
+    struct cmdf__lineedit_out_s out;
+    const char *prompt = edit->searching ? edit->search_prompt : edit->prompt;
+    size_t plen = strlen(prompt), cols = cmdf__window_size(edit->ctx).w;
+    const char *line = edit->buff;
+    size_t len = edit->len, pos = edit->pos;
+    char seq[32];
+
+    while (plen + pos >= cols && pos) {
+        line++;
+        len--;
+        pos--;
+    }
+
+    while (plen + len > cols && len > pos)
+        len--;
+
+    out.len = 0;
+    out.fd = edit->fd;
+
+    /* Rewrite the row, erase whatever is left of the old one, and put the cursor back */
+    cmdf__lineedit_append(&out, "\r", 1);
+    cmdf__lineedit_append(&out, prompt, plen);
+    cmdf__lineedit_append(&out, line, len);
+    cmdf__lineedit_append(&out, "\x1b[K\r", 4);
+
+    if (plen + pos) {
+        sprintf(seq, "\x1b[%luC", (unsigned long)(plen + pos));
+        cmdf__lineedit_append(&out, seq, strlen(seq));
+    }
+
+    cmdf__lineedit_flush(&out);
 }
 
-void cmdf_set_undoc_header(const char *new_undoc_header) {
-    cmdf__settings_stack.top->undoc_header = new_undoc_header ? new_undoc_header : cmdf__default_undoc_header;
+/* Replace the line being edited, with the cursor at its end */
+void cmdf__lineedit_set(struct cmdf__lineedit_s *edit, const char *line) {
+    strncpy(edit->buff, line, edit->size - 1);
+    edit->buff[edit->size - 1] = '\0';
+    edit->len = edit->pos = strlen(edit->buff);
 }
 
-/* Argument Parsing */
-cmdf_arglist *cmdf_parse_arguments(char *argline) {
-    cmdf_arglist *arglist = NULL;
-    size_t i;
-    char *strptr, *startptr;
-    enum states { NONE, IN_WORD, IN_QUOTES } state = NONE;
+/* Insert text at the cursor, as much as fits */
+void cmdf__lineedit_insert(struct cmdf__lineedit_s *edit, const char *text, size_t len) {
+    if (len > edit->size - 1 - edit->len)
+        len = edit->size - 1 - edit->len;
 
-    /* Check if there are any arguments */
-    if (!argline)
-        return NULL;
+    memmove(edit->buff + edit->pos + len, edit->buff + edit->pos, edit->len - edit->pos + 1);
+    memcpy(edit->buff + edit->pos, text, len);
+    edit->len += len;
+    edit->pos += len;
+}
 
-    /* Allocate argument list */
-    arglist = (cmdf_arglist *)(CMDF_MALLOC(sizeof(cmdf_arglist)));
-    if (!arglist)
-        return NULL;
+/* Delete count characters at the cursor */
+void cmdf__lineedit_delete(struct cmdf__lineedit_s *edit, size_t count) {
+    memmove(edit->buff + edit->pos, edit->buff + edit->pos + count, edit->len - edit->pos - count + 1);
+    edit->len -= count;
+}
 
-    arglist->count = 0;
+/*
+ * Move through history: 1 to an older line, -1 to a newer one. If by_prefix is set when
+ * browsing starts, only lines starting like the text before the cursor are visited.
+ */
+void cmdf__lineedit_history(struct cmdf__lineedit_s *edit, int direction, int by_prefix) {
+    struct cmdf__history_s *history = &edit->ctx->history;
+    int index;
+
+    /* Keep the new line around while browsing */
+    if (edit->history_index == 0) {
+        strcpy(edit->saved, edit->buff);
+        edit->prefix_len = by_prefix ? edit->pos : 0;
+    }
 
-    /* First pass on the arguments line - use the state machine to determine how many
-     * argument do we have. */
-    for (strptr = startptr = argline, i = 0; *strptr; strptr++) {
-        switch (state) {
-            case NONE:
-                /* 
-                 * Space = Don't care.
-                 * Quotes = a quoted argument begins.
-                 * Anything else = Inside a word. 
-                 */
-                if (isspace((int)*strptr))
-                    continue;
-                else if (*strptr == '\"')
-                    state = IN_QUOTES;
-                else
-                    state = IN_WORD;
+    for (index = edit->history_index + direction; index > 0 && index <= history->count; index += direction)
+        if (strncmp(cmdf__history_line(history, index), edit->saved, edit->prefix_len) == 0)
+            break;
+
+    if (index > history->count)
+        return;
+
+    if (index < 0)
+        index = 0;
+
+    edit->history_index = index;
+    cmdf__lineedit_set(edit, index ? cmdf__history_line(history, index) : edit->saved);
+}
+
+/*
+ * Find the latest line containing the search query, starting the given number of lines
+ * back, and show it. The history ring is small enough to be scanned on every keystroke,
+ * so it serves as the index. Returns nonzero if found.
+ */
+int cmdf__lineedit_search(struct cmdf__lineedit_s *edit, int back) {
+    struct cmdf__history_s *history = &edit->ctx->history;
+    const char *match;
+
+    for (; back <= history->count; back++) {
+        if ((match = strstr(cmdf__history_line(history, back), edit->query))) {
+            edit->history_index = back;
+            cmdf__lineedit_set(edit, cmdf__history_line(history, back));
+            edit->pos = match - cmdf__history_line(history, back);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Handle a key during a reverse incremental search (Ctrl-R). Typing refines the search,
+ * Ctrl-R looks further back, and Ctrl-G or Ctrl-C give up. Any other key ends the search,
+ * keeping the line found, and is returned to be handled as usual. Returns 0 otherwise.
+ */
+int cmdf__lineedit_search_key(struct cmdf__lineedit_s *edit, int c) {
+    size_t len = strlen(edit->query);
+    int found = 1;
+
+    switch (c) {
+        case 18: /* Ctrl-R */
+            found = cmdf__lineedit_search(edit, edit->history_index + 1);
+            break;
+        case 7: /* Ctrl-G */
+        case 3: /* Ctrl-C */
+            edit->searching = 0;
+            edit->history_index = 0;
+            cmdf__lineedit_set(edit, edit->saved);
+            return 0;
+        case 127:
+        case 8:
+            if (len)
+                edit->query[len - 1] = '\0';
+            found = cmdf__lineedit_search(edit, 1);
+            break;
+        default:
+            if (c < ' ' || c > '~') {
+                edit->searching = 0;
+                return c;
+            }
+
+            if (len < sizeof(edit->query) - 1) {
+                edit->query[len] = (char)c;
+                edit->query[len + 1] = '\0';
+            }
+
+            found = cmdf__lineedit_search(edit, edit->history_index ? edit->history_index : 1);
+            break;
+    }
+
+    sprintf(edit->search_prompt, "(%sreverse-i-search)`%.63s': ", found ? "" : "failed ",
+            edit->query);
+
+    return 0;
+}
+
+/*
+ * Complete the word before the cursor, of which len characters were typed, with the given
+ * matches. A unique match is completed in full; otherwise, the word is completed up to
+ * where the matches diverge, and a second Tab lists them.
+ */
+void cmdf__lineedit_apply(struct cmdf__lineedit_s *edit, size_t len, const char * const *matches,
+                          size_t count) {
+    struct cmdf__lineedit_out_s out;
+    size_t common, i, j;
 
+    if (!count) {
+        cmdf__lineedit_puts(edit->fd, "\a");
+        return;
+    }
+
+    /* Find how far the matches agree */
+    for (common = strlen(matches[0]), j = 1; j < count; j++)
+        for (i = 0; i < common; i++)
+            if (matches[j][i] != matches[0][i]) {
+                common = i;
                 break;
-            case IN_QUOTES:
-                /*
-                 * Space = Don't care, since we're inside quotes.
-                 * Quotes = Quotes have ended, so count++
-                 * Anything else = Don't care, since we're inside quotes.
-                 */
-                if (isspace((int)*strptr))
-                    continue;
-                else if (*strptr == '\"') {
-                    state = NONE;
-                    arglist->count++;
-                    
-                    break;
-                }
-                else
-                    continue;
-            case IN_WORD:
-                /* 
-                 * Space = A word just terminated, so count++
-                 * Quotes = Ignore - quote is part of the word
-                 * Anything else = Still in word
-                 */
-                if (isspace((int)*strptr)) {
-                    state = NONE;
-                    arglist->count++;
+            }
 
-                    break;
-                }
-                else if (*strptr == '\"')
-                    continue;
-                else
-                    continue;
+    if (common > len) {
+        cmdf__lineedit_insert(edit, matches[0] + len, common - len);
+        if (count == 1)
+            cmdf__lineedit_insert(edit, " ", 1);
+    }
+    else if (edit->tabs > 1) {
+        out.len = 0;
+        out.fd = edit->fd;
+
+        cmdf__lineedit_append(&out, "\n", 1);
+        for (j = 0; j < count; j++) {
+            cmdf__lineedit_append(&out, matches[j], strlen(matches[j]));
+            cmdf__lineedit_append(&out, j + 1 < count ? "  " : "\n", j + 1 < count ? 2 : 1);
         }
+
+        cmdf__lineedit_flush(&out);
     }
+    else
+        cmdf__lineedit_puts(edit->fd, "\a");
+}
 
-    /* Handle last argument counting, if any */
-    if (state != NONE)
-        arglist->count++;
+/*
+ * Complete the word under the cursor: a command name of the current menu if it's the
+ * first one, or an argument if its command has a completer
+ */
+void cmdf__lineedit_complete(struct cmdf__lineedit_s *edit) {
+    const char *names[CMDF_MAX_COMMANDS];
+    const char * const *matches = names;
+    struct cmdf__command_info_s *info;
+    size_t start, first, argindex;
+
+    for (start = edit->pos; start && edit->buff[start - 1] != ' '; start--)
+        ;
+
+    for (first = 0; first < start && edit->buff[first] == ' '; first++)
+        ;
+
+    if (first == start)
+        cmdf__lineedit_apply(edit, edit->pos - start,
+                             names, (size_t)cmdf__match_commands(edit->ctx, edit->ctx->settings_stack.top,
+                                                                 edit->buff + start, edit->pos - start,
+                                                                 names));
+    else if ((info = cmdf__completion_target(edit->ctx, edit->buff, start, &argindex))) {
+        cmdf__lineedit_apply(edit, edit->pos - start, matches,
+                             cmdf__completions_enter(info, argindex, edit->buff + start,
+                                                     edit->pos - start, &matches));
+        cmdf__completions_leave();
+    }
+    else
+        cmdf__lineedit_puts(edit->fd, "\a");
+}
 
-    /* Now we can allocate the argument list */
-    arglist->args = (char **)(CMDF_MALLOC(sizeof(char *) * (arglist->count + 1))); /* + NULL */
-    if (!arglist->args) {
-        CMDF_FREE(arglist);
-        return NULL;
+/* Read a byte of input, or return -1 on EOF or error */
+int cmdf__lineedit_getc(int fd) {
+    unsigned char c;
+    ssize_t nread;
+
+    while ((nread = read(fd, &c, 1)) == -1 && errno == EINTR)
+        ;
+
+    return nread == 1 ? c : -1;
+}
+
+/*
+ * Set the line aside as complete, to be executed along with the rest of a paste, and start
+ * a new one. If there's no memory for it, it's dropped.
+ */
+void cmdf__lineedit_block_add(struct cmdf__lineedit_s *edit) {
+    char *block;
+    size_t size = edit->block_size ? edit->block_size : 4096;
+
+    while (size < edit->block_len + edit->len + 2)
+        size *= 2;
+
+    if (size != edit->block_size && (block = (char *)(CMDF_MALLOC(sizeof(char) * size)))) {
+        if (edit->block_len)
+            memcpy(block, edit->block, edit->block_len);
+
+        CMDF_FREE(edit->block);
+        edit->block = block;
+        edit->block_size = size;
     }
 
-    /* Populate argument list */
-    state = NONE;
-    for (strptr = startptr = argline, i = 0; *strptr; strptr++) {
-        switch (state) {
-            case NONE:
-                /* Space = No word yet.
-                 * Quotes = Quotes started, so ignore everything inbetween.
-                 * Else = Probably a word. */
-                if (isspace((int)*strptr))
-                    continue;
-                else if (*strptr == '\"') {
-                    state = IN_QUOTES;
-                    startptr = strptr + 1;
-                }
-                else {
-                    state = IN_WORD;
-                    startptr = strptr;
-                }
+    if (edit->block_len + edit->len + 2 <= edit->block_size) {
+        memcpy(edit->block + edit->block_len, edit->buff, edit->len);
+        edit->block_len += edit->len;
+        edit->block[edit->block_len++] = '\n';
+        edit->block[edit->block_len] = '\0';
+    }
+
+    edit->buff[edit->len = edit->pos = 0] = '\0';
+}
+
+/*
+ * Take text arriving all at once, starting with c: a bracketed paste until its end sequence,
+ * or input typed ahead until there's no more of it. Line breaks complete lines, and the rest
+ * goes into the line being edited. Control keys and escape sequences are dropped.
+ */
+void cmdf__lineedit_take(struct cmdf__lineedit_s *edit, int fd, int c, int paste) {
+    int param;
+    char key;
+
+    for (; c != -1; c = cmdf__lineedit_getc(fd)) {
+        if (c == '\r' || c == '\n')
+            cmdf__lineedit_block_add(edit);
+        else if (c == 27) {
+            if ((c = cmdf__lineedit_getc(fd)) != '[')
+                continue;
 
+            for (param = 0; (c = cmdf__lineedit_getc(fd)) >= '0' && c <= '9'; )
+                param = param * 10 + (c - '0');
+
+            if (paste && c == '~' && param == 201)
                 break;
-            case IN_QUOTES:
-                /* Space = Ignore it, iterate futher.
-                 * Quotes = End quotes, so put the entire quoted part as an argument.
-                 * Else = Whatever is between the quotes */
-                if (*strptr == '\"') {
-                    *strptr = '\0';
-                    arglist->args[i++] = cmdf__strdup(startptr);
-                    state = NONE;
-                }
+        }
+        else if (c >= ' ' || c == '\t') {
+            key = (c == '\t') ? ' ' : (char)c;
+            cmdf__lineedit_insert(edit, &key, 1);
+        }
+    }
+}
+
+/* Take a bracketed paste, once its start sequence was read, at the cursor */
+void cmdf__lineedit_paste(struct cmdf__lineedit_s *edit, int fd) {
+    char after[CMDF_MAX_INPUT_BUFFER_LENGTH];
+    size_t pos;
+
+    /* Text after the cursor follows the paste */
+    strncpy(after, edit->buff + edit->pos, sizeof(after) - 1);
+    after[sizeof(after) - 1] = '\0';
+    edit->buff[edit->len = edit->pos] = '\0';
+
+    cmdf__lineedit_take(edit, fd, cmdf__lineedit_getc(fd), 1);
+
+    pos = edit->pos;
+    cmdf__lineedit_insert(edit, after, strlen(after));
+    edit->pos = pos;
+}
+
+/*
+ * Once a line is entered, check whether more input is already waiting, as when a terminal
+ * without bracketed paste pastes, and take it along.
+ */
+void cmdf__lineedit_burst(struct cmdf__lineedit_s *edit, int fd) {
+    int flags = fcntl(fd, F_GETFL), c;
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return;
+
+    if ((c = cmdf__lineedit_getc(fd)) != -1) {
+        cmdf__lineedit_block_add(edit);
+        cmdf__lineedit_take(edit, fd, c, 0);
+    }
+
+    fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * Handle an escape sequence, once its ESC was read. Returns nonzero if the line needs
+ * to be redrawn.
+ */
+int cmdf__lineedit_escape(struct cmdf__lineedit_s *edit, int fd) {
+    int c, kind = cmdf__lineedit_getc(fd), param = 0;
+
+    if (kind != '[' && kind != 'O')
+        return 0;
+
+    /* Sequences like "ESC [ 3 ~" carry a number */
+    while ((c = cmdf__lineedit_getc(fd)) >= '0' && c <= '9')
+        param = param * 10 + (c - '0');
+
+    if (c == '~') {
+        if (param == 200)
+            cmdf__lineedit_paste(edit, fd);
+        else if (param == 3 && edit->pos < edit->len)
+            cmdf__lineedit_delete(edit, 1);
+        else if (param == 1 || param == 7)
+            edit->pos = 0;
+        else if (param == 4 || param == 8)
+            edit->pos = edit->len;
+
+        return 1;
+    }
+
+    switch (c) {
+        case 'A':
+            cmdf__lineedit_history(edit, 1, 1);
+            break;
+        case 'B':
+            cmdf__lineedit_history(edit, -1, 1);
+            break;
+        case 'C':
+            if (edit->pos < edit->len)
+                edit->pos++;
+            break;
+        case 'D':
+            if (edit->pos)
+                edit->pos--;
+            break;
+        case 'H':
+            edit->pos = 0;
+            break;
+        case 'F':
+            edit->pos = edit->len;
+            break;
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Edit a line of input from the terminal, in raw mode, with the given prompt.
+ * Supports cursor movement, history and command name completion, with the usual
+ * emacs-style keys. If the input is not a terminal, or ctx has an I/O backend, just reads a line.
+ * Several lines pasted at once are returned in block instead, allocated, with the
+ * unfinished last one left to edit next time. Returns 0, or -1 on EOF.
+ */
+int cmdf__lineedit_read(cmdf_context *ctx, const char *prompt, char *buff, size_t size,
+                        char **block) {
+    struct cmdf__lineedit_s edit;
+    struct cmdf__lineedit_out_s out;
+    struct termios orig, raw;
+    int fd = fileno(CMDF_STDIN), c, done = 0;
+    size_t start;
+    char key;
+
+    *block = NULL;
+    cmdf__flush(ctx);
+
+    if (ctx->io.read_line || ctx->io.write || !isatty(fd) || tcgetattr(fd, &orig) == -1)
+        return cmdf__read_line(ctx, prompt, buff, size) ? 0 : -1;
+
+    /* Take keys one by one, and handle Ctrl-C ourselves */
+    raw = orig;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &raw);
+
+    memset(&edit, 0, sizeof(struct cmdf__lineedit_s));
+    edit.ctx = ctx;
+
+    /* Programs reading JSON output don't need prompting */
+    edit.prompt = (ctx->format == CMDF_OUTPUT_JSON) ? "" : prompt;
+    edit.buff = buff;
+    edit.size = size;
+    edit.fd = fileno(cmdf__output(ctx));
+
+    /* Pick up where the last paste left off */
+    strncpy(buff, ctx->typeahead, size - 1);
+    buff[size - 1] = '\0';
+    edit.len = edit.pos = strlen(buff);
+    ctx->typeahead[0] = '\0';
+
+    /* Have pastes bracketed, so they can be told apart from typing */
+    cmdf__lineedit_puts(edit.fd, "\x1b[?2004h");
+    cmdf__lineedit_refresh(&edit);
+
+    while (!done) {
+        c = cmdf__lineedit_getc(fd);
+        edit.tabs = (c == '\t') ? edit.tabs + 1 : 0;
+
+        /* While searching, keys go to the search first */
+        if (edit.searching && !(c = cmdf__lineedit_search_key(&edit, c))) {
+            cmdf__lineedit_refresh(&edit);
+            continue;
+        }
 
+        switch (c) {
+            case -1:
+                done = -1;
                 break;
-            case IN_WORD:
-                /* Space = End of word, so parse it.
-                 * Quote = Some quote inside of a word. We treat it is a word.
-                 * Else = Still a word. */
-                if (isspace((int)*strptr)) {
-                    *strptr = '\0';
-                    arglist->args[i++] = cmdf__strdup(startptr);
-                    state = NONE;
+            case '\r':
+            case '\n':
+                cmdf__lineedit_burst(&edit, fd);
+                done = 1;
+                break;
+            case 3: /* Ctrl-C: abandon the line */
+                cmdf__lineedit_puts(edit.fd, "^C");
+                edit.len = edit.pos = 0;
+                buff[0] = '\0';
+                done = 1;
+                break;
+            case 4: /* Ctrl-D: EOF on an empty line, delete otherwise */
+                if (!edit.len)
+                    done = -1;
+                else if (edit.pos < edit.len)
+                    cmdf__lineedit_delete(&edit, 1);
+                break;
+            case 127:
+            case 8: /* Backspace, Ctrl-H */
+                if (edit.pos) {
+                    edit.pos--;
+                    cmdf__lineedit_delete(&edit, 1);
                 }
+                break;
+            case '\t':
+                cmdf__lineedit_complete(&edit);
+                break;
+            case 1: /* Ctrl-A */
+                edit.pos = 0;
+                break;
+            case 5: /* Ctrl-E */
+                edit.pos = edit.len;
+                break;
+            case 2: /* Ctrl-B */
+                if (edit.pos)
+                    edit.pos--;
+                break;
+            case 6: /* Ctrl-F */
+                if (edit.pos < edit.len)
+                    edit.pos++;
+                break;
+            case 16: /* Ctrl-P */
+                cmdf__lineedit_history(&edit, 1, 0);
+                break;
+            case 14: /* Ctrl-N */
+                cmdf__lineedit_history(&edit, -1, 0);
+                break;
+            case 18: /* Ctrl-R: start a reverse incremental search */
+                if (edit.history_index == 0)
+                    strcpy(edit.saved, buff);
+                edit.searching = 1;
+                edit.query[0] = '\0';
+                strcpy(edit.search_prompt, "(reverse-i-search)`': ");
+                break;
+            case 11: /* Ctrl-K: delete to the end of the line */
+                buff[edit.len = edit.pos] = '\0';
+                break;
+            case 21: /* Ctrl-U: delete to the start of the line */
+                start = edit.pos;
+                edit.pos = 0;
+                cmdf__lineedit_delete(&edit, start);
+                break;
+            case 23: /* Ctrl-W: delete the previous word */
+                start = edit.pos;
+                while (edit.pos && buff[edit.pos - 1] == ' ')
+                    edit.pos--;
+                while (edit.pos && buff[edit.pos - 1] != ' ')
+                    edit.pos--;
+                cmdf__lineedit_delete(&edit, start - edit.pos);
+                break;
+            case 12: /* Ctrl-L: clear the screen */
+                cmdf__lineedit_puts(edit.fd, "\x1b[H\x1b[2J");
+                break;
+            case 27:
+                cmdf__lineedit_escape(&edit, fd);
 
+                /* A paste with line breaks completes the line */
+                done = (edit.block != NULL);
+                break;
+            default:
+                if (c >= ' ') {
+                    key = (char)c;
+                    cmdf__lineedit_insert(&edit, &key, 1);
+                }
                 break;
         }
+
+        if (!done)
+            cmdf__lineedit_refresh(&edit);
     }
 
-    /* Get the last argument, if any. */
-    if (state != NONE && i < arglist->count)
-        arglist->args[i++] = cmdf__strdup(startptr);
+    if (done != -1 && edit.block) {
+        /* Show the lines about to run once, and keep the rest for the next line */
+        out.len = 0;
+        out.fd = edit.fd;
+        cmdf__lineedit_append(&out, "\r\x1b[K", 4);
+        cmdf__lineedit_append(&out, prompt, strlen(prompt));
+        cmdf__lineedit_append(&out, edit.block, edit.block_len);
+        cmdf__lineedit_append(&out, "\x1b[?2004l", 8);
+        cmdf__lineedit_flush(&out);
+
+        strncpy(ctx->typeahead, buff, sizeof(ctx->typeahead) - 1);
+        buff[0] = '\0';
+        *block = edit.block;
+    }
+    else {
+        CMDF_FREE(edit.block);
+        cmdf__lineedit_puts(edit.fd, "\x1b[?2004l\n");
+    }
 
-    /* Set up null terminator in the argument list */
-    arglist->args[i] = NULL;
+    tcsetattr(fd, TCSANOW, &orig);
 
-    return arglist;
+    return done == -1 ? -1 : 0;
 }
 
-void cmdf_free_arglist(cmdf_arglist *arglist) {
-    size_t i;
+/*
+ * Execute lines pasted at once in one batch, adding them to history, and free them.
+ * The whole paste stops at a command that's interrupted.
+ */
+void cmdf__lineedit_run(cmdf_context *ctx, char *block) {
+    const char **lines;
+    char *line, *end, *next;
+    size_t n = 0;
 
-    /* Check if any argument list was provided. */
-    if (arglist) {
-        /* Free every argument */
-        for (i = 0; i < arglist->count - 1; i++)
-            CMDF_FREE(arglist->args[i]);
+    for (line = block; (line = strchr(line, '\n')); line++)
+        n++;
 
-        CMDF_FREE(arglist->args);
+    if ((lines = (const char **)(CMDF_MALLOC(sizeof(char *) * n)))) {
+        for (n = 0, line = block; (end = strchr(line, '\n')); line = next) {
+            next = end + 1;
+            *end = '\0';
+
+            /* Trim it in place */
+            while (isspace((int)*line))
+                line++;
+            while (end != line && isspace((int)*(end - 1)))
+                *(--end) = '\0';
+
+            if (line[0] != '\0') {
+                cmdf__history_add(ctx, line);
+                lines[n++] = line;
+            }
+        }
+
+        cmdf_exec_batch_ctx(ctx, lines, n, NULL);
+        CMDF_FREE(lines);
     }
 
-    CMDF_FREE(arglist);
+    CMDF_FREE(block);
 }
 
-/* Adding/Removing Command Entries */
-CMDF_RETURN cmdf_register_command(cmdf_command_callback callback, const char *cmdname, 
-                          const char *help) {
-    int new_index;
+#endif /* CMDF_LINEEDIT_SUPPORT */
 
-    /* Increate entry count, first checking if we can add more */
-    if (cmdf__settings_stack.top->entry_count == CMDF_MAX_COMMANDS)
-        return CMDF_ERROR_TOO_MANY_COMMANDS;
+/* readline-related utilities */
+#ifdef CMDF_READLINE_SUPPORT
+
+/* Argument completions being handed over to readline */
+static const char * const *cmdf__readline_completions;
+static size_t cmdf__readline_completion_count;
 
-    /* Initialize new entry */
-    new_index = cmdf__settings_stack.top->entry_start + cmdf__settings_stack.top->entry_count;
-    cmdf__entries[new_index].callback = callback;
-    cmdf__entries[new_index].cmdname = cmdname;
-    cmdf__entries[new_index].help = help;
+char **cmdf__command_name_completion(const char *text, int start, int end) {
+    struct cmdf__command_info_s *info;
+    char **matches = NULL;
+    size_t argindex;
 
-    cmdf__settings_stack.top->entry_count++;
+    if (start == 0)
+        matches = rl_completion_matches(text, cmdf__command_name_iter);
+    else if ((info = cmdf__completion_target(cmdf__ctx, rl_line_buffer, start, &argindex))) {
+        cmdf__readline_completion_count = cmdf__completions_enter(info, argindex, text, strlen(text),
+                                                                  &cmdf__readline_completions);
+        matches = rl_completion_matches(text, cmdf__argument_iter);
+        cmdf__completions_leave();
+
+        /* Don't fall back to completing file names */
+        rl_attempted_completion_over = 1;
+    }
 
-    /* Check doc */
-    if (help)
-        cmdf__settings_stack.top->doc_cmds++;
-    else
-        cmdf__settings_stack.top->undoc_cmds++;
+    return matches;
+}
 
-    return CMDF_OK;
+char *cmdf__argument_iter(const char *text, int state) {
+    static size_t list_index;
+
+    if (!state)
+        list_index = 0;
+
+    if (list_index < cmdf__readline_completion_count)
+        return cmdf__strdup(cmdf__readline_completions[list_index++]);
+
+    return NULL;
 }
 
-/* Default callbacks */
-CMDF_RETURN cmdf__default_do_help(cmdf_arglist *arglist) {
-	int i;
-	size_t offset;
+char *cmdf__command_name_iter(const char *text, int state) {
+    static int list_index;
+    static size_t len;
+    const struct cmdf__settings_s *settings = cmdf__active_menu(cmdf__ctx);
+    const struct cmdf__entry_s *entries;
+    char *match = NULL;
+    int count;
 
-    /* If no arguments provided, print all help listing.
-     * Otherwise, print documentation on specified command. */
-    if (arglist) {
-        if (arglist->count == 1) {
-            for (i = cmdf__settings_stack.top->entry_start; i < cmdf__settings_stack.top->entry_start + cmdf__settings_stack.top->entry_count; i++) {
-                if (strcmp(arglist->args[0], cmdf__entries[i].cmdname) == 0) {
-		            /* Print help, if any */
-		            if (cmdf__entries[i].help) {
-                        offset = fprintf(CMDF_STDOUT, "%s   ", cmdf__entries[i].cmdname);
-                        cmdf__pprint(offset, cmdf__entries[i].help);
-		            }
-		            else
-			            printf("\n(No documentation)\n");
-
-		            return CMDF_OK;
-                }
-            }   
+    if (!state) {
+        list_index = 0;
+        len = strlen(text);
+    }
 
-            /* If we reached this, means that the command was not found */
-            fprintf(CMDF_STDOUT, "Command '%s' was not found.\n", arglist->args[0]);
-	    return CMDF_ERROR_UNKNOWN_COMMAND;
-        }
-        else {
-            fprintf(CMDF_STDOUT, "Too many arguments for the 'help' command!\n");
-            return CMDF_ERROR_TOO_MANY_ARGS;
-        }
+    entries = cmdf__menu_enter(cmdf__ctx, settings, &count, NULL);
+    while (!match && list_index < count) {
+        if (strncmp (entries[list_index].cmdname, text, len) == 0)
+            match = cmdf__strdup(entries[list_index].cmdname);
+
+        list_index++;
     }
-    else
-        cmdf__print_command_list();
 
-    fputc('\n', CMDF_STDOUT);
+    cmdf__menu_leave(settings);
 
-    return CMDF_OK;
+    return match;
 }
 
-CMDF_RETURN cmdf__default_do_emptyline(cmdf_arglist *arglist /* Unusued */) {
-    return CMDF_OK;
-}
+/* Line handler for readline's callback interface */
+void cmdf__readline_line_handler(char *line) {
+    struct cmdf__context_s *ctx = cmdf__readline_ctx;
 
-CMDF_RETURN cmdf__default_do_exit(cmdf_arglist *arglist /* Unused */) {
-    cmdf__settings_stack.top->exit_flag = 1;
+    /* EOF exits the active menu, just like in the blocking loop */
+    if (!line) {
+        cmdf__puts(ctx, "\n");
+        ctx->settings_stack.top->exit_flag = 1;
+        cmdf__feed_pop_exited(ctx);
+    }
+    else {
+        if (line[0] != '\0')
+            add_history(line);
 
-    return CMDF_OK;
+        cmdf__feed_line(ctx, line);
+        free(line);
+    }
+
+    if (!ctx->settings_stack.size) {
+        rl_callback_handler_remove();
+        ctx->feed_buffer.mode = CMDF__FEED_INACTIVE;
+        return;
+    }
+
+    /* Report background jobs that finished, then prompt for the active menu */
+    #ifdef CMDF_THREAD_SUPPORT
+        cmdf__jobs_report(ctx);
+    #endif
+
+    cmdf__flush(ctx);
+    rl_set_prompt(ctx->settings_stack.top->prompt);
 }
 
-CMDF_RETURN cmdf__default_do_noop(cmdf_arglist *arglist /* Unused */) {
-    return CMDF_OK;
+/*
+ * Read input through readline's callback interface, without blocking.
+ * Call this whenever the input file descriptor becomes readable, after cmdf_feed_begin().
+ * Returns CMDF_OK, or CMDF_EXITED once the last menu exited.
+ */
+CMDF_RETURN cmdf_feed_readline(void) {
+    struct cmdf__context_s *ctx = cmdf__readline_ctx, *prev_ctx = cmdf__ctx;
+
+    /* Readline's state is global, so it serves the context that last began feeding */
+    if (ctx && ctx->settings_stack.size) {
+        cmdf__ctx = ctx;
+
+        #ifdef CMDF_THREAD_SUPPORT
+            cmdf_feed_jobs();
+        #endif
+
+        rl_callback_read_char();
+        cmdf__ctx = prev_ctx;
+    }
+
+    return ctx && ctx->settings_stack.size ? CMDF_OK : CMDF_EXITED;
 }
 
-CMDF_RETURN cmdf__default_do_command(const char *cmdname, cmdf_arglist *arglist) {
-    int i;
+#endif /* CMDF_READLINE_SUPPORT */
 
-    /* Iterate through the commands list. Find and execute the appropriate command */
-    for (i = cmdf__settings_stack.top->entry_start; i < cmdf__settings_stack.top->entry_start + cmdf__settings_stack.top->entry_count; i++)
-        if (strcmp(cmdname, cmdf__entries[i].cmdname) == 0)
-            return cmdf__entries[i].callback(arglist);
+#endif /* LIBCMDF_IMPL */
 
-    return CMDF_ERROR_UNKNOWN_COMMAND;
+/* For the C++ support. */
+#ifdef __cplusplus
 }
+#endif
 
-void cmdf__default_commandloop(void) {
-    #ifndef CMDF_READLINE_SUPPORT
-        char inputbuff[CMDF_MAX_INPUT_BUFFER_LENGTH];
-    #else
-        char *inputbuff;
-    #endif
+/*
+ * ======================================================================================
+ * C++20 COROUTINE COMMANDS
+ * Compiled only if coroutine support is enabled
+ * ======================================================================================
+ */
+#if defined(CMDF_COROUTINE_SUPPORT) && !defined(LIBCMDF_COROUTINE_INCLUDE)
+#define LIBCMDF_COROUTINE_INCLUDE
 
-    char *cmdptr, *argsptr, *spcptr;
-    cmdf_arglist *cmd_args;
-    int retflag;
+#include <coroutine>
+#include <chrono>
+#include <exception>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <poll.h>
 
-    /* Print intro, if any. */
-    if (cmdf__settings_stack.top->intro)
-        printf("\n%s\n\n", cmdf__settings_stack.top->intro);
+namespace cmdf {
 
-    while (!cmdf__settings_stack.top->exit_flag) {
-        /* Print prompt and get input */
-        #ifndef CMDF_READLINE_SUPPORT
-            fprintf(CMDF_STDOUT, "%s", cmdf__settings_stack.top->prompt);
-            fgets(inputbuff, sizeof(char) * CMDF_MAX_INPUT_BUFFER_LENGTH, CMDF_STDIN);
+/*
+ * Suspended coroutine commands of the calling thread, waiting for timers or file descriptors.
+ * The thread's event loop polls the descriptors and timeout it reports, then calls run().
+ */
+class scheduler {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    /* Get the calling thread's scheduler */
+    static scheduler &current() {
+        static thread_local scheduler instance;
+        return instance;
+    }
 
-            /* Check for EOF */
-            if (feof(CMDF_STDIN)) {
-                cmdf__settings_stack.top->exit_flag = 1;
-                continue;
-            }
-        #else
-            inputbuff = readline(cmdf__settings_stack.top->prompt);
+    ~scheduler() {
+        for (auto &timer : timers)
+            timer.second.handle.destroy();
 
-            /* EOF, or failure to allocate a buffer. Means we probably need to exit. */
-            if (!inputbuff) {
-                cmdf__settings_stack.top->exit_flag = 1;
-                continue;
+        for (auto &waiter : waiters)
+            waiter.handle.destroy();
+    }
+
+    /* Milliseconds until the next timer expires, 0 if one already did, or -1 if there are none */
+    int timeout() const {
+        if (timers.empty())
+            return -1;
+
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(timers.begin()->first - clock::now());
+        return left.count() > 0 ? static_cast<int>(left.count()) : 0;
+    }
+
+    /* Append a pollfd for every file descriptor a command waits on */
+    void add_pollfds(std::vector<pollfd> &fds) const {
+        for (auto &waiter : waiters)
+            fds.push_back(pollfd{ waiter.fd, waiter.events, 0 });
+    }
+
+    /*
+     * Resume the commands whose file descriptors are ready, according to the revents of
+     * fds, and those whose timers expired. Each one runs in the context it was started from.
+     */
+    void run(const pollfd *fds, size_t count) {
+        std::vector<waiter> ready;
+        size_t i;
+
+        for (auto iter = waiters.begin(); iter != waiters.end(); ) {
+            for (i = 0; i < count; i++)
+                if (fds[i].fd == iter->fd && (fds[i].revents & (iter->events | POLLERR | POLLHUP | POLLNVAL)))
+                    break;
+
+            if (i < count) {
+                ready.push_back(*iter);
+                iter = waiters.erase(iter);
             }
-        #endif
+            else
+                ++iter;
+        }
 
-        /* Trim string */
-        cmdf__trim(inputbuff);
+        for (auto iter = timers.begin(); iter != timers.end() && iter->first <= clock::now(); ) {
+            ready.push_back(iter->second);
+            iter = timers.erase(iter);
+        }
 
-        /* If input is empty, call do_emptyline command. */
-        if (inputbuff[0] == '\0') {
-            cmdf__settings_stack.top->do_emptyline(NULL);
-            continue;
+        /* Resume them only now, as they may start waiting again. What they print is
+         * written out right away, as no dispatch is going to flush it. */
+        for (auto &waiter : ready) {
+            cmdf_context *prev_ctx = cmdf_get_context();
+
+            cmdf_set_context(waiter.ctx);
+            waiter.handle.resume();
+            cmdf__flush(waiter.ctx);
+            cmdf_set_context(prev_ctx);
+        }
+    }
+
+    /* Destroy the suspended commands of a context that's going away */
+    void cancel(cmdf_context *ctx) {
+        for (auto iter = timers.begin(); iter != timers.end(); ) {
+            if (iter->second.ctx == ctx) {
+                iter->second.handle.destroy();
+                iter = timers.erase(iter);
+            }
+            else
+                ++iter;
+        }
+
+        for (auto iter = waiters.begin(); iter != waiters.end(); ) {
+            if (iter->ctx == ctx) {
+                iter->handle.destroy();
+                iter = waiters.erase(iter);
+            }
+            else
+                ++iter;
         }
+    }
+
+    /* Check whether no command is suspended */
+    bool idle() const {
+        return timers.empty() && waiters.empty();
+    }
 
-        /* If we've reached this, then line has something in it.
-         * If readline is enabled, save this to history. */
-         #ifdef CMDF_READLINE_SUPPORT
-            add_history(inputbuff);
-         #endif
+    /* Suspend a command until the given time, or until fd has any of the given poll events */
+    void wait_until(clock::time_point when, std::coroutine_handle<> handle, cmdf_context *ctx) {
+        timers.insert(std::make_pair(when, waiter{ handle, ctx, -1, 0 }));
+    }
+
+    void wait_fd(int fd, short events, std::coroutine_handle<> handle, cmdf_context *ctx) {
+        waiters.push_back(waiter{ handle, ctx, fd, events });
+    }
+
+private:
+    struct waiter {
+        std::coroutine_handle<> handle;
+        cmdf_context *ctx;                      /* Context the command was dispatched from */
+        int fd;
+        short events;
+    };
 
-        /* Split by first space.
-         * This should be the command, followed by arguments. */
-        if ((spcptr = strchr(inputbuff, ' '))) {
-            *spcptr = '\0';
+    std::multimap<clock::time_point, waiter> timers;
+    std::vector<waiter> waiters;
+};
 
-            cmdptr = inputbuff;
-            argsptr = spcptr + 1;
+/*
+ * Return type of coroutine commands, which co_return a CMDF_RETURN code.
+ * A command runs right away when dispatched. If it finishes without suspending, its
+ * return code is passed on. Otherwise, the interpreter goes on as if it returned CMDF_OK,
+ * and the command finishes later, on the dispatching thread's scheduler.
+ */
+class task {
+public:
+    struct promise_type {
+        CMDF_RETURN result = CMDF_OK;
+        cmdf_context *ctx = cmdf_get_context(); /* Context the command was dispatched from */
+        bool detached = false;                  /* Set once the command outlives its dispatch */
+
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
         }
-        else {
-            cmdptr = inputbuff;
-            argsptr = NULL;
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
         }
 
-        /* Parse arguments */
-        cmd_args = cmdf_parse_arguments(argsptr);
+        /* Detached commands clean up after themselves when they finish */
+        auto final_suspend() noexcept {
+            struct awaiter {
+                bool detached;
 
-        /* Execute command. */
-        retflag = cmdf__settings_stack.top->do_command(cmdptr, cmd_args);
-        switch (retflag) {
-            case CMDF_ERROR_UNKNOWN_COMMAND:
-                fprintf(CMDF_STDOUT, "Unknown command '%s'.\n", cmdptr);
-                break;
+                bool await_ready() noexcept { return detached; }
+                void await_suspend(std::coroutine_handle<>) noexcept {}
+                void await_resume() noexcept {}
+            };
+
+            return awaiter{ detached };
         }
 
-        /* Free arguments */
-        cmdf_free_arglist(cmd_args);
+        void return_value(CMDF_RETURN value) {
+            result = value;
+        }
 
-        #ifdef CMDF_READLINE_SUPPORT
-            /* Free buffer */
-            free(inputbuff);
-        #endif
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    task(task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task() {
+        if (handle)
+            handle.destroy();
     }
 
-    /* Pop out settings from settings stack */
-    cmdf__settings_stack.size--;
-    cmdf__settings_stack.top--;
-}
+    /* Get the command's return code if it finished, or detach it and get CMDF_OK */
+    CMDF_RETURN dispatch() {
+        if (handle.done())
+            return handle.promise().result;
 
-/* Utility Functions */
-#ifdef _WIN32
-    struct cmdf_windowsize cmdf_get_window_size_win(void) {
-        CONSOLE_SCREEN_BUFFER_INFO csbi;
-        struct cmdf_windowsize winsize = { 0, 0 };
+        handle.promise().detached = true;
+        handle = {};
 
-        /* If this fails, return the zeroed structure as-is */
-        if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi) == 0)
-            return winsize;
+        return CMDF_OK;
+    }
 
-        winsize.w = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-        winsize.h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
 
-        return winsize;
+    std::coroutine_handle<promise_type> handle;
+};
+
+/* Awaitable suspending a command for some time */
+class sleep_awaiter {
+public:
+    explicit sleep_awaiter(scheduler::clock::duration duration) : duration(duration) {}
+
+    bool await_ready() const noexcept {
+        return duration <= scheduler::clock::duration::zero();
     }
-#else
-    struct cmdf_windowsize cmdf_get_window_size_unix(void) {
-        struct cmdf_windowsize cm_winsize;
-        struct winsize ws;
-        int stdin_fd = fileno(CMDF_STDIN);
 
-        memset(&cm_winsize, 0, sizeof(struct cmdf_windowsize));
+    void await_suspend(std::coroutine_handle<task::promise_type> handle) {
+        scheduler::current().wait_until(scheduler::clock::now() + duration, handle, handle.promise().ctx);
+    }
 
-        /* if this ioctl() fails, return the zeroed struct as-is */
-        if (ioctl(stdin_fd, TIOCGWINSZ, &ws) == -1)
-            return cm_winsize;
+    void await_resume() const noexcept {}
 
-        cm_winsize.w = ws.ws_col;
-        cm_winsize.h = ws.ws_row;
+private:
+    scheduler::clock::duration duration;
+};
 
-        return cm_winsize;
+/* Awaitable suspending a command until a file descriptor is ready */
+class fd_awaiter {
+public:
+    fd_awaiter(int fd, short events) : fd(fd), events(events) {}
+
+    bool await_ready() const noexcept {
+        return false;
     }
 
-#endif /* Utility functions */
+    void await_suspend(std::coroutine_handle<task::promise_type> handle) {
+        scheduler::current().wait_fd(fd, events, handle, handle.promise().ctx);
+    }
 
-/* readline-related utilities */
-#ifdef CMDF_READLINE_SUPPORT
+    void await_resume() const noexcept {}
 
-char **cmdf__command_name_completion(const char *text, int start, int end) {
-    char **matches = NULL;
+private:
+    int fd;
+    short events;
+};
 
-    if (start == 0)
-        matches = rl_completion_matches(text, cmdf__command_name_iter);
+inline sleep_awaiter sleep_for(scheduler::clock::duration duration) {
+    return sleep_awaiter(duration);
+}
 
-    return matches;
+inline fd_awaiter readable(int fd) {
+    return fd_awaiter(fd, POLLIN);
 }
 
-char *cmdf__command_name_iter(const char *text, int state) {
-    static int list_index;
-    static size_t len;
-    const char *name = NULL;
+inline fd_awaiter writable(int fd) {
+    return fd_awaiter(fd, POLLOUT);
+}
 
-    if (!state) {
-        list_index = cmdf__settings_stack.top->entry_start;
-        len = strlen(text);
-    }
+/*
+ * Coroutine command. Arguments are passed by value, since the argument list is gone
+ * by the time a suspended command resumes.
+ */
+typedef task (*command)(std::vector<std::string> args);
 
-    while (name = cmdf__entries[list_index].cmdname) {
-        list_index++;
+/* Command callback running a coroutine command */
+template <command Command>
+CMDF_RETURN callback(cmdf_arglist *arglist) {
+    std::vector<std::string> args;
 
-        if (strncmp (name, text, len) == 0)
-            return (cmdf__strdup(name));
-    }
+    if (arglist)
+        args.assign(arglist->args, arglist->args + arglist->count);
 
-    return ((char*) NULL);
+    return Command(std::move(args)).dispatch();
 }
 
-#endif /* CMDF_READLINE_SUPPORT */
+/* Register a coroutine command in the active menu */
+template <command Command>
+CMDF_RETURN register_command(const char *cmdname, const char *help) {
+    return cmdf_register_command(callback<Command>, cmdname, help);
+}
 
-#endif /* LIBCMDF_IMPL */
+} /* namespace cmdf */
 
-/* For the C++ support. */
-#ifdef __cplusplus
+/* Commands can only be suspended on the thread that dispatched them, so a context
+ * must go away on that thread for them to go with it */
+#ifdef LIBCMDF_IMPL
+void cmdf__coroutines_cancel(cmdf_context *ctx) {
+    cmdf::scheduler::current().cancel(ctx);
 }
 #endif
+
+#endif /* CMDF_COROUTINE_SUPPORT */
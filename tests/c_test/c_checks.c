@@ -0,0 +1,865 @@
+/*
+ * c_checks.c - Non-interactive checks for libcmdf
+ * Public domain; no warrenty applied, use at your own risk!
+ *
+ * License:
+ * --------
+ * This software is dual-licensed to the public domain and under the following license:
+ * you are granted a perpetual, irrevocable license to copy, modify,
+ * publish and distribute this file as you see fit.
+ *
+ * Drives the interpreter through cmdf_exec_batch(), with an I/O backend collecting its
+ * output, and checks the output against what's expected. Also checks some of the library's
+ * internals directly. Prints what failed, and exits with 1 if anything did.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#define CMDF_THREAD_SUPPORT
+#define CMDF_SERVER_SUPPORT
+#define CMDF_APROPOS_SUPPORT
+#define CMDF_LINEEDIT_SUPPORT
+#define LIBCMDF_IMPL
+#include "libcmdf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SOCKET_PATH "/tmp/libcmdf-checks.sock"
+
+static int checks = 0, failures = 0;
+
+/* Output of the context under test, collected by its I/O backend from any thread */
+static char output[65536];
+static size_t output_len = 0;
+static int output_writes = 0;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t collect(void *data, const char *text, size_t len) {
+    size_t room;
+
+    pthread_mutex_lock(&output_lock);
+    room = sizeof(output) - 1 - output_len;
+    memcpy(output + output_len, text, len < room ? len : room);
+    output_len += len < room ? len : room;
+    output[output_len] = '\0';
+    output_writes++;
+    pthread_mutex_unlock(&output_lock);
+
+    return len;
+}
+
+static size_t discard(void *data, const char *text, size_t len) {
+    return len;
+}
+
+static void check(int ok, const char *what) {
+    checks++;
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "FAILED: %s\n", what);
+    }
+}
+
+/* Check the output collected so far, and start collecting anew */
+static void check_output(const char *what, const char *expected) {
+    check(strcmp(output, expected) == 0, what);
+    if (strcmp(output, expected) != 0)
+        fprintf(stderr, "  expected: \"%s\"\n  got:      \"%s\"\n", expected, output);
+
+    output_len = 0;
+    output[0] = '\0';
+}
+
+/* Commands */
+static CMDF_RETURN do_echo(cmdf_arglist *arglist) {
+    size_t i;
+
+    for (i = 0; arglist && i < arglist->count; i++)
+        fprintf(cmdf_get_output(), i ? " %s" : "%s", arglist->args[i]);
+
+    fprintf(cmdf_get_output(), "\n");
+
+    return CMDF_OK;
+}
+
+static CMDF_RETURN do_fail(cmdf_arglist *arglist) {
+    return CMDF_ERROR_ARGUMENT_ERROR;
+}
+
+static CMDF_RETURN do_where_top(cmdf_arglist *arglist) {
+    fprintf(cmdf_get_output(), "top\n");
+    return CMDF_OK;
+}
+
+static CMDF_RETURN do_where_sub(cmdf_arglist *arglist) {
+    fprintf(cmdf_get_output(), "sub\n");
+    return CMDF_OK;
+}
+
+/* Opens a submenu without running its loop, so the lines that follow go to it */
+static CMDF_RETURN do_sub(cmdf_arglist *arglist) {
+    cmdf_init("sub> ", "SUB", NULL, NULL, 0, 1);
+    cmdf_register_command(do_where_sub, "where", NULL);
+    return CMDF_OK;
+}
+
+/* A context with an I/O backend collecting its output, made the calling thread's context */
+static cmdf_context *new_context(void) {
+    struct cmdf_io io;
+    cmdf_context *ctx = cmdf_context_create();
+
+    memset(&io, 0, sizeof(struct cmdf_io));
+    io.write = collect;
+
+    cmdf_set_context(ctx);
+    cmdf_init("> ", "", NULL, NULL, 0, 1);
+    cmdf_set_io(&io);
+    cmdf_register_command(do_echo, "echo", "Print the arguments.");
+    cmdf_register_command(do_fail, "fail", NULL);
+    cmdf_register_command(do_where_top, "where", NULL);
+    cmdf_register_command(do_sub, "sub", NULL);
+
+    return ctx;
+}
+
+static void free_context(cmdf_context *ctx) {
+    cmdf_set_context(NULL);
+    cmdf_context_destroy(ctx);
+    output_len = 0;
+    output[0] = '\0';
+}
+
+/* Batches */
+static void check_batch(void) {
+    cmdf_context *ctx = new_context();
+    const char *lines[] = { "where", "sub", "where", "exit", "where; fail || echo x && echo y", "exit", "echo no" };
+    CMDF_RETURN results[7];
+
+    check(cmdf_exec_batch(lines, 7, results) == 6, "a batch stops once its menu exits");
+    check_output("batch lines go to the menu active when they start",
+                 "top\n\nSUB\n\nsub\ntop\nx\ny\n");
+    check(results[0] == CMDF_OK && results[4] == CMDF_OK, "batch results are kept");
+    check(ctx->settings_stack.size == 1, "submenus exiting within a batch are popped");
+
+    free_context(ctx);
+}
+
+/* Feeding input from an event loop */
+static CMDF_RETURN feed(const char *input) {
+    return cmdf_feed(input, strlen(input));
+}
+
+/* The prompt is printed once all the lines fed at once ran */
+static void check_feed(void) {
+    cmdf_context *ctx = new_context();
+
+    cmdf_feed_begin();
+    check_output("feeding starts with the prompt", "\n\n\n> ");
+
+    feed("ec");
+    feed("ho hi\nech");
+    feed("o there\n");
+    check_output("fed lines run once complete", "hi\n> there\n> ");
+
+    feed("sub\nwhere\nexit\nwhere\n");
+    check_output("fed lines go to submenus", "\nSUB\n\nsub\ntop\n> ");
+
+    check(feed("exit\n") == CMDF_EXITED, "feeding ends once the last menu exits");
+
+    free_context(ctx);
+}
+
+/* Buffered output */
+static void check_buffering(void) {
+    cmdf_context *ctx = new_context();
+    const char *lines[] = { "help", "help echo" };
+
+    output_writes = 0;
+    cmdf_exec_batch(lines, 1, NULL);
+    check(output_writes == 1 && output_len > 80, "a help screen is written at once");
+
+    output_writes = 0;
+    cmdf_exec_batch(lines + 1, 1, NULL);
+    check(output_writes == 1, "help for a command is written at once");
+
+    free_context(ctx);
+}
+
+/* Terminal size */
+static void check_window_size(void) {
+    cmdf_context *ctx = new_context();
+
+    check(cmdf__window_size(ctx).w == 80, "without a terminal, $COLUMNS is used");
+
+    /* It's only measured again once the terminal is resized */
+    setenv("COLUMNS", "100", 1);
+    check(cmdf__window_size(ctx).w == 80, "the terminal size is cached");
+    raise(SIGWINCH);
+    check(cmdf__window_size(ctx).w == 100, "the terminal size is measured again once resized");
+
+    setenv("COLUMNS", "80", 1);
+    raise(SIGWINCH);
+    free_context(ctx);
+}
+
+/* Wrapped help */
+#define LONG_HELP "Help text long enough to be wrapped, over several lines of a narrow terminal, " \
+                  "but which fits on one line of a wide one."
+
+/* Check that no line of the output collected so far is wider than width */
+static int output_fits(size_t width) {
+    const char *line = output;
+    size_t len;
+
+    for (;;) {
+        if ((len = strcspn(line, "\n")) > width)
+            return 0;
+
+        if (!line[len])
+            return 1;
+
+        line += len + 1;
+    }
+}
+
+static void check_help_wrapping(void) {
+    cmdf_context *ctx = new_context();
+    const char *lines[] = { "help long" };
+    struct cmdf__entry_s entry;
+    char first[256];
+    const char *wrapped;
+
+    cmdf_register_command(do_echo, "long", LONG_HELP);
+    cmdf__find_entry(ctx, ctx->settings_stack.top, "long", &entry);
+
+    /* The layout is kept for as long as the width stays the same */
+    cmdf_exec_batch(lines, 1, NULL);
+    strcpy(first, output);
+    wrapped = entry.info->wrapped;
+    check(wrapped && entry.info->wrapped_width == 80, "help is wrapped to the terminal width");
+
+    output_len = 0;
+    cmdf_exec_batch(lines, 1, NULL);
+    check(entry.info->wrapped == wrapped && strcmp(output, first) == 0, "wrapped help is reused");
+
+    /* It's wrapped again once the terminal is resized */
+    setenv("COLUMNS", "40", 1);
+    raise(SIGWINCH);
+    output_len = 0;
+    cmdf_exec_batch(lines, 1, NULL);
+    check(entry.info->wrapped_width == 40 && output_fits(40), "help is wrapped again for a new width");
+
+    setenv("COLUMNS", "80", 1);
+    raise(SIGWINCH);
+    free_context(ctx);
+}
+
+/* Help listing */
+static void check_listing(void) {
+    cmdf_context *ctx = new_context();
+    const char *names[] = { "apple", "banana", "cherry", "date", "elderberry", "fig", "grape" };
+    const char *lines[] = { "help" };
+    char dest[7 * (10 + 3)];
+    const char *text;
+
+    /* Names fill columns first, in as few rows as fit */
+    dest[cmdf__columnize(names, 7, 30, dest)] = '\0';
+    check(strcmp(dest, "apple   date        grape\nbanana  elderberry\ncherry  fig\n") == 0,
+          "names are laid out in columns");
+    dest[cmdf__columnize(names, 7, 20, dest)] = '\0';
+    check(strcmp(dest, "apple   elderberry\nbanana  fig\ncherry  grape\ndate\n") == 0,
+          "narrower widths take more rows");
+
+    /* The listing is laid out once, until the menu's commands change */
+    cmdf_exec_batch(lines, 1, NULL);
+    text = ctx->listings[0].text;
+    check(text && strstr(output, "  echo"), "the listing holds the menu's commands");
+
+    output_len = 0;
+    cmdf_exec_batch(lines, 1, NULL);
+    check(ctx->listings[0].text == text, "the listing is reused");
+
+    cmdf_register_command(do_echo, "zebra", "Print the arguments.");
+    output_len = 0;
+    cmdf_exec_batch(lines, 1, NULL);
+    check(strstr(output, "zebra") != NULL, "the listing is laid out again once commands are added");
+
+    free_context(ctx);
+}
+
+/* Command name patterns */
+static void check_glob(void) {
+    static const struct {
+        const char *pattern, *name;
+        int match;
+    } cases[] = {
+        { "*", "help", 1 },         { "", "", 1 },              { "", "a", 0 },
+        { "h*", "help", 1 },        { "*p", "help", 1 },        { "*l*", "help", 1 },
+        { "h?lp", "help", 1 },      { "h?p", "help", 0 },       { "h*x", "help", 0 },
+        { "[a-h]elp", "help", 1 },  { "[!h]elp", "help", 0 },   { "[^a-g]elp", "help", 1 },
+        { "[]x]", "]", 1 },         { "[]x]", "x", 1 },         { "[]x]", "y", 0 },
+        { "\\*", "*", 1 },          { "\\*", "a", 0 },          { "[", "[", 1 },
+        { "a*b*c", "aXbYc", 1 },    { "a*b*c", "aXbY", 0 },     { "**", "", 1 },
+        { "*a*a", "aaa", 1 },       { "*ab", "aab", 1 },        { "[a-]", "-", 1 }
+    };
+    char what[128];
+    size_t i;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        sprintf(what, "'%s' %s '%s'", cases[i].pattern, cases[i].match ? "matches" : "doesn't match",
+                cases[i].name);
+        check(cmdf__glob_match(cases[i].pattern, cases[i].name) == cases[i].match, what);
+    }
+}
+
+/* Help search */
+static void check_apropos(void) {
+    cmdf_context *ctx = new_context();
+    const char *lines[] = { "apropos disk", "apropos disk tape", "apropos nothing" };
+    char *disk, *format, *backup;
+
+    cmdf_register_command(do_echo, "backup", "Copy the disk to tape.");
+    cmdf_register_command(do_echo, "disk", "Show disk usage.");
+    cmdf_register_command(do_echo, "format", "Erase a disk, and everything on the disk.");
+
+    cmdf_exec_batch(lines, 1, NULL);
+    disk = strstr(output, "disk  ");
+    format = strstr(output, "format");
+    backup = strstr(output, "backup");
+    check(disk && format && backup && disk < format && format < backup,
+          "apropos ranks names, then repeated words, first");
+    check(strstr(output, "echo") == NULL, "apropos leaves out commands without the keyword");
+    output_len = 0;
+
+    cmdf_exec_batch(lines + 1, 1, NULL);
+    check(strncmp(output, "backup", 6) == 0, "apropos ranks commands matching more keywords first");
+    output_len = 0;
+
+    cmdf_exec_batch(lines + 2, 1, NULL);
+    check_output("apropos reports when nothing matches", "Nothing appropriate.\n");
+
+    free_context(ctx);
+}
+
+/* Suggestions for unknown commands */
+/* Optimal string alignment distance, working out the whole matrix */
+static size_t full_distance(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t d[9][9], i, j, best;
+
+    for (i = 0; i <= alen; i++)
+        d[i][0] = i;
+    for (j = 0; j <= blen; j++)
+        d[0][j] = j;
+
+    for (i = 1; i <= alen; i++) {
+        for (j = 1; j <= blen; j++) {
+            best = d[i - 1][j - 1] + (a[i - 1] != b[j - 1]);
+            if (d[i - 1][j] + 1 < best)
+                best = d[i - 1][j] + 1;
+            if (d[i][j - 1] + 1 < best)
+                best = d[i][j - 1] + 1;
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && d[i - 2][j - 2] + 1 < best)
+                best = d[i - 2][j - 2] + 1;
+
+            d[i][j] = best;
+        }
+    }
+
+    return d[alen][blen];
+}
+
+static void check_edit_distance(void) {
+    unsigned long seed = 1;
+    char a[9], b[9], what[128];
+    size_t alen, blen, bound, full, expected, got, i;
+    int round, mismatches = 0;
+
+    /* Random names over a small alphabet, so that swaps and repeats are frequent */
+    for (round = 0; round < 50000; round++) {
+        seed = seed * 1103515245 + 12345;
+        alen = (seed >> 8) % 9;
+        blen = (seed >> 12) % 9;
+        bound = (seed >> 16) % 5;
+
+        for (i = 0; i < alen; i++) {
+            seed = seed * 1103515245 + 12345;
+            a[i] = "abc"[(seed >> 16) % 3];
+        }
+
+        for (i = 0; i < blen; i++) {
+            seed = seed * 1103515245 + 12345;
+            b[i] = "abc"[(seed >> 16) % 3];
+        }
+
+        full = full_distance(a, alen, b, blen);
+        expected = full <= bound ? full : bound + 1;
+        got = cmdf__edit_distance(a, alen, b, blen, bound);
+
+        if (got != expected && mismatches++ < 5) {
+            a[alen] = b[blen] = '\0';
+            sprintf(what, "edit distance of '%s' and '%s' within %lu is %lu, not %lu", a, b,
+                    (unsigned long)bound, (unsigned long)expected, (unsigned long)got);
+            check(0, what);
+        }
+    }
+
+    check(mismatches == 0, "banded edit distance agrees with the full matrix");
+    check(cmdf__edit_distance("exti", 4, "exit", 4, 1) == 1, "a swap is one edit");
+}
+
+static void check_suggestions(void) {
+    cmdf_context *ctx = new_context();
+    const char *lines[] = { "ehco hi", "wehre" };
+
+    cmdf_exec_batch(lines, 2, NULL);
+    check_output("unknown commands get suggestions",
+                 "Unknown command 'ehco'.\nDid you mean 'echo'?\n"
+                 "Unknown command 'wehre'.\nDid you mean 'where'?\n");
+
+    free_context(ctx);
+}
+
+/* JSON output */
+static void check_json(void) {
+    cmdf_context *ctx = new_context();
+    const char *lines[] = { "echo \"a\\\"b\"", "nope", "fail" };
+
+    check(cmdf_set_output_format(CMDF_OUTPUT_JSON) == CMDF_OK, "JSON output can be turned on");
+
+    cmdf__json_string(ctx, "q\"b\\s\nt\tc\037");
+    cmdf__emit(ctx, " ", 1);
+    cmdf__json_string(ctx, NULL);
+    cmdf__flush(ctx);
+    check_output("JSON strings are escaped", "\"q\\\"b\\\\s\\nt\\tc\\u001f\" null");
+
+    cmdf_exec_batch(lines, 3, NULL);
+    check(strstr(output, "\"type\":\"result\"") && strstr(output, "\"command\":\"nope\"") &&
+          strstr(output, "\"error\":\"unknown_command\"") && strstr(output, "\"command\":\"fail\""),
+          "every command gets a result record");
+    check(strstr(output, "Unknown command") == NULL, "JSON output has no plain text errors");
+    check(strchr(output, '\n') && output[output_len - 1] == '\n', "JSON records are one per line");
+
+    free_context(ctx);
+}
+
+/* Background jobs */
+static int holding = 0, released = 0, job_saw_own = 0, job_saw_other = 0;
+
+/* Waits until released, then looks for its own command and the one that took its slot */
+static CMDF_RETURN do_hold(cmdf_arglist *arglist) {
+    struct cmdf_command_stats stats;
+
+    __atomic_store_n(&holding, 1, __ATOMIC_RELEASE);
+
+    while (!__atomic_load_n(&released, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    job_saw_own = (cmdf_get_command_stats("hold", &stats) == CMDF_OK);
+    job_saw_other = (cmdf_get_command_stats("other", &stats) == CMDF_OK);
+
+    return CMDF_OK;
+}
+
+static CMDF_RETURN do_release(cmdf_arglist *arglist) {
+    __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+    return CMDF_OK;
+}
+
+static CMDF_RETURN do_hold_menu(cmdf_arglist *arglist) {
+    cmdf_init("hold> ", NULL, NULL, NULL, 0, 1);
+    cmdf_register_command(do_hold, "hold", "Wait until released.");
+    return CMDF_OK;
+}
+
+/* Its first command takes the slot of 'hold' */
+static CMDF_RETURN do_other_menu(cmdf_arglist *arglist) {
+    cmdf_init("other> ", NULL, NULL, NULL, 0, 1);
+    cmdf_register_command(do_echo, "other", "Print the arguments, with long help that gets wrapped.");
+    cmdf_register_command(do_release, "release", NULL);
+    return CMDF_OK;
+}
+
+static void check_jobs(void) {
+    cmdf_context *ctx = new_context();
+    const char *lines[] = { "holdmenu", "hold &", "exit", "othermenu", "release", "wait" };
+    const char *top[] = { "echo x &", "wait" };
+    const char *refused[] = { "jobs &", "kill 1 &" };
+    struct cmdf_command_stats stats;
+
+    cmdf_register_command(do_hold_menu, "holdmenu", NULL);
+    cmdf_register_command(do_other_menu, "othermenu", NULL);
+
+    /* A job outlives its submenu, whose command slots are taken over in the meantime */
+    cmdf_exec_batch(lines, 6, NULL);
+    check(job_saw_own && !job_saw_other, "jobs keep the commands of the menu they started from");
+    check(cmdf_get_command_stats("other", &stats) == CMDF_OK && stats.calls == 0,
+          "jobs don't count their runs for commands that took over their slot");
+
+    /* Jobs of a menu that's still there count their runs */
+    cmdf_set_context(NULL);
+    cmdf_context_destroy(ctx);
+    ctx = new_context();
+    output_len = 0;
+    cmdf_exec_batch(top, 2, NULL);
+    check(cmdf_get_command_stats("echo", &stats) == CMDF_OK && stats.calls == 1,
+          "jobs count their runs for their command");
+    check_output("jobs are announced before their output", "[1] echo x\nx\n[1] Done       echo x\n");
+
+    /* Commands managing jobs stay in the foreground */
+    cmdf_exec_batch(refused, 2, NULL);
+    check_output("commands managing jobs can't be run in the background",
+                 "Unable to run 'jobs' in the background.\nUnable to run 'kill' in the background.\n");
+
+    free_context(ctx);
+}
+
+/* Server sessions */
+static void check_server(void) {
+    cmdf_context *ctx = new_context();
+    struct sockaddr_un addr;
+    cmdf_server *server;
+    int fd, detached;
+
+    holding = released = 0;
+    cmdf_register_command(do_hold, "hold", NULL);
+    server = cmdf_server_open(SOCKET_PATH);
+    check(server != NULL, "the server opens");
+    if (!server) {
+        free_context(ctx);
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET_PATH);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    cmdf_server_dispatch(server, 1000);
+
+    /* The client goes away while its job runs */
+    write(fd, "hold &\n", 7);
+    cmdf_server_dispatch(server, 1000);
+    while (!__atomic_load_n(&holding, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    close(fd);
+    cmdf_server_dispatch(server, 1000);
+
+    pthread_mutex_lock(&cmdf__jobs_lock);
+    detached = server->detached;
+    pthread_mutex_unlock(&cmdf__jobs_lock);
+    check(!server->sessions[0] && detached == 1, "sessions end without waiting for their jobs");
+
+    /* Closing the server waits for the job, which frees the session */
+    __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+    cmdf_server_close(server);
+    free_context(ctx);
+}
+
+/* Argument completion */
+static int completer_runs = 0;
+
+static void complete_colors(cmdf_completions *completions, size_t argindex) {
+    completer_runs++;
+    cmdf_add_completion(completions, "red");
+    cmdf_add_completion(completions, "green");
+    cmdf_add_completion(completions, "grey");
+}
+
+static void complete_sizes(cmdf_completions *completions, size_t argindex) {
+    cmdf_add_completion(completions, "small");
+    cmdf_add_completion(completions, "large");
+}
+
+/* Complete the word at the end of line, and give back the first match, or NULL */
+static const char *complete(cmdf_context *ctx, const char *line, size_t *count) {
+    struct cmdf__command_info_s *info;
+    const char *const *matches, *first = NULL;
+    size_t start = strrchr(line, ' ') - line + 1, argindex;
+
+    *count = 0;
+    if (!(info = cmdf__completion_target(ctx, line, start, &argindex)))
+        return NULL;
+
+    if ((*count = cmdf__completions_enter(info, argindex, line + start, strlen(line + start), &matches)))
+        first = matches[0];
+
+    cmdf__completions_leave();
+
+    return first;
+}
+
+static CMDF_RETURN do_colors_menu(cmdf_arglist *arglist) {
+    cmdf_init("colors> ", NULL, NULL, NULL, 0, 1);
+    cmdf_register_command(do_echo, "paint", NULL);
+    cmdf_set_command_completer("paint", complete_colors, 0);
+    return CMDF_OK;
+}
+
+/* Its first command takes the slot of 'paint' */
+static CMDF_RETURN do_sizes_menu(cmdf_arglist *arglist) {
+    cmdf_init("sizes> ", NULL, NULL, NULL, 0, 1);
+    cmdf_register_command(do_echo, "cut", NULL);
+    cmdf_set_command_completer("cut", complete_sizes, 0);
+    return CMDF_OK;
+}
+
+static void check_completion(void) {
+    cmdf_context *ctx = new_context();
+    const char *first;
+    size_t count;
+
+    /* Fed input pops the submenus that exit, so another can take their place */
+    cmdf_register_command(do_colors_menu, "colors", NULL);
+    cmdf_register_command(do_sizes_menu, "sizes", NULL);
+    cmdf_feed_begin();
+    cmdf_feed("colors\n", 7);
+
+    first = complete(ctx, "paint gr", &count);
+    check(count == 2 && strcmp(first, "green") == 0, "arguments complete to the candidates they start");
+    complete(ctx, "paint r", &count);
+    check(count == 1 && completer_runs == 1, "completions are cached");
+
+    cmdf_invalidate_completions("paint");
+    complete(ctx, "paint ", &count);
+    check(count == 3 && completer_runs == 2, "invalidated completions are asked for again");
+
+    /* A command taking over the slot of another doesn't inherit its completions */
+    cmdf_feed("exit\nsizes\n", 11);
+    first = complete(ctx, "cut ", &count);
+    check(count == 2 && strcmp(first, "large") == 0, "completions go with the command they're for");
+
+    free_context(ctx);
+}
+
+/* Pasting into the line editor */
+/* Write input for the line editor to a pipe, and give back its reading end */
+static int input_pipe(const char *input, int *write_fd) {
+    int fds[2];
+
+    if (pipe(fds) == -1)
+        return -1;
+
+    if (write(fds[1], input, strlen(input)) != (ssize_t)strlen(input))
+        return -1;
+
+    *write_fd = fds[1];
+    return fds[0];
+}
+
+static void check_paste(void) {
+    cmdf_context *ctx = new_context();
+    struct cmdf__lineedit_s edit;
+    char buff[CMDF_MAX_INPUT_BUFFER_LENGTH];
+    int fd, write_fd;
+
+    memset(&edit, 0, sizeof(struct cmdf__lineedit_s));
+    edit.ctx = ctx;
+    edit.buff = buff;
+    edit.size = sizeof(buff);
+
+    /* A bracketed paste in the middle of a line: "x|y" */
+    strcpy(buff, "xy");
+    edit.len = 2;
+    edit.pos = 1;
+    fd = input_pipe("echo 1\n  echo\001 2  \n\x1b[Aecho 3\x1b[201~", &write_fd);
+    cmdf__lineedit_paste(&edit, fd);
+    check(edit.block && strcmp(edit.block, "xecho 1\n  echo 2  \n") == 0,
+          "pasted lines are split at line breaks, without control keys");
+    check(strcmp(buff, "echo 3y") == 0 && edit.pos == 6, "the last pasted line is left to edit");
+    close(fd);
+    close(write_fd);
+
+    /* Input typed ahead of a line that was just entered */
+    CMDF_FREE(edit.block);
+    edit.block = NULL;
+    edit.block_len = edit.block_size = 0;
+    strcpy(buff, "echo 1");
+    edit.len = edit.pos = 6;
+    fd = input_pipe("echo 2\r\necho 3\n\necho 4", &write_fd);
+    cmdf__lineedit_burst(&edit, fd);
+    check(edit.block && strcmp(edit.block, "echo 1\necho 2\n\necho 3\n\n") == 0,
+          "input typed ahead is split at line breaks");
+    check(strcmp(buff, "echo 4") == 0, "the unfinished typed ahead line is left to edit");
+    close(fd);
+    close(write_fd);
+
+    cmdf__lineedit_run(ctx, edit.block);
+    check_output("pasted lines run as one batch", "1\n2\n3\n");
+    check(ctx->history.count == 3, "pasted lines are added to history");
+
+    free_context(ctx);
+}
+
+/* Catalog commands */
+static int catalog_retired(const cmdf_catalog *catalog) {
+    const struct cmdf__catalog_table_s *table;
+    int count = 0;
+
+    for (table = catalog->retired; table; table = table->next)
+        count++;
+
+    return count;
+}
+
+static void check_reclamation(void) {
+    cmdf_catalog *catalog = cmdf_catalog_create(1);
+    const struct cmdf__catalog_table_s *table;
+    cmdf_context *ctx = new_context();
+    const char *lines[] = { "where", "hello" };
+
+    cmdf_catalog_register_command(catalog, do_where_top, "where", NULL, 0);
+    cmdf_catalog_freeze(catalog);
+    cmdf_init_catalog(ctx, catalog, "catalog> ", NULL, NULL, NULL, 0);
+
+    /* A version being read survives its replacement */
+    table = cmdf__catalog_enter(catalog);
+    check(cmdf_catalog_register_command(catalog, do_echo, "hello", NULL, 0) == CMDF_OK,
+          "a frozen catalog takes new commands");
+    check(catalog_retired(catalog) == 1, "a version being read is kept once replaced");
+    check(table != catalog->table && table->entry_count + 1 == catalog->table->entry_count,
+          "a reader keeps seeing the version it entered");
+    cmdf__catalog_leave(catalog);
+
+    /* A reader entering after a change can't be using the version it replaced */
+    cmdf__catalog_enter(catalog);
+    cmdf_catalog_register_command(catalog, do_echo, "hi", NULL, 0);
+    check(catalog_retired(catalog) == 1, "versions replaced before a reader entered are freed");
+    cmdf__catalog_leave(catalog);
+
+    /* Once nobody reads them, replaced versions are freed by the next change */
+    cmdf_catalog_register_command(catalog, do_echo, "bye", NULL, 0);
+    check(catalog_retired(catalog) == 0, "versions nobody reads are freed");
+
+    cmdf_exec_batch(lines, 2, NULL);
+    check_output("commands added to a catalog can be run", "top\n\n");
+
+    free_context(ctx);
+    cmdf_catalog_destroy(catalog);
+}
+
+#define DISPATCHERS 4
+#define ADDED_COMMANDS 12
+
+/* A thread dispatching catalog commands with a context of its own */
+struct dispatcher {
+    pthread_t thread;
+    cmdf_catalog *catalog;
+    int *started, *registered;
+    int errors, found;
+};
+
+static void *dispatch(void *arg) {
+    struct dispatcher *dispatcher = (struct dispatcher *)arg;
+    const char *where[] = { "where" }, *added[] = { "c11" };
+    cmdf_context *ctx = cmdf_context_create();
+    CMDF_RETURN result;
+    struct cmdf_io io;
+    int done, started = 0;
+
+    memset(&io, 0, sizeof(struct cmdf_io));
+    io.write = discard;
+    cmdf_set_context(ctx);
+    cmdf_set_io(&io);
+    cmdf_init_catalog(ctx, dispatcher->catalog, "> ", NULL, NULL, NULL, 0);
+
+    /* Commands registered earlier keep dispatching while new ones are added */
+    do {
+        done = __atomic_load_n(dispatcher->registered, __ATOMIC_ACQUIRE);
+        cmdf_exec_batch(where, 1, &result);
+        if (result != CMDF_OK)
+            dispatcher->errors++;
+
+        if (!started++)
+            __atomic_add_fetch(dispatcher->started, 1, __ATOMIC_RELEASE);
+    } while (!done);
+
+    /* Once they are all there, they are found too */
+    cmdf_exec_batch(added, 1, &result);
+    dispatcher->found = (result == CMDF_OK);
+
+    cmdf_set_context(NULL);
+    cmdf_context_destroy(ctx);
+
+    return NULL;
+}
+
+static void check_concurrent_registration(void) {
+    struct dispatcher dispatchers[DISPATCHERS];
+    cmdf_catalog *catalog = cmdf_catalog_create(1);
+    static char names[ADDED_COMMANDS][8];
+    int started = 0, registered = 0, errors = 0, found = 0, i;
+
+    cmdf_catalog_register_command(catalog, do_where_top, "where", NULL, 0);
+    cmdf_catalog_freeze(catalog);
+
+    for (i = 0; i < DISPATCHERS; i++) {
+        dispatchers[i].catalog = catalog;
+        dispatchers[i].started = &started;
+        dispatchers[i].registered = &registered;
+        dispatchers[i].errors = dispatchers[i].found = 0;
+        pthread_create(&dispatchers[i].thread, NULL, dispatch, dispatchers + i);
+    }
+
+    /* Register new commands once all of them are dispatching */
+    while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < DISPATCHERS)
+        sched_yield();
+
+    for (i = 0; i < ADDED_COMMANDS; i++) {
+        sprintf(names[i], "c%d", i);
+        if (cmdf_catalog_register_command(catalog, do_where_top, names[i], NULL, 0) != CMDF_OK)
+            errors++;
+    }
+
+    __atomic_store_n(&registered, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < DISPATCHERS; i++) {
+        pthread_join(dispatchers[i].thread, NULL);
+        errors += dispatchers[i].errors;
+        found += dispatchers[i].found;
+    }
+
+    check(errors == 0, "commands dispatch while others are registered");
+    check(found == DISPATCHERS, "commands registered while others dispatch are found");
+
+    /* The versions the dispatchers read are all reclaimed once they're done */
+    cmdf_catalog_register_command(catalog, do_echo, "last", NULL, 0);
+    check(catalog_retired(catalog) == 0, "versions read during dispatch are freed afterwards");
+
+    cmdf_catalog_destroy(catalog);
+}
+
+int main(void) {
+    /* Give every context the same window width */
+    setenv("COLUMNS", "80", 1);
+    setenv("LINES", "24", 1);
+
+    check_batch();
+    check_feed();
+    check_buffering();
+    check_window_size();
+    check_help_wrapping();
+    check_listing();
+    check_glob();
+    check_apropos();
+    check_edit_distance();
+    check_suggestions();
+    check_json();
+    check_jobs();
+    check_server();
+    check_completion();
+    check_paste();
+    check_reclamation();
+    check_concurrent_registration();
+
+    printf("%d checks, %d failed\n", checks, failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * c_contexts.c - A test program for libcmdf's interpreter contexts
+ * Public domain; no warrenty applied, use at your own risk!
+ *
+ * License:
+ * --------
+ * This software is dual-licensed to the public domain and under the following license: 
+ * you are granted a perpetual, irrevocable license to copy, modify, 
+ * publish and distribute this file as you see fit.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#define LIBCMDF_IMPL
+#include "libcmdf.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define SHELL_COUNT 4
+#define COUNT_HELP "Count up to the given number, printing the name of the shell."
+
+static CMDF_RETURN do_count(cmdf_arglist *arglist) {
+    int i, limit = arglist ? atoi(arglist->args[0]) : 3;
+
+    /* Inside a callback, the context-less functions work with the dispatching context */
+    for (i = 1; i <= limit; i++)
+        fprintf(cmdf_get_output(), "%s%d\n", cmdf_get_prompt(), i);
+
+    return CMDF_OK;
+}
+
+static void *run_shell(void *arg) {
+    static const char *lines[] = { "count 3", "count 2 && count 1", "exit", "count 5" };
+    cmdf_context *ctx = (cmdf_context *)arg;
+
+    cmdf_exec_batch_ctx(ctx, lines, sizeof(lines) / sizeof(lines[0]), NULL);
+
+    return NULL;
+}
+
+int main(void) {
+    static const char *prompts[SHELL_COUNT] = { "shell-a> ", "shell-b> ", "shell-c> ", "shell-d> " };
+    cmdf_context *contexts[SHELL_COUNT];
+    pthread_t threads[SHELL_COUNT];
+    cmdf_catalog *catalog;
+    int i;
+
+    /* Register the commands once, in a catalog all of the shells share */
+    if (!(catalog = cmdf_catalog_create(1)))
+        return 1;
+
+    cmdf_catalog_register_command(catalog, do_count, "count", COUNT_HELP, 0);
+    cmdf_catalog_freeze(catalog);
+
+    /* Run one independent interpreter per thread */
+    for (i = 0; i < SHELL_COUNT; i++) {
+        if (!(contexts[i] = cmdf_context_create()))
+            return 1;
+
+        cmdf_init_catalog(contexts[i], catalog, prompts[i], NULL, NULL, NULL, 0);
+        pthread_create(&threads[i], NULL, run_shell, contexts[i]);
+    }
+
+    for (i = 0; i < SHELL_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+        cmdf_context_destroy(contexts[i]);
+    }
+
+    cmdf_catalog_destroy(catalog);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * c_feed.c - A test program for libcmdf's event loop interface
+ * Public domain; no warrenty applied, use at your own risk!
+ *
+ * License:
+ * --------
+ * This software is dual-licensed to the public domain and under the following license: 
+ * you are granted a perpetual, irrevocable license to copy, modify, 
+ * publish and distribute this file as you see fit.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#define LIBCMDF_IMPL
+#include "libcmdf.h"
+
+#include <stdio.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define PROG_INTRO "feed - A simple test program for libcmdf's event loop interface.\n" \
+                   "The event loop wakes up every second, even while waiting for input."
+#define TICKS_HELP "Print how many times the event loop woke up without any input."
+
+static unsigned long ticks = 0;
+
+/* Read available input and feed it to libcmdf */
+static CMDF_RETURN feed_input(int fd) {
+    #ifdef CMDF_READLINE_SUPPORT
+        return cmdf_feed_readline();
+    #else
+        char buff[64];
+        int nread = read(fd, buff, sizeof(buff));
+
+        return cmdf_feed(buff, nread > 0 ? (size_t)nread : 0);
+    #endif
+}
+
+static CMDF_RETURN do_ticks(cmdf_arglist *arglist) {
+    fprintf(cmdf_get_output(), "\nThe event loop ticked %lu times.\n", ticks);
+
+    return CMDF_OK;
+}
+
+int main(void) {
+    struct pollfd pfd;
+
+    cmdf_init("libcmdf-feed> ", PROG_INTRO, NULL, NULL, 0, 1);
+
+    /* Register our custom commands */
+    cmdf_register_command(do_ticks, "ticks", TICKS_HELP);
+
+    /* Run our own event loop, feeding libcmdf whatever input arrives */
+    pfd.fd = cmdf_get_input_fd();
+    pfd.events = POLLIN;
+
+    cmdf_feed_begin();
+    for (;;) {
+        if (poll(&pfd, 1, 1000) == 0) {
+            /* Notify every 10 idle seconds, without disturbing the prompt */
+            if (++ticks % 10 == 0)
+                cmdf_print_async("The event loop ticked %lu times.\n", ticks);
+
+            continue;
+        }
+
+        if (feed_input(pfd.fd) == CMDF_EXITED)
+            break;
+    }
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * c_jobs.c - A test program for libcmdf's background jobs
+ * Public domain; no warrenty applied, use at your own risk!
+ *
+ * License:
+ * --------
+ * This software is dual-licensed to the public domain and under the following license: 
+ * you are granted a perpetual, irrevocable license to copy, modify, 
+ * publish and distribute this file as you see fit.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#define CMDF_THREAD_SUPPORT
+#define LIBCMDF_IMPL
+#include "libcmdf.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define PROG_INTRO "jobs - A simple test program for libcmdf's background jobs.\n" \
+                   "Try 'sleep 3 &', then 'jobs', 'wait' and 'kill'.\n" \
+                   "Press Ctrl-C to interrupt a running command. 'sleep' gives up after 5 seconds."
+#define SLEEP_HELP "Sleep for the given number of seconds. Append '&' to run it in the background."
+#define COMPACT_HELP "Pretend to compact a database. Always runs in the background."
+#define STATS_HELP "Show the statistics of a command."
+
+static CMDF_RETURN do_sleep(cmdf_arglist *arglist) {
+    int seconds = arglist ? atoi(arglist->args[0]) : 1;
+
+    /* Sleep a second at a time, so Ctrl-C or 'kill' can stop us */
+    while (seconds-- > 0) {
+        if (cmdf_cancelled())
+            return CMDF_ERROR_CANCELLED;
+
+        sleep(1);
+    }
+
+    return CMDF_OK;
+}
+
+static CMDF_RETURN do_compact(cmdf_arglist *arglist) {
+    sleep(2);
+    fprintf(cmdf_get_output(), "\nCompaction finished!\n");
+
+    return CMDF_OK;
+}
+
+static CMDF_RETURN do_stats(cmdf_arglist *arglist) {
+    struct cmdf_command_stats stats;
+
+    if (!arglist || arglist->count != 1) {
+        fprintf(cmdf_get_output(), "Usage: stats <command>\n");
+        return CMDF_ERROR_ARGUMENT_ERROR;
+    }
+
+    if (cmdf_get_command_stats(arglist->args[0], &stats) != CMDF_OK) {
+        fprintf(cmdf_get_output(), "No such command: '%s'.\n", arglist->args[0]);
+        return CMDF_ERROR_ARGUMENT_ERROR;
+    }
+
+    fprintf(cmdf_get_output(), "Calls: %lu, cancelled: %lu, overruns: %lu, total: %lu ms, longest: %lu ms\n",
+            stats.calls, stats.cancellations, stats.overruns, stats.total_ms, stats.max_ms);
+
+    return CMDF_OK;
+}
+
+int main(void) {
+    cmdf_init("libcmdf-jobs> ", PROG_INTRO, NULL, NULL, 0, 1);
+
+    /* Register our custom commands */
+    cmdf_register_command(do_sleep, "sleep", SLEEP_HELP);
+    cmdf_register_command_ex(do_compact, "compact", COMPACT_HELP, CMDF_COMMAND_ASYNC);
+    cmdf_register_command(do_stats, "stats", STATS_HELP);
+
+    /* Don't let anyone sleep for too long */
+    cmdf_set_command_timeout("sleep", 5);
+
+    cmdf_commandloop();
+
+    return 0;
+}
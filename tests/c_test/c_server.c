@@ -0,0 +1,86 @@
+/*
+ * c_server.c - A test program for libcmdf's Unix domain socket server
+ * Public domain; no warrenty applied, use at your own risk!
+ *
+ * License:
+ * --------
+ * This software is dual-licensed to the public domain and under the following license: 
+ * you are granted a perpetual, irrevocable license to copy, modify, 
+ * publish and distribute this file as you see fit.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#define CMDF_SERVER_SUPPORT
+#define LIBCMDF_IMPL
+#include "libcmdf.h"
+
+#include <stdio.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define PROG_INTRO "server - A simple test program for libcmdf's socket server.\n" \
+                   "Connect with e.g. 'socat - UNIX-CONNECT:<path>' while this console runs."
+#define SUBMENU_INTRO "This is a submenu!"
+#define DEFAULT_PATH "/tmp/libcmdf-test.sock"
+
+static unsigned long greetings = 0;
+
+static CMDF_RETURN do_hello(cmdf_arglist *arglist) {
+    /* Print to libcmdf's output, so the output reaches the session */
+    fprintf(cmdf_get_output(), "\nHello, world! (greeting #%lu)\n", ++greetings);
+
+    return CMDF_OK;
+}
+
+static CMDF_RETURN do_submenu(cmdf_arglist *arglist) {
+    cmdf_init("libcmdf-server/submenu> ", SUBMENU_INTRO, NULL, NULL, 0, 1);
+
+    /* Register our custom commands. Don't call cmdf_commandloop(): the
+     * following lines are fed to the submenu. */
+    cmdf_register_command(do_hello, "hello", NULL);
+
+    return CMDF_OK;
+}
+
+int main(int argc, char **argv) {
+    struct pollfd pfds[2];
+    cmdf_server *server;
+    char buff[64];
+    int nread;
+
+    cmdf_init("libcmdf-server> ", PROG_INTRO, NULL, NULL, 0, 1);
+
+    /* Register our custom commands */
+    cmdf_register_command(do_hello, "hello", NULL);
+    cmdf_register_command(do_submenu, "submenu", NULL);
+
+    /* Serve the same commands on a socket, next to the local console */
+    if (!(server = cmdf_server_open(argc > 1 ? argv[1] : DEFAULT_PATH))) {
+        perror("cmdf_server_open");
+        return 1;
+    }
+
+    pfds[0].fd = cmdf_get_input_fd();
+    pfds[0].events = POLLIN;
+    pfds[1].fd = cmdf_server_get_fd(server);
+    pfds[1].events = POLLIN;
+
+    cmdf_feed_begin();
+    for (;;) {
+        if (poll(pfds, 2, -1) == -1)
+            continue;
+
+        if (pfds[1].revents & POLLIN)
+            cmdf_server_dispatch(server, 0);
+
+        if (pfds[0].revents & (POLLIN | POLLHUP)) {
+            nread = read(pfds[0].fd, buff, sizeof(buff));
+            if (cmdf_feed(buff, nread > 0 ? (size_t)nread : 0) == CMDF_EXITED)
+                break;
+        }
+    }
+
+    cmdf_server_close(server);
+
+    return 0;
+}
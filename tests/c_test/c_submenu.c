@@ -11,6 +11,7 @@
  */
 
 #define _CRT_SECURE_NO_WARNINGS
+#define CMDF_LINEEDIT_SUPPORT
 #define LIBCMDF_IMPL
 #include "libcmdf.h"
 
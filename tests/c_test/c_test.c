@@ -11,6 +11,8 @@
  */
 
 #define _CRT_SECURE_NO_WARNINGS
+#define CMDF_LINEEDIT_SUPPORT
+#define CMDF_APROPOS_SUPPORT
 #define LIBCMDF_IMPL
 #include "libcmdf.h"
 
@@ -44,12 +46,27 @@ static CMDF_RETURN do_printargs(cmdf_arglist *arglist) {
     return CMDF_OK;
 }
 
+static void complete_printargs(cmdf_completions *completions, size_t argindex) {
+    static const char *colors[] = { "red", "green", "blue", "cyan", "magenta", "yellow" };
+    static const char *shapes[] = { "circle", "square", "triangle" };
+    size_t i;
+
+    /* First argument is a color, the rest are shapes */
+    if (argindex == 0)
+        for (i = 0; i < sizeof(colors) / sizeof(colors[0]); i++)
+            cmdf_add_completion(completions, colors[i]);
+    else
+        for (i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++)
+            cmdf_add_completion(completions, shapes[i]);
+}
+
 int main(void) {
     cmdf_init("libcmdf-test> ", PROG_INTRO, NULL, NULL, 0, 1);
 
     /* Register our custom commands */
     cmdf_register_command(do_hello, "hello", NULL);
     cmdf_register_command(do_printargs, "printargs", PRINTARGS_HELP);
+    cmdf_set_command_completer("printargs", complete_printargs, 0);
 
     cmdf_commandloop();
 
@@ -0,0 +1,85 @@
+/*
+ * cpp_coro.cpp - A test program for libcmdf's C++20 coroutine commands
+ * Public domain; no warrenty applied, use at your own risk!
+ *
+ * License:
+ * --------
+ * This software is dual-licensed to the public domain and under the following license: 
+ * you are granted a perpetual, irrevocable license to copy, modify, 
+ * publish and distribute this file as you see fit.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#define CMDF_COROUTINE_SUPPORT
+#define LIBCMDF_IMPL
+#include "libcmdf.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+#define PROG_INTRO "coro - A simple test program for libcmdf's coroutine commands.\n" \
+                   "Try 'countdown 5', and keep typing commands while it runs."
+#define SLEEP_HELP "Sleep for the given number of seconds, without blocking the prompt."
+#define COUNTDOWN_HELP "Count down from the given number, once a second."
+
+static cmdf::task do_sleep(std::vector<std::string> args) {
+    int seconds = args.empty() ? 1 : atoi(args[0].c_str());
+
+    co_await cmdf::sleep_for(std::chrono::seconds(seconds));
+    cmdf_print_async("Slept for %d seconds.\n", seconds);
+
+    co_return CMDF_OK;
+}
+
+static cmdf::task do_countdown(std::vector<std::string> args) {
+    int count = args.empty() ? 3 : atoi(args[0].c_str());
+
+    if (count <= 0) {
+        fprintf(cmdf_get_output(), "Nothing to count down from!\n");
+        co_return CMDF_ERROR_ARGUMENT_ERROR;
+    }
+
+    while (count--) {
+        co_await cmdf::sleep_for(std::chrono::seconds(1));
+        cmdf_print_async(count ? "%d...\n" : "Liftoff!\n", count);
+    }
+
+    co_return CMDF_OK;
+}
+
+int main() {
+    cmdf::scheduler &scheduler = cmdf::scheduler::current();
+    std::vector<pollfd> fds;
+    char buff[CMDF_MAX_INPUT_BUFFER_LENGTH];
+    ssize_t nread;
+
+    cmdf_init("libcmdf-coro> ", PROG_INTRO, NULL, NULL, 0, 1);
+
+    /* Register our custom commands */
+    cmdf::register_command<do_sleep>("sleep", SLEEP_HELP);
+    cmdf::register_command<do_countdown>("countdown", COUNTDOWN_HELP);
+
+    /* Wait for both input and suspended commands */
+    cmdf_feed_begin();
+    for (;;) {
+        fds.assign(1, pollfd{ cmdf_get_input_fd(), POLLIN, 0 });
+        scheduler.add_pollfds(fds);
+
+        if (poll(fds.data(), fds.size(), scheduler.timeout()) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        if (fds[0].revents) {
+            nread = read(fds[0].fd, buff, sizeof(buff));
+            if (cmdf_feed(buff, nread > 0 ? (size_t)nread : 0) == CMDF_EXITED)
+                break;
+        }
+
+        scheduler.run(fds.data(), fds.size());
+    }
+
+    return 0;
+}